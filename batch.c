@@ -0,0 +1,282 @@
+#include "diskogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+    #include <pthread.h>
+    #include <unistd.h>
+#endif
+
+/*
+ * Concurrent scans for --stdin --batch.
+ *
+ * Paths are queued in input order and picked up by a fixed set of job
+ * threads, each scanning one path at a time. Results are handed back on
+ * the thread that submits, either in input order (a finished path waits
+ * for those before it) or as they complete with --unordered. At most a
+ * small window of paths is queued or held back at once, so memory does not
+ * grow with the number of paths read from stdin.
+ */
+
+/* Paths queued or waiting for delivery, per job thread */
+#define BATCH_WINDOW_PER_JOB 4
+
+typedef enum {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE
+} job_state_t;
+
+typedef struct batch_job {
+    struct batch_job *next;     /* submission order */
+    histogram_t *hists[MAX_SCAN_HISTOGRAMS];
+    size_t count;
+    int status;
+    job_state_t state;
+    char path[];
+} batch_job_t;
+
+struct batch_runner {
+    scan_options_t opts;
+    int unordered;
+    batch_result_fn on_result;
+    void *ctx;
+
+    batch_job_t *head;          /* oldest job not yet delivered */
+    batch_job_t *tail;
+    size_t in_window;           /* jobs between head and tail */
+    size_t window;
+#ifndef _WIN32
+    batch_job_t *next_queued;   /* first job no thread has taken */
+    int closing;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;   /* a job was queued, or closing */
+    pthread_cond_t done_cond;   /* a job finished */
+    pthread_t *threads;
+    size_t thread_count;
+#endif
+};
+
+/* Scan one job; with --dedup-inodes each path is deduplicated on its own */
+static void run_job(batch_job_t *job, const scan_options_t *opts) {
+    if (opts->dedup) inode_set_clear(opts->dedup);
+    job->status = scan_directory_multi(job->path, job->hists, job->count, opts);
+}
+
+static void deliver(batch_runner_t *runner, batch_job_t *job) {
+    runner->on_result(runner->ctx, job->path, job->hists, job->count, job->status);
+    free(job);
+}
+
+#ifndef _WIN32
+
+typedef struct {
+    batch_runner_t *runner;
+    scan_options_t opts;        /* private inode set when deduplicating */
+} job_thread_t;
+
+static void* job_thread_main(void *arg) {
+    job_thread_t *self = (job_thread_t *)arg;
+    batch_runner_t *runner = self->runner;
+
+    pthread_mutex_lock(&runner->lock);
+    for (;;) {
+        batch_job_t *job;
+
+        while (!runner->next_queued && !runner->closing) {
+            pthread_cond_wait(&runner->work_cond, &runner->lock);
+        }
+        job = runner->next_queued;
+        if (!job) break;
+        runner->next_queued = job->next;
+        job->state = JOB_RUNNING;
+        pthread_mutex_unlock(&runner->lock);
+
+        run_job(job, &self->opts);
+
+        pthread_mutex_lock(&runner->lock);
+        job->state = JOB_DONE;
+        pthread_cond_signal(&runner->done_cond);
+    }
+    pthread_mutex_unlock(&runner->lock);
+
+    inode_set_destroy(self->opts.dedup);
+    free(self);
+    return NULL;
+}
+
+/* Unlink the jobs that may be delivered now; called with the lock held */
+static batch_job_t* take_finished(batch_runner_t *runner) {
+    batch_job_t *ready = NULL;
+    batch_job_t **ready_tail = &ready;
+    batch_job_t **link = &runner->head;
+    batch_job_t *prev = NULL;
+
+    while (*link) {
+        batch_job_t *job = *link;
+        if (job->state != JOB_DONE) {
+            if (!runner->unordered) break;
+            prev = job;
+            link = &job->next;
+            continue;
+        }
+        *link = job->next;
+        if (runner->tail == job) runner->tail = prev;
+        runner->in_window--;
+        job->next = NULL;
+        *ready_tail = job;
+        ready_tail = &job->next;
+    }
+    return ready;
+}
+
+/* Deliver everything that is ready, waiting while more than max_in_window jobs remain */
+static void flush_finished(batch_runner_t *runner, size_t max_in_window) {
+    for (;;) {
+        batch_job_t *ready;
+
+        pthread_mutex_lock(&runner->lock);
+        ready = take_finished(runner);
+        while (!ready && runner->in_window > max_in_window) {
+            pthread_cond_wait(&runner->done_cond, &runner->lock);
+            ready = take_finished(runner);
+        }
+        pthread_mutex_unlock(&runner->lock);
+        if (!ready) return;
+
+        while (ready) {
+            batch_job_t *next = ready->next;
+            deliver(runner, ready);
+            ready = next;
+        }
+    }
+}
+
+static size_t resolve_job_count(size_t jobs) {
+    if (jobs > 0) return jobs;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+#endif
+
+/*
+ * Create a runner with jobs concurrent scans (0 = one per online CPU),
+ * each using opts. on_result receives every path exactly once, on the
+ * thread calling batch_runner_submit() or batch_runner_finish().
+ */
+batch_runner_t* batch_runner_create(size_t jobs, int unordered, const scan_options_t *opts,
+                                    batch_result_fn on_result, void *ctx) {
+    batch_runner_t *runner = calloc(1, sizeof(batch_runner_t));
+    if (!runner) return NULL;
+    runner->opts = *opts;
+    runner->unordered = unordered;
+    runner->on_result = on_result;
+    runner->ctx = ctx;
+
+#ifdef _WIN32
+    /* No thread pool on Windows: each path is scanned as it is submitted */
+    (void)jobs;
+    runner->window = 1;
+#else
+    size_t wanted = resolve_job_count(jobs);
+    runner->threads = calloc(wanted, sizeof(pthread_t));
+    if (!runner->threads) {
+        free(runner);
+        return NULL;
+    }
+    pthread_mutex_init(&runner->lock, NULL);
+    pthread_cond_init(&runner->work_cond, NULL);
+    pthread_cond_init(&runner->done_cond, NULL);
+
+    for (size_t i = 0; i < wanted; i++) {
+        job_thread_t *self = malloc(sizeof(job_thread_t));
+        if (!self) break;
+        self->runner = runner;
+        self->opts = *opts;
+        self->opts.dedup = opts->dedup ? inode_set_create() : NULL;
+        if ((opts->dedup && !self->opts.dedup) ||
+            pthread_create(&runner->threads[runner->thread_count], NULL,
+                           job_thread_main, self) != 0) {
+            inode_set_destroy(self->opts.dedup);
+            free(self);
+            break;
+        }
+        runner->thread_count++;
+    }
+    if (runner->thread_count == 0) {
+        pthread_mutex_destroy(&runner->lock);
+        pthread_cond_destroy(&runner->work_cond);
+        pthread_cond_destroy(&runner->done_cond);
+        free(runner->threads);
+        free(runner);
+        return NULL;
+    }
+    runner->window = runner->thread_count * BATCH_WINDOW_PER_JOB;
+#endif
+    return runner;
+}
+
+/*
+ * Queue a scan of path into hists, which the runner owns until they are
+ * passed to on_result. Blocks while the window is full, delivering results
+ * meanwhile. Returns -1 if out of memory (hists are left to the caller).
+ */
+int batch_runner_submit(batch_runner_t *runner, const char *path,
+                        histogram_t **hists, size_t count) {
+    size_t len = strlen(path);
+    batch_job_t *job;
+
+    if (count > MAX_SCAN_HISTOGRAMS) return -1;
+    job = malloc(sizeof(batch_job_t) + len + 1);
+    if (!job) return -1;
+    job->next = NULL;
+    memcpy(job->hists, hists, sizeof(histogram_t *) * count);
+    job->count = count;
+    job->status = 0;
+    job->state = JOB_QUEUED;
+    memcpy(job->path, path, len + 1);
+
+#ifdef _WIN32
+    run_job(job, &runner->opts);
+    deliver(runner, job);
+#else
+    flush_finished(runner, runner->window - 1);
+
+    pthread_mutex_lock(&runner->lock);
+    if (runner->tail) {
+        runner->tail->next = job;
+    } else {
+        runner->head = job;
+    }
+    runner->tail = job;
+    runner->in_window++;
+    if (!runner->next_queued) runner->next_queued = job;
+    pthread_cond_signal(&runner->work_cond);
+    pthread_mutex_unlock(&runner->lock);
+#endif
+    return 0;
+}
+
+/* Wait for every queued path, deliver the remaining results and free the runner */
+void batch_runner_finish(batch_runner_t *runner) {
+    if (!runner) return;
+#ifndef _WIN32
+    flush_finished(runner, 0);
+
+    pthread_mutex_lock(&runner->lock);
+    runner->closing = 1;
+    pthread_cond_broadcast(&runner->work_cond);
+    pthread_mutex_unlock(&runner->lock);
+    for (size_t i = 0; i < runner->thread_count; i++) {
+        pthread_join(runner->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&runner->lock);
+    pthread_cond_destroy(&runner->work_cond);
+    pthread_cond_destroy(&runner->done_cond);
+    free(runner->threads);
+#endif
+    free(runner);
+}
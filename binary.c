@@ -0,0 +1,502 @@
+#include "diskogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Columnar binary export (--binary) and its reader.
+ *
+ * A stream of histograms meant to be loaded without parsing: each bucket
+ * column is a contiguous array of 8-byte little-endian integers, 8-byte
+ * aligned from the start of the file, so a mapped file can be used in
+ * place. The stream is written as results arrive, with no index up front.
+ *
+ *   header      BINARY_HEADER_SIZE bytes: magic, version, header size
+ *   blocks      one per histogram, BINARY_BLOCK_HEADER_SIZE bytes of fields
+ *               (see below), then NUL-terminated strings and the columns
+ *               starts (int64 seconds), bytes, files and allocated bytes
+ *   end         an 8-byte zero, where the next block size would be
+ *
+ * Offsets inside a block are relative to the start of the block, and the
+ * block size is a multiple of 8. A stream without the end marker was cut
+ * short.
+ *
+ * With BLOCK_TOP set (--largest) the allocated column is followed by the
+ * ranked entries: their count, then count-long columns of bucket index,
+ * kind (0 = file, 1 = directory), bytes and path offset, then the paths.
+ * Entries come grouped by bucket, each kind largest first. Readers that
+ * do not know the flag skip the section with the rest of the block.
+ */
+
+#ifdef _WIN32
+    #include <fcntl.h>
+    #include <io.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#define BINARY_MAGIC "DSKGHIST"
+#define BINARY_VERSION 1
+#define BINARY_HEADER_SIZE 16
+#define BINARY_BLOCK_HEADER_SIZE 144
+
+/* Stream header field offsets */
+#define HDR_VERSION         8
+#define HDR_HEADER_SIZE     12
+
+/* Block field offsets */
+#define BLK_SIZE            0
+#define BLK_BUCKET_COUNT    8
+#define BLK_INTERVAL        16
+#define BLK_MODE            20
+#define BLK_FLAGS           24
+#define BLK_TOP_N           28
+#define BLK_TOTAL_BYTES     32
+#define BLK_TOTAL_ALLOCATED 40
+#define BLK_TOTAL_FILES     48
+#define BLK_SCAN_START      56
+#define BLK_SCAN_END        64
+#define BLK_ERROR_COUNT     72
+#define BLK_DIRS_SCANNED    80
+#define BLK_LABEL           88
+#define BLK_TITLE           96
+#define BLK_LAST_ERROR      104
+#define BLK_STARTS          112
+#define BLK_BYTES           120
+#define BLK_FILES           128
+#define BLK_ALLOCATED       136
+
+/* Block flags */
+#define BLOCK_DISK_USAGE    1
+#define BLOCK_TOP           2
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_le64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint64_t get_le64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+/* ---- Writing ---- */
+
+/* Stream header; on Windows stdout is switched out of text mode first */
+void export_binary_start(void) {
+    unsigned char header[BINARY_HEADER_SIZE];
+
+#ifdef _WIN32
+    fflush(stdout);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    memcpy(header, BINARY_MAGIC, 8);
+    put_le32(header + HDR_VERSION, BINARY_VERSION);
+    put_le32(header + HDR_HEADER_SIZE, BINARY_HEADER_SIZE);
+    fwrite(header, 1, sizeof(header), stdout);
+}
+
+/* A NUL-terminated string padded with zeros to a multiple of 8 bytes */
+static void output_padded_string(output_t *out, const char *str) {
+    static const char zeros[8] = {0};
+    size_t len = strlen(str) + 1;
+    output_write(out, str, len);
+    output_write(out, zeros, align8(len) - len);
+}
+
+static void output_le64(output_t *out, uint64_t value) {
+    unsigned char bytes[8];
+    put_le64(bytes, value);
+    output_write(out, (const char *)bytes, sizeof(bytes));
+}
+
+/* Ranked entries of all buckets, and the bytes their padded paths take */
+static uint64_t count_top_entries(const histogram_t *hist, size_t *strings_size) {
+    uint64_t count = 0;
+
+    *strings_size = 0;
+    for (size_t i = 0; i < hist->bucket_count; i++) {
+        const time_bucket_t *bucket = &hist->buckets[i];
+        for (size_t j = 0; j < bucket->top_file_count; j++) {
+            *strings_size += align8(strlen(bucket->top_files[j].path) + 1);
+        }
+        for (size_t j = 0; j < bucket->top_dir_count; j++) {
+            *strings_size += align8(strlen(bucket->top_dirs[j].path) + 1);
+        }
+        count += bucket->top_file_count + bucket->top_dir_count;
+    }
+    return count;
+}
+
+/* The BLOCK_TOP section, starting at offset within its block */
+static void output_top_section(output_t *out, const histogram_t *hist, size_t offset,
+                               uint64_t count) {
+    size_t path_offset = offset + 8 + 4 * 8 * (size_t)count;
+
+    output_le64(out, count);
+    for (size_t i = 0; i < hist->bucket_count; i++) {
+        const time_bucket_t *bucket = &hist->buckets[i];
+        for (size_t j = 0; j < bucket->top_file_count + bucket->top_dir_count; j++) {
+            output_le64(out, i);
+        }
+    }
+    for (size_t i = 0; i < hist->bucket_count; i++) {
+        const time_bucket_t *bucket = &hist->buckets[i];
+        for (size_t j = 0; j < bucket->top_file_count; j++) output_le64(out, 0);
+        for (size_t j = 0; j < bucket->top_dir_count; j++) output_le64(out, 1);
+    }
+    for (size_t i = 0; i < hist->bucket_count; i++) {
+        const time_bucket_t *bucket = &hist->buckets[i];
+        for (size_t j = 0; j < bucket->top_file_count; j++) {
+            output_le64(out, bucket->top_files[j].bytes);
+        }
+        for (size_t j = 0; j < bucket->top_dir_count; j++) {
+            output_le64(out, bucket->top_dirs[j].bytes);
+        }
+    }
+    for (size_t i = 0; i < hist->bucket_count; i++) {
+        const time_bucket_t *bucket = &hist->buckets[i];
+        for (size_t j = 0; j < bucket->top_file_count; j++) {
+            output_le64(out, path_offset);
+            path_offset += align8(strlen(bucket->top_files[j].path) + 1);
+        }
+        for (size_t j = 0; j < bucket->top_dir_count; j++) {
+            output_le64(out, path_offset);
+            path_offset += align8(strlen(bucket->top_dirs[j].path) + 1);
+        }
+    }
+    for (size_t i = 0; i < hist->bucket_count; i++) {
+        const time_bucket_t *bucket = &hist->buckets[i];
+        for (size_t j = 0; j < bucket->top_file_count; j++) {
+            output_padded_string(out, bucket->top_files[j].path);
+        }
+        for (size_t j = 0; j < bucket->top_dir_count; j++) {
+            output_padded_string(out, bucket->top_dirs[j].path);
+        }
+    }
+}
+
+/*
+ * One histogram; label is the path or other subject it describes. Empty
+ * histograms are skipped, as by the other batch exporters.
+ */
+void export_binary_item(const histogram_t *hist, const char *title, const char *label) {
+    if (!hist || hist->bucket_count == 0) return;
+
+    unsigned char header[BINARY_BLOCK_HEADER_SIZE];
+    uint64_t n = hist->bucket_count;
+    size_t label_offset = BINARY_BLOCK_HEADER_SIZE;
+    size_t title_offset = label_offset + align8(strlen(label) + 1);
+    size_t error_offset = title_offset + align8(strlen(title) + 1);
+    size_t starts_offset = error_offset + align8(strlen(hist->last_error) + 1);
+    size_t top_offset = starts_offset + 4 * 8 * n;
+    size_t strings_size = 0;
+    uint64_t top_count = hist->top_n > 0 ? count_top_entries(hist, &strings_size) : 0;
+    size_t size = top_offset;
+    output_t out;
+
+    if (hist->top_n > 0) size += 8 + 4 * 8 * (size_t)top_count + strings_size;
+
+    memset(header, 0, sizeof(header));
+    put_le64(header + BLK_SIZE, size);
+    put_le64(header + BLK_BUCKET_COUNT, n);
+    put_le32(header + BLK_INTERVAL, (uint32_t)hist->interval);
+    put_le32(header + BLK_MODE, (uint32_t)hist->mode);
+    put_le32(header + BLK_FLAGS, (hist->disk_usage ? BLOCK_DISK_USAGE : 0) |
+                                 (hist->top_n > 0 ? BLOCK_TOP : 0));
+    put_le32(header + BLK_TOP_N, (uint32_t)hist->top_n);
+    put_le64(header + BLK_TOTAL_BYTES, hist->total_bytes);
+    put_le64(header + BLK_TOTAL_ALLOCATED, hist->total_allocated);
+    put_le64(header + BLK_TOTAL_FILES, hist->total_files);
+    put_le64(header + BLK_SCAN_START, (uint64_t)(int64_t)hist->scan_start_time);
+    put_le64(header + BLK_SCAN_END, (uint64_t)(int64_t)hist->scan_end_time);
+    put_le64(header + BLK_ERROR_COUNT, hist->error_count);
+    put_le64(header + BLK_DIRS_SCANNED, hist->directories_scanned);
+    put_le64(header + BLK_LABEL, label_offset);
+    put_le64(header + BLK_TITLE, title_offset);
+    put_le64(header + BLK_LAST_ERROR, error_offset);
+    put_le64(header + BLK_STARTS, starts_offset);
+    put_le64(header + BLK_BYTES, starts_offset + 8 * n);
+    put_le64(header + BLK_FILES, starts_offset + 16 * n);
+    put_le64(header + BLK_ALLOCATED, starts_offset + 24 * n);
+
+    output_init(&out, stdout);
+    output_write(&out, (const char *)header, sizeof(header));
+    output_padded_string(&out, label);
+    output_padded_string(&out, title);
+    output_padded_string(&out, hist->last_error);
+    for (size_t i = 0; i < n; i++) {
+        output_le64(&out, (uint64_t)(int64_t)hist->buckets[i].start_time);
+    }
+    for (size_t i = 0; i < n; i++) output_le64(&out, hist->buckets[i].total_bytes);
+    for (size_t i = 0; i < n; i++) output_le64(&out, hist->buckets[i].file_count);
+    for (size_t i = 0; i < n; i++) output_le64(&out, hist->buckets[i].allocated_bytes);
+    if (hist->top_n > 0) output_top_section(&out, hist, top_offset, top_count);
+    output_flush(&out);
+}
+
+void export_binary_end(void) {
+    unsigned char end[8];
+    put_le64(end, 0);
+    fwrite(end, 1, sizeof(end), stdout);
+    fflush(stdout);
+}
+
+/* ---- Reading ---- */
+
+struct binary_file {
+    const unsigned char *data;
+    size_t size;
+    int mapped;             /* data is an mmap()ed view, not a heap copy */
+    size_t next;            /* offset of the next block */
+};
+
+/* Load the whole file: mapped where possible, read into memory otherwise */
+static int binary_load(binary_file_t *file, const char *filename) {
+#ifdef _WIN32
+    FILE *f = fopen(filename, "rb");
+    long size;
+    unsigned char *data;
+
+    if (!f) return -1;
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        return -1;
+    }
+    data = malloc(size > 0 ? (size_t)size : 1);
+    if (!data || fread(data, 1, (size_t)size, f) != (size_t)size) {
+        free(data);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    file->data = data;
+    file->size = (size_t)size;
+    file->mapped = 0;
+    return 0;
+#else
+    struct stat st;
+    void *data;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || st.st_size < BINARY_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+    file->data = data;
+    file->size = (size_t)st.st_size;
+    file->mapped = 1;
+    return 0;
+#endif
+}
+
+/*
+ * Open a --binary export. Columns are handed out in place, so this fails
+ * on big-endian hosts, where they would need converting.
+ */
+binary_file_t* binary_open(const char *filename) {
+    const uint16_t probe = 1;
+    binary_file_t *file;
+
+    if (*(const unsigned char *)&probe != 1) return NULL;
+    file = calloc(1, sizeof(binary_file_t));
+    if (!file) return NULL;
+    if (binary_load(file, filename) != 0) {
+        free(file);
+        return NULL;
+    }
+
+    if (file->size < BINARY_HEADER_SIZE || memcmp(file->data, BINARY_MAGIC, 8) != 0 ||
+        get_le32(file->data + HDR_VERSION) != BINARY_VERSION ||
+        get_le32(file->data + HDR_HEADER_SIZE) < BINARY_HEADER_SIZE ||
+        get_le32(file->data + HDR_HEADER_SIZE) % 8 != 0) {
+        binary_close(file);
+        return NULL;
+    }
+    file->next = get_le32(file->data + HDR_HEADER_SIZE);
+    return file;
+}
+
+void binary_close(binary_file_t *file) {
+    if (!file) return;
+#ifndef _WIN32
+    if (file->mapped) {
+        munmap((void *)file->data, file->size);
+    } else
+#endif
+    {
+        free((void *)file->data);
+    }
+    free(file);
+}
+
+/* A string at offset inside a block of size bytes, or NULL if it runs past it */
+static const char* block_string(const unsigned char *block, uint64_t size, uint64_t offset) {
+    if (offset < BINARY_BLOCK_HEADER_SIZE || offset >= size) return NULL;
+    if (!memchr(block + offset, '\0', (size_t)(size - offset))) return NULL;
+    return (const char *)(block + offset);
+}
+
+/* A column of count 8-byte values at offset inside a block of size bytes */
+static const void* block_column(const unsigned char *block, uint64_t size, uint64_t offset,
+                                uint64_t count) {
+    if (offset < BINARY_BLOCK_HEADER_SIZE || offset % 8 != 0 || offset > size ||
+        count > (size - offset) / 8) {
+        return NULL;
+    }
+    return block + offset;
+}
+
+/* Point hist at the BLOCK_TOP section at offset; -1 if it does not fit the block */
+static int read_top_section(const unsigned char *block, uint64_t size, uint64_t offset,
+                            binary_histogram_t *hist) {
+    const uint64_t *count = block_column(block, size, offset, 1);
+    if (!count) return -1;
+
+    hist->top_count = get_le64(block + offset);
+    if (hist->top_count > (size - offset - 8) / 32) return -1;
+    hist->top_buckets = block_column(block, size, offset + 8, hist->top_count);
+    hist->top_kinds = block_column(block, size, offset + 8 + 8 * hist->top_count,
+                                   hist->top_count);
+    hist->top_bytes = block_column(block, size, offset + 8 + 16 * hist->top_count,
+                                   hist->top_count);
+    hist->top_paths = block_column(block, size, offset + 8 + 24 * hist->top_count,
+                                   hist->top_count);
+    hist->top_base = (const char *)block;
+    if (!hist->top_buckets || !hist->top_kinds || !hist->top_bytes || !hist->top_paths) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < hist->top_count; i++) {
+        if (hist->top_buckets[i] >= hist->bucket_count || hist->top_kinds[i] > 1 ||
+            !block_string(block, size, hist->top_paths[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Next histogram of the stream. Returns 1 and fills hist, whose strings
+ * and columns point into the file until binary_close(); 0 at the end
+ * marker; -1 if the file is damaged or cut short.
+ */
+int binary_next(binary_file_t *file, binary_histogram_t *hist) {
+    const unsigned char *block;
+    uint64_t size;
+    uint32_t flags;
+
+    if (file->next > file->size || file->size - file->next < 8) return -1;
+    block = file->data + file->next;
+    size = get_le64(block + BLK_SIZE);
+    if (size == 0) return 0;
+    if (size < BINARY_BLOCK_HEADER_SIZE || size % 8 != 0 || size > file->size - file->next) {
+        return -1;
+    }
+
+    flags = get_le32(block + BLK_FLAGS);
+    hist->bucket_count = get_le64(block + BLK_BUCKET_COUNT);
+    hist->interval = (interval_t)get_le32(block + BLK_INTERVAL);
+    hist->mode = (grouping_mode_t)get_le32(block + BLK_MODE);
+    hist->disk_usage = (flags & BLOCK_DISK_USAGE) != 0;
+    hist->total_bytes = get_le64(block + BLK_TOTAL_BYTES);
+    hist->total_allocated = get_le64(block + BLK_TOTAL_ALLOCATED);
+    hist->total_files = get_le64(block + BLK_TOTAL_FILES);
+    hist->scan_start_time = (time_t)(int64_t)get_le64(block + BLK_SCAN_START);
+    hist->scan_end_time = (time_t)(int64_t)get_le64(block + BLK_SCAN_END);
+    hist->error_count = get_le64(block + BLK_ERROR_COUNT);
+    hist->directories_scanned = get_le64(block + BLK_DIRS_SCANNED);
+    hist->label = block_string(block, size, get_le64(block + BLK_LABEL));
+    hist->title = block_string(block, size, get_le64(block + BLK_TITLE));
+    hist->last_error = block_string(block, size, get_le64(block + BLK_LAST_ERROR));
+    hist->starts = block_column(block, size, get_le64(block + BLK_STARTS), hist->bucket_count);
+    hist->bytes = block_column(block, size, get_le64(block + BLK_BYTES), hist->bucket_count);
+    hist->files = block_column(block, size, get_le64(block + BLK_FILES), hist->bucket_count);
+    hist->allocated = block_column(block, size, get_le64(block + BLK_ALLOCATED),
+                                   hist->bucket_count);
+    if (!hist->label || !hist->title || !hist->last_error || !hist->starts ||
+        !hist->bytes || !hist->files || !hist->allocated ||
+        (unsigned)hist->interval > INTERVAL_YEAR || (unsigned)hist->mode > GROUP_BY_ATIME) {
+        return -1;
+    }
+
+    hist->top_n = 0;
+    hist->top_count = 0;
+    hist->top_buckets = hist->top_kinds = hist->top_bytes = hist->top_paths = NULL;
+    hist->top_base = NULL;
+    if (flags & BLOCK_TOP) {
+        hist->top_n = get_le32(block + BLK_TOP_N);
+        if (read_top_section(block, size, get_le64(block + BLK_ALLOCATED) +
+                             8 * hist->bucket_count, hist) != 0) {
+            return -1;
+        }
+    }
+
+    file->next += (size_t)size;
+    return 1;
+}
+
+/* A finalized histogram_t holding a copy of hist, for the exporters */
+histogram_t* binary_histogram_load(const binary_histogram_t *hist) {
+    histogram_t *result = histogram_create(hist->interval);
+    if (!result) return NULL;
+
+    if (hist->bucket_count > result->bucket_capacity) {
+        time_bucket_t *buckets;
+        if (hist->bucket_count > SIZE_MAX / sizeof(time_bucket_t) ||
+            !(buckets = realloc(result->buckets, sizeof(time_bucket_t) * hist->bucket_count))) {
+            histogram_destroy(result);
+            return NULL;
+        }
+        result->buckets = buckets;
+        result->bucket_capacity = (size_t)hist->bucket_count;
+    }
+    for (size_t i = 0; i < hist->bucket_count; i++) {
+        result->buckets[i].start_time = (time_t)hist->starts[i];
+        result->buckets[i].total_bytes = hist->bytes[i];
+        result->buckets[i].file_count = hist->files[i];
+        result->buckets[i].allocated_bytes = hist->allocated[i];
+    }
+    result->bucket_count = (size_t)hist->bucket_count;
+    result->mode = hist->mode;
+    result->disk_usage = hist->disk_usage;
+    result->total_bytes = hist->total_bytes;
+    result->total_allocated = hist->total_allocated;
+    result->total_files = hist->total_files;
+    result->scan_start_time = hist->scan_start_time;
+    result->scan_end_time = hist->scan_end_time;
+    result->error_count = hist->error_count;
+    result->directories_scanned = hist->directories_scanned;
+    snprintf(result->last_error, sizeof(result->last_error), "%s", hist->last_error);
+
+    if (hist->top_n > 0) {
+        histogram_set_top(result, (size_t)hist->top_n, 1u << hist->interval);
+        for (uint64_t i = 0; i < hist->top_count; i++) {
+            histogram_add_top(result, (time_t)hist->starts[hist->top_buckets[i]],
+                              hist->top_kinds[i] != 0, hist->top_bytes[i],
+                              hist->top_base + hist->top_paths[i]);
+        }
+    }
+    histogram_link_tops(result);
+    return result;
+}
@@ -0,0 +1,371 @@
+#include "diskogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/*
+ * Local-time bucket boundaries without a localtime()/mktime() per file.
+ *
+ * The cache is a sorted table of local month starts, built a whole year at
+ * a time for the years files actually fall in and extended lazily. Each
+ * month also records its UTC offset and, for months containing a DST
+ * change, the instant of the change, so day and hour boundaries inside a
+ * month are plain arithmetic. Month and year buckets are a table lookup.
+ */
+
+#define SECONDS_PER_HOUR (60 * 60)
+#define SECONDS_PER_DAY (24 * 60 * 60)
+
+/* Timestamps further than this from the cached range are bucketed directly */
+#define MAX_CALENDAR_YEARS 400
+
+typedef struct {
+    time_t start;           /* local midnight on the 1st, as a UTC time_t */
+    time_t transition;      /* first instant at next_offset (== next start if none) */
+    int32_t offset;         /* seconds east of UTC at start */
+    int32_t next_offset;    /* seconds east of UTC after the transition */
+} calendar_month_t;
+
+struct calendar {
+    calendar_month_t *months;   /* 12 per cached year, plus a sentinel */
+    size_t count;               /* months, excluding the sentinel */
+    int first_year;
+    size_t last;                /* month of the previous lookup */
+};
+
+static struct tm* local_time(const time_t *t, struct tm *result) {
+#ifdef _WIN32
+    return localtime_s(result, t) == 0 ? result : NULL;
+#else
+    return localtime_r(t, result);
+#endif
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian date (month 1-12) */
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+/* Inverse of days_from_civil: the date (month 1-12) of days since 1970-01-01 */
+static void civil_from_days(int64_t days, int64_t *y, unsigned *m, unsigned *d) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned doe = (unsigned)(days - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    *d = doy - (153 * mp + 2) / 5 + 1;
+    *m = mp < 10 ? mp + 3 : mp - 9;
+    *y = (int64_t)yoe + era * 400 + (*m <= 2);
+}
+
+static int64_t floor_div(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+/* Seconds east of UTC in effect at t */
+static int local_offset(time_t t, int32_t *offset) {
+    struct tm tm;
+    if (!local_time(&t, &tm)) return -1;
+
+    int64_t local = days_from_civil((int64_t)tm.tm_year + 1900, (unsigned)tm.tm_mon + 1,
+                                    (unsigned)tm.tm_mday) * SECONDS_PER_DAY
+                    + tm.tm_hour * SECONDS_PER_HOUR + tm.tm_min * 60 + tm.tm_sec;
+    *offset = (int32_t)(local - (int64_t)t);
+    return 0;
+}
+
+static int month_start(int year, int month, time_t *start) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = month;
+    tm.tm_mday = 1;
+    tm.tm_isdst = -1;  /* Let mktime() determine DST */
+    *start = mktime(&tm);
+    return *start == (time_t)-1 ? -1 : 0;
+}
+
+/* Fill in offsets and the DST change (if any) of a month ending at next */
+static int month_finish(calendar_month_t *month, time_t next) {
+    if (local_offset(month->start, &month->offset) != 0 ||
+        local_offset(next - 1, &month->next_offset) != 0) {
+        return -1;
+    }
+
+    month->transition = next;
+    if (month->offset != month->next_offset) {
+        /* Binary search for the first second at the new offset */
+        time_t lo = month->start;
+        time_t hi = next - 1;
+        while (hi - lo > 1) {
+            time_t mid = lo + (hi - lo) / 2;
+            int32_t off;
+            if (local_offset(mid, &off) != 0) return -1;
+            if (off == month->offset) lo = mid; else hi = mid;
+        }
+        month->transition = hi;
+    }
+    return 0;
+}
+
+/* Build months [year, year + years) into dst[0 .. 12 * years] (with sentinel) */
+static int build_years(calendar_month_t *dst, int year, int years) {
+    size_t count = (size_t)years * 12;
+
+    for (size_t i = 0; i <= count; i++) {
+        if (month_start(year + (int)(i / 12), (int)(i % 12), &dst[i].start) != 0) return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (month_finish(&dst[i], dst[i + 1].start) != 0) return -1;
+    }
+    return local_offset(dst[count].start, &dst[count].offset);
+}
+
+/* Grow the cached range to include year; -1 if it is too far away */
+static int calendar_extend(calendar_t *cal, int year) {
+    int years = (int)(cal->count / 12);
+    int new_first = cal->count == 0 ? year : (year < cal->first_year ? year : cal->first_year);
+    int new_end = cal->count == 0 ? year + 1 :
+                  (year >= cal->first_year + years ? year + 1 : cal->first_year + years);
+    int new_years = new_end - new_first;
+
+    if (new_years > MAX_CALENDAR_YEARS) return -1;
+
+    calendar_month_t *months = malloc(sizeof(calendar_month_t) * ((size_t)new_years * 12 + 1));
+    if (!months) return -1;
+
+    if (cal->count == 0) {
+        if (build_years(months, new_first, new_years) != 0) {
+            free(months);
+            return -1;
+        }
+    } else {
+        size_t before = (size_t)(cal->first_year - new_first) * 12;
+        size_t after = (size_t)(new_end - (cal->first_year + years)) * 12;
+
+        /*
+         * Existing months (and their sentinel) are reused; only the new years
+         * are computed. Each block overwrites the sentinel of the one before.
+         */
+        if (before > 0 && build_years(months, new_first, (int)(before / 12)) != 0) {
+            free(months);
+            return -1;
+        }
+        memcpy(months + before, cal->months, sizeof(calendar_month_t) * (cal->count + 1));
+        if (after > 0 && build_years(months + before + cal->count,
+                                     cal->first_year + years, (int)(after / 12)) != 0) {
+            free(months);
+            return -1;
+        }
+    }
+
+    free(cal->months);
+    cal->months = months;
+    cal->count = (size_t)new_years * 12;
+    cal->first_year = new_first;
+    cal->last = 0;
+    return 0;
+}
+
+/* Index of the cached month containing t, or -1 */
+static long calendar_find(calendar_t *cal, time_t t) {
+    if (cal->count == 0 || t < cal->months[0].start || t >= cal->months[cal->count].start) {
+        return -1;
+    }
+
+    size_t i = cal->last;
+    if (t >= cal->months[i].start && t < cal->months[i + 1].start) return (long)i;
+
+    size_t lo = 0;
+    size_t hi = cal->count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cal->months[mid].start <= t) lo = mid; else hi = mid;
+    }
+    cal->last = lo;
+    return (long)lo;
+}
+
+static int32_t offset_at(const calendar_month_t *month, time_t t) {
+    return t < month->transition ? month->offset : month->next_offset;
+}
+
+/* Start of the local day or hour containing t, within a cached month */
+static time_t truncate_local(const calendar_month_t *month, time_t t, int64_t unit) {
+    int32_t off = offset_at(month, t);
+    int64_t local_start = floor_div((int64_t)t + off, unit) * unit;
+    time_t start = (time_t)(local_start - off);
+
+    /* The boundary may lie on the other side of a DST change */
+    if (start < month->start) return month->start;
+    if (offset_at(month, start) != off) {
+        start = (time_t)(local_start - offset_at(month, start));
+        /* The local boundary was skipped over: the bucket opens at the change */
+        if (start > t) start = month->transition;
+    }
+    return start;
+}
+
+/* Uncached fallback for timestamps far outside the cached range */
+static time_t bucket_start_slow(time_t t, interval_t interval) {
+    struct tm tm_buf;
+    struct tm *tm_info = local_time(&t, &tm_buf);
+    if (!tm_info) return t;
+
+    struct tm tm_copy = *tm_info;
+    switch (interval) {
+        case INTERVAL_YEAR:
+            tm_copy.tm_mon = 0;
+            /* fall through */
+        case INTERVAL_MONTH:
+            tm_copy.tm_mday = 1;
+            /* fall through */
+        case INTERVAL_DAY:
+        default:
+            tm_copy.tm_hour = 0;
+            /* fall through */
+        case INTERVAL_HOUR:
+            tm_copy.tm_min = 0;
+            tm_copy.tm_sec = 0;
+            break;
+    }
+    tm_copy.tm_isdst = -1;  /* Let mktime() determine DST */
+    return mktime(&tm_copy);
+}
+
+calendar_t* calendar_create(void) {
+    calendar_t *cal = calloc(1, sizeof(calendar_t));
+    return cal;
+}
+
+void calendar_destroy(calendar_t *cal) {
+    if (!cal) return;
+    free(cal->months);
+    free(cal);
+}
+
+time_t calendar_bucket_start(calendar_t *cal, time_t t, interval_t interval) {
+    long i = calendar_find(cal, t);
+
+    if (i < 0) {
+        struct tm tm;
+        if (!local_time(&t, &tm) || calendar_extend(cal, tm.tm_year + 1900) != 0 ||
+            (i = calendar_find(cal, t)) < 0) {
+            return bucket_start_slow(t, interval);
+        }
+    }
+
+    const calendar_month_t *month = &cal->months[i];
+    switch (interval) {
+        case INTERVAL_HOUR:
+            return truncate_local(month, t, SECONDS_PER_HOUR);
+        case INTERVAL_MONTH:
+            return month->start;
+        case INTERVAL_YEAR:
+            return cal->months[i - i % 12].start;
+        case INTERVAL_DAY:
+        default:
+            return truncate_local(month, t, SECONDS_PER_DAY);
+    }
+}
+
+/*
+ * Whether the local hour and day boundaries of the month containing t fall
+ * on multiples of unit seconds since the epoch: its UTC offsets and the
+ * instant of its DST change, if any, are all such multiples. Whole quarter
+ * hours pass for 15-minute units; local mean time or a change at 00:01 does
+ * not. Times outside the cached range report 0.
+ */
+int calendar_on_grid(calendar_t *cal, time_t t, int64_t unit) {
+    long i = calendar_find(cal, t);
+
+    if (i < 0) {
+        struct tm tm;
+        if (!local_time(&t, &tm) || calendar_extend(cal, tm.tm_year + 1900) != 0 ||
+            (i = calendar_find(cal, t)) < 0) {
+            return 0;
+        }
+    }
+
+    const calendar_month_t *month = &cal->months[i];
+    return month->offset % unit == 0 && month->next_offset % unit == 0 &&
+           (int64_t)month->transition % unit == 0;
+}
+
+/*
+ * Local month of t as year * 12 + month (0-11), the base slot of month and
+ * year histograms. A time localtime() cannot convert falls in its UTC month.
+ */
+int64_t calendar_month_index(calendar_t *cal, time_t t) {
+    long i = calendar_find(cal, t);
+
+    if (i < 0) {
+        struct tm tm;
+        if (!local_time(&t, &tm)) {
+            int64_t year;
+            unsigned month, day;
+            civil_from_days(floor_div((int64_t)t, SECONDS_PER_DAY), &year, &month, &day);
+            return year * 12 + (month - 1);
+        }
+        if (calendar_extend(cal, tm.tm_year + 1900) != 0 || (i = calendar_find(cal, t)) < 0) {
+            return ((int64_t)tm.tm_year + 1900) * 12 + tm.tm_mon;
+        }
+    }
+    return (int64_t)cal->first_year * 12 + i;
+}
+
+/* Start of the local month numbered index by calendar_month_index() */
+time_t calendar_month_start(calendar_t *cal, int64_t index) {
+    int64_t year = floor_div(index, 12);
+    int month = (int)(index - year * 12);
+    int64_t cached = index - (int64_t)cal->first_year * 12;
+    time_t start;
+
+    if (cal->count > 0 && cached >= 0 && cached <= (int64_t)cal->count) {
+        return cal->months[cached].start;
+    }
+    if (year > INT_MIN + 1900 && year < INT_MAX && month_start((int)year, month, &start) == 0) {
+        return start;
+    }
+    return (time_t)(days_from_civil(year, (unsigned)month + 1, 1) * SECONDS_PER_DAY);
+}
+
+/*
+ * Local date and time of t like localtime_r(), but from the cached UTC
+ * offsets: only tm_year, tm_mon, tm_mday, tm_hour, tm_min and tm_sec are
+ * set. Returns NULL if t cannot be converted.
+ */
+struct tm* calendar_local_time(calendar_t *cal, time_t t, struct tm *result) {
+    long i = calendar_find(cal, t);
+
+    if (i < 0) {
+        if (!local_time(&t, result)) return NULL;
+        if (calendar_extend(cal, result->tm_year + 1900) != 0 ||
+            (i = calendar_find(cal, t)) < 0) {
+            return result;
+        }
+    }
+
+    int64_t local = (int64_t)t + offset_at(&cal->months[i], t);
+    int64_t days = floor_div(local, SECONDS_PER_DAY);
+    int64_t secs = local - days * SECONDS_PER_DAY;
+    int64_t year;
+    unsigned month, day;
+
+    civil_from_days(days, &year, &month, &day);
+    result->tm_year = (int)(year - 1900);
+    result->tm_mon = (int)month - 1;
+    result->tm_mday = (int)day;
+    result->tm_hour = (int)(secs / SECONDS_PER_HOUR);
+    result->tm_min = (int)(secs % SECONDS_PER_HOUR / 60);
+    result->tm_sec = (int)(secs % 60);
+    return result;
+}
@@ -0,0 +1,231 @@
+#include "diskogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Differences between two snapshots.
+ *
+ * Both snapshots are walked in path order (snapshot_walk_*) and the two
+ * streams are merged like sorted files: a path present on one side only is
+ * a directory added or removed, a path on both sides is compared. Only the
+ * top_n directories that grew most are kept, in a min-heap, so memory does
+ * not depend on how many directories changed. Time buckets are compared
+ * the same way after each snapshot is re-histogrammed.
+ */
+
+static int64_t growth(const dir_change_t *d) {
+    return (int64_t)(d->new_bytes - d->old_bytes);
+}
+
+/* Min-heap on growth: the root is the smallest of the directories kept */
+static void heap_sift_down(dir_change_t *heap, size_t count, size_t i) {
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < count && growth(&heap[left]) < growth(&heap[smallest])) smallest = left;
+        if (right < count && growth(&heap[right]) < growth(&heap[smallest])) smallest = right;
+        if (smallest == i) return;
+        dir_change_t tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static void heap_sift_up(dir_change_t *heap, size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (growth(&heap[parent]) <= growth(&heap[i])) return;
+        dir_change_t tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+/* Offer a directory to the top-N list; -1 if out of memory */
+static int offer_dir(comparison_t *cmp, size_t top_n, const char *path,
+                     const snapshot_dir_totals_t *old_dir, const snapshot_dir_totals_t *new_dir) {
+    dir_change_t d;
+    size_t len;
+
+    memset(&d, 0, sizeof(d));
+    if (old_dir) {
+        d.old_bytes = old_dir->bytes;
+        d.old_files = old_dir->files;
+        d.old_tree_bytes = old_dir->tree_bytes;
+    }
+    if (new_dir) {
+        d.new_bytes = new_dir->bytes;
+        d.new_files = new_dir->files;
+        d.new_tree_bytes = new_dir->tree_bytes;
+    }
+    if (growth(&d) <= 0 || top_n == 0) return 0;
+    if (cmp->top_count == top_n && growth(&d) <= growth(&cmp->top_dirs[0])) return 0;
+
+    len = strlen(path);
+    d.path = malloc(len + 1);
+    if (!d.path) return -1;
+    memcpy(d.path, path, len + 1);
+
+    if (cmp->top_count < top_n) {
+        cmp->top_dirs[cmp->top_count] = d;
+        heap_sift_up(cmp->top_dirs, cmp->top_count++);
+    } else {
+        free(cmp->top_dirs[0].path);
+        cmp->top_dirs[0] = d;
+        heap_sift_down(cmp->top_dirs, cmp->top_count, 0);
+    }
+    return 0;
+}
+
+static int compare_growth_desc(const void *a, const void *b) {
+    int64_t ga = growth((const dir_change_t *)a);
+    int64_t gb = growth((const dir_change_t *)b);
+    if (ga != gb) return ga > gb ? -1 : 1;
+    return strcmp(((const dir_change_t *)a)->path, ((const dir_change_t *)b)->path);
+}
+
+static int same_totals(const snapshot_dir_totals_t *a, const snapshot_dir_totals_t *b) {
+    return a->files == b->files && a->bytes == b->bytes;
+}
+
+/* Merge the two directory walks */
+static int compare_dirs(comparison_t *cmp, const snapshot_t *old_snap,
+                        const snapshot_t *new_snap, size_t top_n) {
+    snapshot_walk_t *old_walk = snapshot_walk_create(old_snap);
+    snapshot_walk_t *new_walk = snapshot_walk_create(new_snap);
+    snapshot_dir_totals_t old_dir;
+    snapshot_dir_totals_t new_dir;
+    int have_old;
+    int have_new;
+    int result = -1;
+
+    if (!old_walk || !new_walk) goto done;
+
+    have_old = snapshot_walk_next(old_walk, &old_dir);
+    have_new = snapshot_walk_next(new_walk, &new_dir);
+    while (have_old > 0 || have_new > 0) {
+        int order = have_old <= 0 ? 1 : have_new <= 0 ? -1 :
+                    path_compare(old_dir.path, new_dir.path);
+
+        if (order < 0) {
+            cmp->dirs_removed++;
+            have_old = snapshot_walk_next(old_walk, &old_dir);
+        } else if (order > 0) {
+            cmp->dirs_added++;
+            if (offer_dir(cmp, top_n, new_dir.path, NULL, &new_dir) != 0) goto done;
+            have_new = snapshot_walk_next(new_walk, &new_dir);
+        } else {
+            if (!same_totals(&old_dir, &new_dir)) {
+                cmp->dirs_changed++;
+                if (offer_dir(cmp, top_n, new_dir.path, &old_dir, &new_dir) != 0) goto done;
+            }
+            have_old = snapshot_walk_next(old_walk, &old_dir);
+            have_new = snapshot_walk_next(new_walk, &new_dir);
+        }
+    }
+    if (have_old == 0 && have_new == 0) result = 0;
+
+done:
+    snapshot_walk_destroy(old_walk);
+    snapshot_walk_destroy(new_walk);
+    return result;
+}
+
+/* Merge the bucket lists of two finalized histograms, keeping changed buckets */
+static int compare_buckets(comparison_t *cmp, const histogram_t *old_hist,
+                           const histogram_t *new_hist) {
+    size_t i = 0;
+    size_t j = 0;
+    size_t capacity = old_hist->bucket_count + new_hist->bucket_count;
+
+    cmp->buckets = malloc(sizeof(bucket_change_t) * (capacity ? capacity : 1));
+    if (!cmp->buckets) return -1;
+
+    while (i < old_hist->bucket_count || j < new_hist->bucket_count) {
+        const time_bucket_t *o = i < old_hist->bucket_count ? &old_hist->buckets[i] : NULL;
+        const time_bucket_t *n = j < new_hist->bucket_count ? &new_hist->buckets[j] : NULL;
+        bucket_change_t b;
+
+        memset(&b, 0, sizeof(b));
+        if (o && (!n || o->start_time <= n->start_time)) {
+            b.start_time = o->start_time;
+            b.old_bytes = o->total_bytes;
+            b.old_files = o->file_count;
+            i++;
+        }
+        if (n && (!o || n->start_time <= o->start_time)) {
+            b.start_time = n->start_time;
+            b.new_bytes = n->total_bytes;
+            b.new_files = n->file_count;
+            j++;
+        }
+        if (b.old_bytes != b.new_bytes || b.old_files != b.new_files) {
+            cmp->buckets[cmp->bucket_count++] = b;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Compare two snapshots: per-bucket changes at mode/interval and the top_n
+ * directories whose own files grew most. Returns NULL if either snapshot
+ * is inconsistent or memory runs out.
+ */
+comparison_t* compare_snapshots(const snapshot_t *old_snap, const snapshot_t *new_snap,
+                                grouping_mode_t mode, interval_t interval, size_t top_n) {
+    comparison_t *cmp = calloc(1, sizeof(comparison_t));
+    histogram_t *old_hist = histogram_create(interval);
+    histogram_t *new_hist = histogram_create(interval);
+
+    if (!cmp || !old_hist || !new_hist) goto fail;
+    cmp->mode = mode;
+    cmp->interval = interval;
+    cmp->old_label = snapshot_label(old_snap);
+    cmp->new_label = snapshot_label(new_snap);
+    cmp->top_dirs = malloc(sizeof(dir_change_t) * (top_n ? top_n : 1));
+    if (!cmp->top_dirs) goto fail;
+
+    old_hist->mode = mode;
+    new_hist->mode = mode;
+    snapshot_fill(old_snap, &old_hist, 1);
+    snapshot_fill(new_snap, &new_hist, 1);
+    histogram_finalize(old_hist);
+    histogram_finalize(new_hist);
+
+    cmp->old_scan_time = old_hist->scan_start_time;
+    cmp->new_scan_time = new_hist->scan_start_time;
+    cmp->old_bytes = old_hist->total_bytes;
+    cmp->new_bytes = new_hist->total_bytes;
+    cmp->old_files = old_hist->total_files;
+    cmp->new_files = new_hist->total_files;
+
+    if (compare_buckets(cmp, old_hist, new_hist) != 0 ||
+        compare_dirs(cmp, old_snap, new_snap, top_n) != 0) {
+        goto fail;
+    }
+    qsort(cmp->top_dirs, cmp->top_count, sizeof(dir_change_t), compare_growth_desc);
+
+    histogram_destroy(old_hist);
+    histogram_destroy(new_hist);
+    return cmp;
+
+fail:
+    histogram_destroy(old_hist);
+    histogram_destroy(new_hist);
+    comparison_destroy(cmp);
+    return NULL;
+}
+
+void comparison_destroy(comparison_t *cmp) {
+    if (!cmp) return;
+    for (size_t i = 0; i < cmp->top_count; i++) {
+        free(cmp->top_dirs[i].path);
+    }
+    free(cmp->top_dirs);
+    free(cmp->buckets);
+    free(cmp);
+}
@@ -49,24 +49,90 @@ typedef enum {
     FORMAT_TEXT,        /* default terminal output */
     FORMAT_CSV,
     FORMAT_JSON,
-    FORMAT_XML
+    FORMAT_XML,
+    FORMAT_BINARY       /* columnar, see binary.c */
 } export_format_t;
 
+/* A file or directory ranked by size within a bucket (--largest) */
+typedef struct {
+    uint64_t bytes;             /* apparent size; for a directory, of its files in the bucket */
+    char *path;
+} top_entry_t;
+
 /* Time bucket (e.g., a day, week, month, or year) */
 typedef struct {
     time_t start_time;
-    uint64_t total_bytes;
+    uint64_t total_bytes;       /* apparent size (st_size) */
+    uint64_t allocated_bytes;   /* space on disk (st_blocks * 512) */
     uint64_t file_count;
+    const top_entry_t *top_files;  /* largest first; owned by the histogram */
+    size_t top_file_count;      /* 0 unless ranking was enabled */
+    const top_entry_t *top_dirs;   /* by bytes of the files directly inside */
+    size_t top_dir_count;
 } time_bucket_t;
 
-/* Histogram structure */
+/* Metadata of one file; all grouping times come from a single stat */
 typedef struct {
-    time_bucket_t *buckets;
+    uint64_t size;
+    uint64_t allocated; /* bytes of storage in use; may differ from size */
+    time_t mtime;
+    time_t ctime;       /* birth time where the platform records it */
+    time_t atime;
+    uint64_t ino;
+    uint64_t dev;       /* device of ino; with nlink only set by a live scan */
+    uint32_t nlink;
+} file_info_t;
+
+/* Cache of local calendar boundaries (calendar.c) */
+typedef struct calendar calendar_t;
+
+/* A day of base-resolution counters (histogram.c) */
+typedef struct histogram_page histogram_page_t;
+
+/* Largest files and directories of one bucket (histogram.c) */
+typedef struct top_bucket top_bucket_t;
+
+/* Bytes of one directory's files per bucket, gathered until it has been
+ * read completely and can be ranked; start zeroed */
+typedef struct {
+    struct top_sum *sums;
+    size_t count;
+    size_t capacity;
+} top_dir_sums_t;
+
+/*
+ * Histogram structure. Files are counted into base slots: 15 minutes when
+ * hours or days are wanted, local months otherwise (see `resolution`). The
+ * buckets at `interval` are rolled up from them by histogram_finalize(),
+ * and histogram_rollup() derives other intervals.
+ */
+typedef struct {
+    time_bucket_t *buckets;     /* valid after histogram_finalize() */
     size_t bucket_count;
     size_t bucket_capacity;
+    histogram_page_t **pages;   /* open-addressing table of base pages, NULL = empty */
+    size_t page_count;
+    size_t page_capacity;       /* power of two, at least twice page_count */
+    histogram_page_t *last_page;  /* most recently used page, checked first */
+    struct exact_bucket *exact; /* open-addressing table of buckets at `resolution`
+                                   for days off the slot grid, NULL until needed */
+    size_t exact_count;
+    size_t exact_capacity;      /* power of two, 0 until the first entry */
     uint64_t total_bytes;
+    uint64_t total_allocated;
     uint64_t total_files;
     interval_t interval;
+    interval_t resolution;      /* finest interval the base slots roll up to */
+    grouping_mode_t mode;       /* which file time is bucketed */
+    int disk_usage;             /* report allocated space alongside apparent size */
+    calendar_t *calendar;       /* bucket boundaries in local time */
+
+    /* Largest files and directories per bucket (histogram_set_top) */
+    size_t top_n;               /* entries kept per bucket and kind, 0 = off */
+    unsigned top_intervals;     /* bit (1 << interval) for every interval ranked */
+    top_bucket_t **tops;        /* open-addressing table, NULL = empty */
+    size_t top_count;
+    size_t top_capacity;        /* power of two, 0 until the first entry */
 
     /* Scan metadata */
     time_t scan_start_time;
@@ -74,22 +140,295 @@ typedef struct {
     uint64_t error_count;
     uint64_t directories_scanned;
     char last_error[256];
+    int out_of_memory;          /* a file could not be counted; recorded once */
 
     /* Error logging */
     FILE *error_log_file;
     int log_errors_to_stderr;
 } histogram_t;
 
+/* Most histograms one scan fills: every grouping mode at every interval */
+#define MAX_SCAN_HISTOGRAMS 12
+
+/* Default size of each worker's directory entry buffer (getdents64 batch) */
+#define DEFAULT_DIRENT_BUFFER_SIZE (256 * 1024)
+#define MIN_DIRENT_BUFFER_SIZE (4 * 1024)
+
+/* Default number of asynchronous stats kept in flight per thread */
+#define DEFAULT_URING_DEPTH 256
+#define MAX_URING_DEPTH 4096
+
+/* Most paths --stdin --batch scans at once */
+#define MAX_BATCH_JOBS 256
+
+/* Directory descriptors a scan keeps open; the default follows RLIMIT_NOFILE */
+#define DEFAULT_MAX_OPEN_DIRS 4096
+#define MIN_MAX_OPEN_DIRS 8
+
+/* Scan snapshots (snapshot.c) */
+typedef struct snapshot_writer snapshot_writer_t;
+typedef struct snapshot_batch snapshot_batch_t;
+typedef struct snapshot snapshot_t;
+typedef struct snapshot_index snapshot_index_t;
+typedef struct snapshot_walk snapshot_walk_t;
+
+/* Set of (device, inode) pairs already counted (inodes.c) */
+typedef struct inode_set inode_set_t;
+
+/* Mounted filesystems, for --one-file-system and --skip-fs (mounts.c) */
+typedef struct mount_table mount_table_t;
+
+/* Directories with the histograms of their subtrees, for --tree (tree.c) */
+typedef struct dir_tree dir_tree_t;
+typedef struct tree_node tree_node_t;
+typedef struct tree_batch tree_batch_t;
+
+/* Deepest level below the scanned path --tree reports */
+#define MAX_TREE_DEPTH 64
+
+/* A directory visited by snapshot_walk_next() */
+typedef struct {
+    const char *path;       /* valid until the next call */
+    uint64_t files;         /* files directly inside */
+    uint64_t bytes;
+    uint64_t tree_files;    /* files in the whole subtree */
+    uint64_t tree_bytes;
+} snapshot_dir_totals_t;
+
+/* Scanner options */
+typedef struct {
+    int threads;                /* worker threads; 0 = one per online CPU */
+    size_t dirent_buffer_size;  /* bytes per directory read batch */
+    int fast_stat;              /* allow cached attributes (AT_STATX_DONT_SYNC) */
+    int use_io_uring;           /* stat through io_uring when available */
+    unsigned uring_depth;       /* io_uring submission queue entries */
+    size_t max_open_dirs;       /* directories kept open for openat(); 0 = automatic */
+    int inode_order;            /* stat each directory's entries by inode number */
+    snapshot_writer_t *snapshot;  /* record every directory and file, NULL = off */
+    const snapshot_index_t *reuse;  /* previous snapshot: skip unchanged directories */
+    inode_set_t *dedup;         /* count each multiply-linked inode once, NULL = off */
+    int one_file_system;        /* stay on the filesystem of the scanned path */
+    const mount_table_t *mounts;  /* mount points to skip by type, NULL = none */
+    dir_tree_t *tree;           /* also count into per-directory nodes, NULL = off */
+} scan_options_t;
+
+/* State of a JSON array being streamed by export_json_array_*() */
+typedef struct {
+    size_t items;           /* items written so far */
+} json_array_writer_t;
+
+/* Buffered writer for display and export output (output.c) */
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+    FILE *file;
+    size_t len;             /* bytes waiting in buf */
+    char buf[OUTPUT_BUFFER_SIZE];
+} output_t;
+
+/* Columnar binary export, read back in place (binary.c) */
+typedef struct binary_file binary_file_t;
+
+/* One histogram of a binary export; strings and columns point into the file */
+typedef struct {
+    const char *label;          /* path or other subject of the histogram */
+    const char *title;
+    const char *last_error;     /* "" if none */
+    interval_t interval;
+    grouping_mode_t mode;
+    int disk_usage;
+    uint64_t bucket_count;
+    uint64_t total_bytes;
+    uint64_t total_allocated;
+    uint64_t total_files;
+    time_t scan_start_time;
+    time_t scan_end_time;
+    uint64_t error_count;
+    uint64_t directories_scanned;
+    const int64_t *starts;      /* bucket_count entries each */
+    const uint64_t *bytes;
+    const uint64_t *files;
+    const uint64_t *allocated;
+    uint64_t top_n;             /* --largest entries per bucket and kind, 0 if none */
+    uint64_t top_count;         /* ranked entries of all buckets */
+    const uint64_t *top_buckets;   /* top_count entries each: index into the columns */
+    const uint64_t *top_kinds;  /* 0 = file, 1 = directory */
+    const uint64_t *top_bytes;
+    const uint64_t *top_paths;  /* offsets from top_base of NUL-terminated paths */
+    const char *top_base;
+} binary_histogram_t;
+
+/* Concurrent batch scans (batch.c) */
+typedef struct batch_runner batch_runner_t;
+
+/* Receives a finished path and owns its histograms; status is the scan's result */
+typedef void (*batch_result_fn)(void *ctx, const char *path, histogram_t **hists,
+                                size_t count, int status);
+
 /* Function declarations */
 
 /* Directory traversal */
+void scan_options_init(scan_options_t *opts);
 int scan_directory(const char *path, grouping_mode_t mode, histogram_t *hist);
+int scan_directory_opts(const char *path, grouping_mode_t mode, histogram_t *hist,
+                        const scan_options_t *opts);
+int scan_directory_multi(const char *path, histogram_t **hists, size_t count,
+                         const scan_options_t *opts);
+
+/* Asynchronous statx batching (uring.c, Linux only); uring_create returns
+ * NULL when io_uring or IORING_OP_STATX is unavailable */
+typedef struct uring uring_t;
+uring_t* uring_create(unsigned entries);
+void uring_destroy(uring_t *ring);
+int uring_queue_statx(uring_t *ring, int dirfd, const char *name, int flags,
+                      unsigned mask, void *statx_buf, uint64_t user_data);
+unsigned uring_unsubmitted(const uring_t *ring);
+int uring_submit(uring_t *ring, unsigned wait_nr);
+int uring_take_unsubmitted(uring_t *ring, uint64_t *user_data);
+int uring_next_completion(uring_t *ring, uint64_t *user_data, int *result);
+
+/* Local calendar boundaries; one cache per thread, not thread-safe */
+calendar_t* calendar_create(void);
+void calendar_destroy(calendar_t *cal);
+time_t calendar_bucket_start(calendar_t *cal, time_t t, interval_t interval);
+int calendar_on_grid(calendar_t *cal, time_t t, int64_t unit);
+int64_t calendar_month_index(calendar_t *cal, time_t t);
+time_t calendar_month_start(calendar_t *cal, int64_t index);
+struct tm* calendar_local_time(calendar_t *cal, time_t t, struct tm *result);
+
+/* Snapshot writing: one batch per scanning thread, finish once all are destroyed */
+snapshot_writer_t* snapshot_writer_create(const char *filename);
+uint64_t snapshot_next_dir_id(snapshot_writer_t *writer);
+int snapshot_writer_finish(snapshot_writer_t *writer, const histogram_t *meta,
+                           const char *label);
+snapshot_batch_t* snapshot_batch_create(snapshot_writer_t *writer);
+void snapshot_batch_destroy(snapshot_batch_t *batch);
+void snapshot_batch_add_file(snapshot_batch_t *batch, uint64_t parent, const file_info_t *info);
+void snapshot_batch_add_dir(snapshot_batch_t *batch, uint64_t id, uint64_t parent,
+                            const file_info_t *info, const char *name);
+
+/* Snapshot reading; snapshot_open returns NULL if the file is missing or invalid */
+snapshot_t* snapshot_open(const char *filename);
+void snapshot_close(snapshot_t *snap);
+const char* snapshot_label(const snapshot_t *snap);
+void snapshot_fill(const snapshot_t *snap, histogram_t **hists, size_t count);
+
+/* Incremental scans: directories of a previous snapshot, referenced by
+ * nonzero handles; dir 0 is the (virtual) parent of the scan roots */
+snapshot_index_t* snapshot_index_create(const snapshot_t *snap);
+void snapshot_index_destroy(snapshot_index_t *idx);
+size_t snapshot_index_lookup(const snapshot_index_t *idx, size_t dir, const char *name);
+int snapshot_index_unchanged(const snapshot_index_t *idx, size_t dir, const file_info_t *now);
+size_t snapshot_index_file_count(const snapshot_index_t *idx, size_t dir);
+void snapshot_index_file(const snapshot_index_t *idx, size_t dir, size_t i, file_info_t *info);
+size_t snapshot_index_subdir_count(const snapshot_index_t *idx, size_t dir);
+size_t snapshot_index_subdir(const snapshot_index_t *idx, size_t dir, size_t i,
+                             const char **name);
+
+/* Directories of a snapshot with their totals, in path_compare() order */
+snapshot_walk_t* snapshot_walk_create(const snapshot_t *snap);
+void snapshot_walk_destroy(snapshot_walk_t *walk);
+int snapshot_walk_next(snapshot_walk_t *walk, snapshot_dir_totals_t *dir);
+
+/* Differences between two snapshots (compare.c) */
+typedef struct {
+    time_t start_time;
+    uint64_t old_bytes;
+    uint64_t new_bytes;
+    uint64_t old_files;
+    uint64_t new_files;
+} bucket_change_t;
+
+typedef struct {
+    char *path;
+    uint64_t old_bytes;         /* files directly inside */
+    uint64_t new_bytes;
+    uint64_t old_files;
+    uint64_t new_files;
+    uint64_t old_tree_bytes;    /* whole subtree */
+    uint64_t new_tree_bytes;
+} dir_change_t;
+
+typedef struct {
+    grouping_mode_t mode;
+    interval_t interval;
+    const char *old_label;      /* point into the snapshots */
+    const char *new_label;
+    time_t old_scan_time;
+    time_t new_scan_time;
+    uint64_t old_bytes;
+    uint64_t new_bytes;
+    uint64_t old_files;
+    uint64_t new_files;
+    bucket_change_t *buckets;   /* buckets whose bytes or files changed */
+    size_t bucket_count;
+    dir_change_t *top_dirs;     /* largest growth first */
+    size_t top_count;
+    uint64_t dirs_added;
+    uint64_t dirs_removed;
+    uint64_t dirs_changed;
+} comparison_t;
+
+comparison_t* compare_snapshots(const snapshot_t *old_snap, const snapshot_t *new_snap,
+                                grouping_mode_t mode, interval_t interval, size_t top_n);
+void comparison_destroy(comparison_t *cmp);
+
+/* Hard-link deduplication; insert returns 1 if new, 0 if seen, -1 if out of memory */
+inode_set_t* inode_set_create(void);
+void inode_set_destroy(inode_set_t *set);
+void inode_set_clear(inode_set_t *set);
+int inode_set_insert(inode_set_t *set, uint64_t dev, uint64_t ino);
+
+/* Concurrent --stdin --batch scans; results arrive on the submitting thread */
+batch_runner_t* batch_runner_create(size_t jobs, int unordered, const scan_options_t *opts,
+                                    batch_result_fn on_result, void *ctx);
+int batch_runner_submit(batch_runner_t *runner, const char *path,
+                        histogram_t **hists, size_t count);
+void batch_runner_finish(batch_runner_t *runner);
+
+/* Directory tree: one batch per scanning thread, finish once all are
+ * destroyed; dir_tree_child returns parent itself below max_depth */
+dir_tree_t* dir_tree_create(unsigned max_depth, const grouping_mode_t *modes,
+                            size_t mode_count, const interval_t *intervals,
+                            size_t interval_count, int disk_usage);
+void dir_tree_destroy(dir_tree_t *tree);
+tree_node_t* dir_tree_add_root(dir_tree_t *tree, const char *path);
+tree_node_t* dir_tree_child(dir_tree_t *tree, tree_node_t *parent, const char *name);
+tree_batch_t* tree_batch_create(dir_tree_t *tree);
+void tree_batch_destroy(tree_batch_t *batch);
+void tree_batch_add_dir(tree_batch_t *batch, tree_node_t *node);
+void tree_batch_add_file(tree_batch_t *batch, tree_node_t *node, const file_info_t *info);
+int dir_tree_finish(dir_tree_t *tree);
+void dir_tree_visit(dir_tree_t *tree, const histogram_t *meta, batch_result_fn fn, void *ctx);
+
+/* Mount table; load returns NULL where no table is available */
+mount_table_t* mount_table_load(void);
+void mount_table_destroy(mount_table_t *mounts);
+void mount_table_skip_types(mount_table_t *mounts, const char *list);
+uint64_t mount_table_device_of(const mount_table_t *mounts, const char *path);
+int mount_table_excluded(const mount_table_t *mounts, const char *path,
+                         int one_file_system, uint64_t root_dev);
 
 /* Histogram management */
 histogram_t* histogram_create(interval_t interval);
 void histogram_destroy(histogram_t *hist);
 void histogram_add_file(histogram_t *hist, time_t file_time, uint64_t size);
+void histogram_add_file_info(histogram_t *hist, const file_info_t *info);
+void histogram_merge(histogram_t *dst, const histogram_t *src);
 void histogram_finalize(histogram_t *hist);
+
+/* Per-bucket ranking of the largest files and directories; memory grows
+ * with n times the number of buckets, not with the number of files */
+#define MAX_TOP_ENTRIES 1000
+void histogram_set_top(histogram_t *hist, size_t n, unsigned intervals);
+void histogram_add_top_file(histogram_t *hist, const file_info_t *info, const char *dir,
+                            const char *name, top_dir_sums_t *sums);
+void histogram_add_top_dir(histogram_t *hist, top_dir_sums_t *sums, const char *path);
+void histogram_add_top(histogram_t *hist, time_t start, int is_dir, uint64_t bytes,
+                       const char *path);
+void histogram_link_tops(histogram_t *hist);
+histogram_t* histogram_rollup(const histogram_t *hist, interval_t interval);
+void histogram_set_resolution(histogram_t *hist, interval_t interval);
 void histogram_set_error_log(histogram_t *hist, FILE *log_file);
 void histogram_set_error_stderr(histogram_t *hist, int enabled);
 void histogram_log_error(histogram_t *hist, const char *error_msg);
@@ -99,19 +438,56 @@ void display_histogram(const histogram_t *hist, const char *title);
 void export_csv(const histogram_t *hist, const char *title);
 void export_json(const histogram_t *hist, const char *title);
 void export_xml(const histogram_t *hist, const char *title);
+void display_comparison(const comparison_t *cmp, const char *title);
+void export_csv_comparison(const comparison_t *cmp, const char *title);
+void export_json_comparison(const comparison_t *cmp, const char *title);
+void export_xml_comparison(const comparison_t *cmp, const char *title);
 
 /* Batch export helpers */
-void export_json_array_start(void);
-void export_json_array_item(const histogram_t *hist, const char *title, int is_last);
-void export_json_array_end(void);
+void export_json_array_start(json_array_writer_t *writer);
+void export_json_array_item(json_array_writer_t *writer, const histogram_t *hist,
+                            const char *title, int with_mode);
+void export_json_array_end(json_array_writer_t *writer);
 void export_xml_collection_start(void);
-void export_xml_collection_item(const histogram_t *hist, const char *title);
+void export_xml_collection_item(const histogram_t *hist, const char *title, int with_mode);
 void export_xml_collection_end(void);
-void export_csv_batch_start(const char *mode_name, interval_t interval);
+void export_csv_batch_start(const char *mode_name, interval_t interval, int disk_usage,
+                            int top);
 void export_csv_batch_item(const histogram_t *hist, const char *path, interval_t interval);
 
+/* Multi-histogram (--modes/--intervals) CSV with Mode and Interval columns */
+void export_csv_set(histogram_t *const *hists, size_t count, const char *title);
+void export_csv_batch_set_start(int disk_usage, int top);
+void export_csv_batch_set_item(histogram_t *const *hists, size_t count, const char *path);
+
+/* Columnar binary export and its reader */
+void export_binary_start(void);
+void export_binary_item(const histogram_t *hist, const char *title, const char *label);
+void export_binary_end(void);
+binary_file_t* binary_open(const char *filename);
+int binary_next(binary_file_t *file, binary_histogram_t *hist);
+void binary_close(binary_file_t *file);
+histogram_t* binary_histogram_load(const binary_histogram_t *hist);
+
+/* Buffered output; output_flush() must be called before anything else is
+ * printed to the same FILE */
+void output_init(output_t *out, FILE *file);
+void output_flush(output_t *out);
+void output_write(output_t *out, const char *data, size_t len);
+void output_str(output_t *out, const char *str);
+void output_char(output_t *out, char c);
+void output_repeat(output_t *out, char c, size_t count);
+void output_u64(output_t *out, uint64_t value);
+void output_i64(output_t *out, int64_t value);
+void output_format(output_t *out, const char *fmt, ...);
+int output_timestamp(output_t *out, time_t t);
+void output_bucket_time(output_t *out, time_t t, interval_t interval);
+void output_json_escaped(output_t *out, const char *str);
+void output_xml_escaped(output_t *out, const char *str);
+void output_csv_field(output_t *out, const char *str);
+
 /* Utilities */
 const char* format_size(uint64_t bytes, char *buf, size_t bufsize);
-const char* format_time(time_t t, char *buf, size_t bufsize);
+int path_compare(const char *a, const char *b);
 
 #endif /* SPACETIME_H */
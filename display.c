@@ -4,7 +4,7 @@
 #include <math.h>
 
 #define BAR_WIDTH 50
-#define BLOCK_CHAR "#"
+#define BLOCK_CHAR '#'
 
 const char* format_size(uint64_t bytes, char *buf, size_t bufsize) {
     const char *units[] = {"B", "KB", "MB", "GB", "TB", "PB"};
@@ -25,105 +25,229 @@ const char* format_size(uint64_t bytes, char *buf, size_t bufsize) {
     return buf;
 }
 
-const char* format_time(time_t t, char *buf, size_t bufsize) {
-    struct tm *tm_info = localtime(&t);
-    if (tm_info) {
-        strftime(buf, bufsize, "%Y-%m-%d", tm_info);
-    } else {
-        snprintf(buf, bufsize, "unknown");
-    }
-    return buf;
+static int is_separator(char c) {
+    return c == '/' || c == PATH_SEPARATOR;
 }
 
-static const char* format_time_interval(time_t t, interval_t interval, char *buf, size_t bufsize) {
-    struct tm *tm_info = localtime(&t);
-    if (!tm_info) {
-        snprintf(buf, bufsize, "unknown");
-        return buf;
-    }
-
-    switch (interval) {
-        case INTERVAL_HOUR:
-            strftime(buf, bufsize, "%Y-%m-%d %H:00", tm_info);
-            break;
-        case INTERVAL_DAY:
-            strftime(buf, bufsize, "%Y-%m-%d", tm_info);
-            break;
-        case INTERVAL_MONTH:
-            strftime(buf, bufsize, "%Y-%m", tm_info);
-            break;
-        case INTERVAL_YEAR:
-            strftime(buf, bufsize, "%Y", tm_info);
-            break;
-        default:
-            strftime(buf, bufsize, "%Y-%m-%d", tm_info);
-            break;
+/*
+ * Path order with the separator before every other byte, so that a
+ * directory's subtree sorts directly after it and before a sibling that
+ * merely extends its name ("a", "a/x", "a-b"). Snapshot walks join with
+ * '/', so on Win32 both separators count.
+ */
+int path_compare(const char *a, const char *b) {
+    while (*a && (*a == *b || (is_separator(*a) && is_separator(*b)))) {
+        a++;
+        b++;
     }
+    if (*a == *b) return 0;
+    if (is_separator(*a)) return *b ? -1 : 1;
+    if (is_separator(*b)) return *a ? 1 : -1;
+    return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+}
 
-    return buf;
+/* "  <kind>  <size>  <path>" lines of a bucket's largest files or directories */
+static void output_top_entries(output_t *out, const char *kind, const top_entry_t *entries,
+                               size_t count) {
+    char size_buf[64];
+
+    for (size_t i = 0; i < count; i++) {
+        output_format(out, "  %-9s  %10s  ", kind,
+                      format_size(entries[i].bytes, size_buf, sizeof(size_buf)));
+        output_str(out, entries[i].path);
+        output_char(out, '\n');
+    }
 }
 
 void display_histogram(const histogram_t *hist, const char *title) {
+    output_t out;
+    output_init(&out, stdout);
+
     if (!hist || hist->bucket_count == 0) {
-        printf("No data to display.\n");
+        output_str(&out, "No data to display.\n");
+        output_flush(&out);
         return;
     }
 
     char size_buf[64];
-    char time_buf[64];
-
-    printf("\n%s\n", title);
-    printf("Total: %s in %lu files",
-           format_size(hist->total_bytes, size_buf, sizeof(size_buf)),
-           (unsigned long)hist->total_files);
-    printf(" (%lu directories scanned)\n",
-           (unsigned long)hist->directories_scanned);
+    char alloc_buf[64];
+
+    output_char(&out, '\n');
+    output_str(&out, title);
+    output_str(&out, "\nTotal: ");
+    output_str(&out, format_size(hist->total_bytes, size_buf, sizeof(size_buf)));
+    output_str(&out, " in ");
+    output_u64(&out, hist->total_files);
+    output_str(&out, " files");
+    if (hist->disk_usage) {
+        output_str(&out, ", ");
+        output_str(&out, format_size(hist->total_allocated, alloc_buf, sizeof(alloc_buf)));
+        output_str(&out, " allocated");
+    }
+    output_str(&out, " (");
+    output_u64(&out, hist->directories_scanned);
+    output_str(&out, " directories scanned)\n");
 
     /* Show warnings if errors occurred */
     if (hist->error_count > 0) {
-        printf("\nWARNING: %lu error(s) occurred during scan\n",
-               (unsigned long)hist->error_count);
+        output_str(&out, "\nWARNING: ");
+        output_u64(&out, hist->error_count);
+        output_str(&out, " error(s) occurred during scan\n");
         if (hist->last_error[0] != '\0') {
-            printf("Last error: %s\n", hist->last_error);
+            output_str(&out, "Last error: ");
+            output_str(&out, hist->last_error);
+            output_char(&out, '\n');
         }
-        printf("Results may be incomplete.\n");
+        output_str(&out, "Results may be incomplete.\n");
     }
-    printf("\n");
+    output_char(&out, '\n');
 
-    /* Find maximum size for scaling */
+    /* Find maximum size for scaling; with --disk-usage bars show allocated space */
     uint64_t max_size = 0;
     for (size_t i = 0; i < hist->bucket_count; i++) {
-        if (hist->buckets[i].total_bytes > max_size) {
-            max_size = hist->buckets[i].total_bytes;
+        uint64_t size = hist->disk_usage ? hist->buckets[i].allocated_bytes
+                                         : hist->buckets[i].total_bytes;
+        if (size > max_size) {
+            max_size = size;
         }
     }
 
     if (max_size == 0) {
-        printf("No data to display.\n");
+        output_str(&out, "No data to display.\n");
+        output_flush(&out);
         return;
     }
 
     /* Display each bucket */
     for (size_t i = 0; i < hist->bucket_count; i++) {
         time_bucket_t *bucket = &hist->buckets[i];
+        uint64_t size = hist->disk_usage ? bucket->allocated_bytes : bucket->total_bytes;
 
         /* Calculate bar length */
-        int bar_len = (int)((double)bucket->total_bytes / (double)max_size * BAR_WIDTH);
-        if (bar_len < 1 && bucket->total_bytes > 0) {
+        int bar_len = (int)((double)size / (double)max_size * BAR_WIDTH);
+        if (bar_len < 1 && size > 0) {
             bar_len = 1;
         }
 
         /* Print date and bar */
-        printf("%s  ", format_time_interval(bucket->start_time, hist->interval, time_buf, sizeof(time_buf)));
-        for (int j = 0; j < bar_len; j++) {
-            printf(BLOCK_CHAR);
-        }
+        output_bucket_time(&out, bucket->start_time, hist->interval);
+        output_str(&out, "  ");
+        output_repeat(&out, BLOCK_CHAR, (size_t)bar_len);
 
         /* Print size and file count */
-        printf("  %s (%lu files)\n",
-               format_size(bucket->total_bytes, size_buf, sizeof(size_buf)),
-               (unsigned long)bucket->file_count);
+        output_str(&out, "  ");
+        if (hist->disk_usage) {
+            output_str(&out, format_size(bucket->allocated_bytes, alloc_buf, sizeof(alloc_buf)));
+            output_str(&out, " allocated, ");
+        }
+        output_str(&out, format_size(bucket->total_bytes, size_buf, sizeof(size_buf)));
+        output_str(&out, hist->disk_usage ? " apparent (" : " (");
+        output_u64(&out, bucket->file_count);
+        output_str(&out, " files)\n");
     }
 
-    printf("\n");
+    /* --largest: directories are sized by the files directly inside */
+    if (hist->top_n > 0) {
+        output_str(&out, "\nLargest files and directories:\n");
+        for (size_t i = 0; i < hist->bucket_count; i++) {
+            const time_bucket_t *bucket = &hist->buckets[i];
+            if (bucket->top_file_count == 0 && bucket->top_dir_count == 0) continue;
+            output_bucket_time(&out, bucket->start_time, hist->interval);
+            output_char(&out, '\n');
+            output_top_entries(&out, "file", bucket->top_files, bucket->top_file_count);
+            output_top_entries(&out, "directory", bucket->top_dirs, bucket->top_dir_count);
+        }
+    }
+
+    output_char(&out, '\n');
+    output_flush(&out);
+}
+
+/* Signed change between two sizes, e.g. "+1.50 GB" */
+static const char* format_size_change(uint64_t old_bytes, uint64_t new_bytes,
+                                      char *buf, size_t bufsize) {
+    char size_buf[64];
+    if (new_bytes >= old_bytes) {
+        snprintf(buf, bufsize, "+%s", format_size(new_bytes - old_bytes, size_buf, sizeof(size_buf)));
+    } else {
+        snprintf(buf, bufsize, "-%s", format_size(old_bytes - new_bytes, size_buf, sizeof(size_buf)));
+    }
+    return buf;
+}
+
+/* Signed change between two counts, e.g. "+12" */
+static void output_count_change(output_t *out, uint64_t old_count, uint64_t new_count) {
+    int64_t delta = (int64_t)(new_count - old_count);
+    if (delta >= 0) {
+        output_char(out, '+');
+    }
+    output_i64(out, delta);
+}
+
+/* "<size> in <n> files (<label>, scanned <date>)" of one side of a comparison */
+static void output_comparison_side(output_t *out, uint64_t bytes, uint64_t files,
+                                   const char *label, time_t scan_time) {
+    char size_buf[64];
+
+    output_str(out, format_size(bytes, size_buf, sizeof(size_buf)));
+    output_str(out, " in ");
+    output_u64(out, files);
+    output_str(out, " files (");
+    output_str(out, label);
+    output_str(out, ", scanned ");
+    output_bucket_time(out, scan_time, INTERVAL_DAY);
+    output_str(out, ")\n");
+}
+
+void display_comparison(const comparison_t *cmp, const char *title) {
+    char size_buf[64];
+    output_t out;
+    output_init(&out, stdout);
+
+    output_char(&out, '\n');
+    output_str(&out, title);
+    output_str(&out, "\nPrevious: ");
+    output_comparison_side(&out, cmp->old_bytes, cmp->old_files, cmp->old_label,
+                           cmp->old_scan_time);
+    output_str(&out, "Current:  ");
+    output_comparison_side(&out, cmp->new_bytes, cmp->new_files, cmp->new_label,
+                           cmp->new_scan_time);
+    output_str(&out, "Change:   ");
+    output_str(&out, format_size_change(cmp->old_bytes, cmp->new_bytes, size_buf, sizeof(size_buf)));
+    output_str(&out, ", ");
+    output_count_change(&out, cmp->old_files, cmp->new_files);
+    output_str(&out, " files; ");
+    output_u64(&out, cmp->dirs_added);
+    output_str(&out, " directories added, ");
+    output_u64(&out, cmp->dirs_removed);
+    output_str(&out, " removed, ");
+    output_u64(&out, cmp->dirs_changed);
+    output_str(&out, " changed\n\n");
+
+    if (cmp->bucket_count == 0) {
+        output_str(&out, "No changes by time.\n");
+    }
+    for (size_t i = 0; i < cmp->bucket_count; i++) {
+        const bucket_change_t *b = &cmp->buckets[i];
+        output_bucket_time(&out, b->start_time, cmp->interval);
+        output_format(&out, "  %12s  (",
+                      format_size_change(b->old_bytes, b->new_bytes, size_buf, sizeof(size_buf)));
+        output_count_change(&out, b->old_files, b->new_files);
+        output_str(&out, " files)\n");
+    }
+
+    if (cmp->top_count > 0) {
+        output_str(&out, "\nDirectories that grew most (files directly inside):\n");
+    }
+    for (size_t i = 0; i < cmp->top_count; i++) {
+        const dir_change_t *d = &cmp->top_dirs[i];
+        output_format(&out, "  %12s  (",
+                      format_size_change(d->old_bytes, d->new_bytes, size_buf, sizeof(size_buf)));
+        output_count_change(&out, d->old_files, d->new_files);
+        output_str(&out, " files)  ");
+        output_str(&out, d->path);
+        output_char(&out, '\n');
+    }
+    output_char(&out, '\n');
+    output_flush(&out);
 }
@@ -1,342 +1,473 @@
 #include "diskogram.h"
 #include <stdio.h>
-#include <string.h>
 
-/* Escape a string for safe JSON output */
-static void print_json_escaped(const char *str) {
-    if (!str) {
-        printf("null");
-        return;
+static const char* get_mode_name(grouping_mode_t mode) {
+    switch (mode) {
+        case GROUP_BY_CTIME: return "ctime";
+        case GROUP_BY_ATIME: return "atime";
+        case GROUP_BY_MTIME:
+        default:             return "mtime";
     }
+}
 
-    for (const char *p = str; *p; p++) {
-        switch (*p) {
-            case '"':  printf("\\\""); break;
-            case '\\': printf("\\\\"); break;
-            case '\b': printf("\\b"); break;
-            case '\f': printf("\\f"); break;
-            case '\n': printf("\\n"); break;
-            case '\r': printf("\\r"); break;
-            case '\t': printf("\\t"); break;
-            default:
-                if ((unsigned char)*p < 0x20) {
-                    /* Control characters */
-                    printf("\\u%04x", (unsigned char)*p);
-                } else {
-                    putchar(*p);
-                }
-                break;
-        }
+static const char* get_interval_name(interval_t interval) {
+    switch (interval) {
+        case INTERVAL_HOUR: return "hour";
+        case INTERVAL_MONTH: return "month";
+        case INTERVAL_YEAR: return "year";
+        case INTERVAL_DAY:
+        default: return "day";
     }
 }
 
-/* Escape a string for safe XML output */
-static void print_xml_escaped(const char *str) {
-    if (!str) return;
+/* Extra CSV columns of --disk-usage, after the apparent size */
+static const char* allocated_columns(int disk_usage) {
+    return disk_usage ? ",Allocated Bytes,Human-Readable Allocated Size" : "";
+}
 
-    for (const char *p = str; *p; p++) {
-        switch (*p) {
-            case '<':  printf("&lt;"); break;
-            case '>':  printf("&gt;"); break;
-            case '&':  printf("&amp;"); break;
-            case '"':  printf("&quot;"); break;
-            case '\'': printf("&apos;"); break;
-            default:
-                putchar(*p);
-                break;
-        }
-    }
+/* Extra CSV columns of --largest: rows for ranked entries follow each bucket */
+static const char* top_columns(int top) {
+    return top ? ",Kind,Rank,Entry" : "";
 }
 
-static const char* get_interval_format(interval_t interval) {
-    switch (interval) {
-        case INTERVAL_HOUR:
-            return "%Y-%m-%d %H:00";
-        case INTERVAL_DAY:
-            return "%Y-%m-%d";
-        case INTERVAL_MONTH:
-            return "%Y-%m";
-        case INTERVAL_YEAR:
-            return "%Y";
-        default:
-            return "%Y-%m-%d";
+/* Timestamp of a scan, or "unknown" if it cannot be converted */
+static void output_scan_time(output_t *out, time_t t) {
+    if (output_timestamp(out, t) != 0) {
+        output_str(out, "unknown");
     }
 }
 
-void export_csv(const histogram_t *hist, const char *title) {
-    if (!hist || hist->bucket_count == 0) {
-        fprintf(stderr, "No data to export.\n");
-        return;
-    }
+/* Leading fields of a row: optional path, mode/interval, then the bucket time */
+static void output_csv_row_start(output_t *out, const histogram_t *hist, const char *path,
+                                 int with_dimensions, time_t start) {
+    if (path) {
+        output_csv_field(out, path);
+        output_char(out, ',');
+    }
+    if (with_dimensions) {
+        output_str(out, get_mode_name(hist->mode));
+        output_char(out, ',');
+        output_str(out, get_interval_name(hist->interval));
+        output_char(out, ',');
+    }
+    output_bucket_time(out, start, hist->interval);
+    output_char(out, ',');
+}
 
-    char time_buf[64];
+/* Rows of a bucket's largest files or directories; Files and allocated columns stay empty */
+static void output_csv_top_rows(output_t *out, const histogram_t *hist, const char *path,
+                                int with_dimensions, time_t start, const char *kind,
+                                const top_entry_t *entries, size_t count) {
     char size_buf[64];
-    const char *format = get_interval_format(hist->interval);
-
-    printf("# %s\n", title);
-    printf("# Version: %s\n", DISKOGRAM_VERSION);
-    printf("# Scan Duration: %ld seconds\n",
-           (long)(hist->scan_end_time - hist->scan_start_time));
-    printf("# Directories Scanned: %lu\n", (unsigned long)hist->directories_scanned);
-    printf("# Errors: %lu\n", (unsigned long)hist->error_count);
-    if (hist->error_count > 0 && hist->last_error[0] != '\0') {
-        printf("# Last Error: %s\n", hist->last_error);
+
+    for (size_t i = 0; i < count; i++) {
+        output_csv_row_start(out, hist, path, with_dimensions, start);
+        output_u64(out, entries[i].bytes);
+        output_str(out, ",,");
+        output_str(out, format_size(entries[i].bytes, size_buf, sizeof(size_buf)));
+        if (hist->disk_usage) {
+            output_str(out, ",,");
+        }
+        output_char(out, ',');
+        output_str(out, kind);
+        output_char(out, ',');
+        output_u64(out, i + 1);
+        output_char(out, ',');
+        output_csv_field(out, entries[i].path);
+        output_char(out, '\n');
     }
-    printf("Time,Bytes,Files,Human-Readable Size\n");
+}
+
+/* Rows of one histogram, prefixed by an optional path and its mode/interval */
+static void output_csv_rows(output_t *out, const histogram_t *hist, const char *path,
+                            int with_dimensions) {
+    char size_buf[64];
 
     for (size_t i = 0; i < hist->bucket_count; i++) {
         time_bucket_t *bucket = &hist->buckets[i];
-        struct tm *tm_info = localtime(&bucket->start_time);
 
-        if (tm_info) {
-            strftime(time_buf, sizeof(time_buf), format, tm_info);
-        } else {
-            snprintf(time_buf, sizeof(time_buf), "unknown");
+        output_csv_row_start(out, hist, path, with_dimensions, bucket->start_time);
+        output_u64(out, bucket->total_bytes);
+        output_char(out, ',');
+        output_u64(out, bucket->file_count);
+        output_char(out, ',');
+        output_str(out, format_size(bucket->total_bytes, size_buf, sizeof(size_buf)));
+        if (hist->disk_usage) {
+            output_char(out, ',');
+            output_u64(out, bucket->allocated_bytes);
+            output_char(out, ',');
+            output_str(out, format_size(bucket->allocated_bytes, size_buf, sizeof(size_buf)));
         }
+        if (hist->top_n > 0) {
+            output_str(out, ",bucket,,");
+        }
+        output_char(out, '\n');
+        output_csv_top_rows(out, hist, path, with_dimensions, bucket->start_time, "file",
+                            bucket->top_files, bucket->top_file_count);
+        output_csv_top_rows(out, hist, path, with_dimensions, bucket->start_time, "directory",
+                            bucket->top_dirs, bucket->top_dir_count);
+    }
+}
 
-        printf("%s,%lu,%lu,%s\n",
-               time_buf,
-               (unsigned long)bucket->total_bytes,
-               (unsigned long)bucket->file_count,
-               format_size(bucket->total_bytes, size_buf, sizeof(size_buf)));
+/* "# ..." metadata lines that open a CSV export */
+static void output_csv_metadata(output_t *out, const histogram_t *hist, const char *title) {
+    output_str(out, "# ");
+    output_str(out, title);
+    output_str(out, "\n# Version: " DISKOGRAM_VERSION "\n# Scan Duration: ");
+    output_i64(out, (int64_t)(hist->scan_end_time - hist->scan_start_time));
+    output_str(out, " seconds\n# Directories Scanned: ");
+    output_u64(out, hist->directories_scanned);
+    output_str(out, "\n# Errors: ");
+    output_u64(out, hist->error_count);
+    output_char(out, '\n');
+    if (hist->error_count > 0 && hist->last_error[0] != '\0') {
+        output_str(out, "# Last Error: ");
+        output_str(out, hist->last_error);
+        output_char(out, '\n');
     }
 }
 
-void export_json(const histogram_t *hist, const char *title) {
+void export_csv(const histogram_t *hist, const char *title) {
     if (!hist || hist->bucket_count == 0) {
         fprintf(stderr, "No data to export.\n");
         return;
     }
 
-    char time_buf[64];
-    const char *format = get_interval_format(hist->interval);
+    output_t out;
+    output_init(&out, stdout);
+    output_csv_metadata(&out, hist, title);
+    output_str(&out, "Time,Bytes,Files,Human-Readable Size");
+    output_str(&out, allocated_columns(hist->disk_usage));
+    output_str(&out, top_columns(hist->top_n > 0));
+    output_char(&out, '\n');
 
-    char start_buf[64], end_buf[64];
-    struct tm *tm_info;
+    output_csv_rows(&out, hist, NULL, 0);
+    output_flush(&out);
+}
+
+/* Start of a JSON line at indentation pad: pad, then "  \"name\": " */
+static void json_key(output_t *out, const char *pad, const char *name) {
+    output_str(out, pad);
+    output_str(out, "  \"");
+    output_str(out, name);
+    output_str(out, "\": ");
+}
 
-    printf("{\n");
-    printf("  \"version\": \"%s\",\n", DISKOGRAM_VERSION);
-    printf("  \"title\": \"");
-    print_json_escaped(title);
-    printf("\",\n");
-    printf("  \"total_bytes\": %lu,\n", (unsigned long)hist->total_bytes);
-    printf("  \"total_files\": %lu,\n", (unsigned long)hist->total_files);
-    printf("  \"interval\": \"");
-    switch (hist->interval) {
-        case INTERVAL_HOUR: printf("hour"); break;
-        case INTERVAL_DAY: printf("day"); break;
-        case INTERVAL_MONTH: printf("month"); break;
-        case INTERVAL_YEAR: printf("year"); break;
+/* An integer member followed by a comma */
+static void json_u64(output_t *out, const char *pad, const char *name, uint64_t value) {
+    json_key(out, pad, name);
+    output_u64(out, value);
+    output_str(out, ",\n");
+}
+
+/* A string member followed by a comma */
+static void json_string(output_t *out, const char *pad, const char *name, const char *value) {
+    json_key(out, pad, name);
+    output_char(out, '"');
+    output_json_escaped(out, value);
+    output_str(out, "\",\n");
+}
+
+/* "name": [...] of a bucket's largest files or directories, one entry per line */
+static void json_top_entries(output_t *out, const char *pad, const char *name,
+                             const top_entry_t *entries, size_t count, int last) {
+    output_str(out, pad);
+    output_str(out, "      \"");
+    output_str(out, name);
+    output_str(out, count > 0 ? "\": [\n" : "\": [");
+    for (size_t i = 0; i < count; i++) {
+        output_str(out, pad);
+        output_str(out, "        {\"path\": \"");
+        output_json_escaped(out, entries[i].path);
+        output_str(out, "\", \"bytes\": ");
+        output_u64(out, entries[i].bytes);
+        output_str(out, i < count - 1 ? "},\n" : "}\n");
+    }
+    if (count > 0) {
+        output_str(out, pad);
+        output_str(out, "      ");
+    }
+    output_str(out, last ? "]\n" : "],\n");
+}
+
+/*
+ * One histogram as a JSON object, every line indented by pad; the closing
+ * brace is not followed by a newline so arrays can place their separator.
+ */
+static void output_json_histogram(output_t *out, const histogram_t *hist, const char *title,
+                                  const char *pad, int with_mode) {
+    output_str(out, pad);
+    output_str(out, "{\n");
+    json_string(out, pad, "version", DISKOGRAM_VERSION);
+    json_string(out, pad, "title", title);
+    json_u64(out, pad, "total_bytes", hist->total_bytes);
+    if (hist->disk_usage) {
+        json_u64(out, pad, "total_allocated_bytes", hist->total_allocated);
+    }
+    json_u64(out, pad, "total_files", hist->total_files);
+    json_string(out, pad, "interval", get_interval_name(hist->interval));
+    if (with_mode) {
+        json_string(out, pad, "mode", get_mode_name(hist->mode));
     }
-    printf("\",\n");
 
     /* Scan metadata */
-    tm_info = localtime(&hist->scan_start_time);
-    if (tm_info) {
-        strftime(start_buf, sizeof(start_buf), "%Y-%m-%dT%H:%M:%S", tm_info);
-    } else {
-        snprintf(start_buf, sizeof(start_buf), "unknown");
-    }
-    printf("  \"scan_start\": \"%s\",\n", start_buf);
-
-    tm_info = localtime(&hist->scan_end_time);
-    if (tm_info) {
-        strftime(end_buf, sizeof(end_buf), "%Y-%m-%dT%H:%M:%S", tm_info);
-    } else {
-        snprintf(end_buf, sizeof(end_buf), "unknown");
-    }
-    printf("  \"scan_end\": \"%s\",\n", end_buf);
-    printf("  \"scan_duration_seconds\": %ld,\n",
-           (long)(hist->scan_end_time - hist->scan_start_time));
-    printf("  \"directories_scanned\": %lu,\n", (unsigned long)hist->directories_scanned);
-    printf("  \"error_count\": %lu,\n", (unsigned long)hist->error_count);
+    json_key(out, pad, "scan_start");
+    output_char(out, '"');
+    output_scan_time(out, hist->scan_start_time);
+    output_str(out, "\",\n");
+    json_key(out, pad, "scan_end");
+    output_char(out, '"');
+    output_scan_time(out, hist->scan_end_time);
+    output_str(out, "\",\n");
+    json_key(out, pad, "scan_duration_seconds");
+    output_i64(out, (int64_t)(hist->scan_end_time - hist->scan_start_time));
+    output_str(out, ",\n");
+    json_u64(out, pad, "directories_scanned", hist->directories_scanned);
+    json_u64(out, pad, "error_count", hist->error_count);
     if (hist->error_count > 0 && hist->last_error[0] != '\0') {
-        printf("  \"last_error\": \"");
-        print_json_escaped(hist->last_error);
-        printf("\",\n");
+        json_string(out, pad, "last_error", hist->last_error);
     }
 
-    printf("  \"buckets\": [\n");
+    json_key(out, pad, "buckets");
+    output_str(out, "[\n");
 
     for (size_t i = 0; i < hist->bucket_count; i++) {
         time_bucket_t *bucket = &hist->buckets[i];
-        struct tm *tm_info = localtime(&bucket->start_time);
 
-        if (tm_info) {
-            strftime(time_buf, sizeof(time_buf), format, tm_info);
+        output_str(out, pad);
+        output_str(out, "    {\n");
+        output_str(out, pad);
+        output_str(out, "      \"time\": \"");
+        output_bucket_time(out, bucket->start_time, hist->interval);
+        output_str(out, "\",\n");
+        output_str(out, pad);
+        output_str(out, "      \"bytes\": ");
+        output_u64(out, bucket->total_bytes);
+        output_str(out, ",\n");
+        if (hist->disk_usage) {
+            output_str(out, pad);
+            output_str(out, "      \"allocated_bytes\": ");
+            output_u64(out, bucket->allocated_bytes);
+            output_str(out, ",\n");
+        }
+        output_str(out, pad);
+        output_str(out, "      \"files\": ");
+        output_u64(out, bucket->file_count);
+        if (hist->top_n > 0) {
+            output_str(out, ",\n");
+            json_top_entries(out, pad, "largest_files", bucket->top_files,
+                             bucket->top_file_count, 0);
+            json_top_entries(out, pad, "largest_directories", bucket->top_dirs,
+                             bucket->top_dir_count, 1);
         } else {
-            snprintf(time_buf, sizeof(time_buf), "unknown");
+            output_char(out, '\n');
         }
-
-        printf("    {\n");
-        printf("      \"time\": \"%s\",\n", time_buf);
-        printf("      \"bytes\": %lu,\n", (unsigned long)bucket->total_bytes);
-        printf("      \"files\": %lu\n", (unsigned long)bucket->file_count);
-        printf("    }%s\n", (i < hist->bucket_count - 1) ? "," : "");
+        output_str(out, pad);
+        output_str(out, i < hist->bucket_count - 1 ? "    },\n" : "    }\n");
     }
 
-    printf("  ]\n");
-    printf("}\n");
+    output_str(out, pad);
+    output_str(out, "  ]\n");
+    output_str(out, pad);
+    output_char(out, '}');
 }
 
-void export_xml(const histogram_t *hist, const char *title) {
+void export_json(const histogram_t *hist, const char *title) {
     if (!hist || hist->bucket_count == 0) {
         fprintf(stderr, "No data to export.\n");
         return;
     }
 
-    char time_buf[64];
-    const char *format = get_interval_format(hist->interval);
+    output_t out;
+    output_init(&out, stdout);
+    output_json_histogram(&out, hist, title, "", 0);
+    output_char(&out, '\n');
+    output_flush(&out);
+}
 
-    char start_buf[64], end_buf[64];
-    struct tm *tm_info;
+/* "<name>value</name>" line at indentation pad plus two spaces */
+static void xml_u64(output_t *out, const char *pad, const char *name, uint64_t value) {
+    output_str(out, pad);
+    output_str(out, "  <");
+    output_str(out, name);
+    output_char(out, '>');
+    output_u64(out, value);
+    output_str(out, "</");
+    output_str(out, name);
+    output_str(out, ">\n");
+}
 
-    printf("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
-    printf("<histogram>\n");
-    printf("  <version>%s</version>\n", DISKOGRAM_VERSION);
-    printf("  <title>");
-    print_xml_escaped(title);
-    printf("</title>\n");
-    printf("  <total_bytes>%lu</total_bytes>\n", (unsigned long)hist->total_bytes);
-    printf("  <total_files>%lu</total_files>\n", (unsigned long)hist->total_files);
-    printf("  <interval>");
-    switch (hist->interval) {
-        case INTERVAL_HOUR: printf("hour"); break;
-        case INTERVAL_DAY: printf("day"); break;
-        case INTERVAL_MONTH: printf("month"); break;
-        case INTERVAL_YEAR: printf("year"); break;
-    }
-    printf("</interval>\n");
+static void xml_i64(output_t *out, const char *pad, const char *name, int64_t value) {
+    output_str(out, pad);
+    output_str(out, "  <");
+    output_str(out, name);
+    output_char(out, '>');
+    output_i64(out, value);
+    output_str(out, "</");
+    output_str(out, name);
+    output_str(out, ">\n");
+}
+
+static void xml_string(output_t *out, const char *pad, const char *name, const char *value) {
+    output_str(out, pad);
+    output_str(out, "  <");
+    output_str(out, name);
+    output_char(out, '>');
+    output_xml_escaped(out, value);
+    output_str(out, "</");
+    output_str(out, name);
+    output_str(out, ">\n");
+}
+
+/* Scan time element, "unknown" if the time cannot be converted as in JSON */
+static void xml_scan_time(output_t *out, const char *pad, const char *name, time_t t) {
+    output_str(out, pad);
+    output_str(out, "  <");
+    output_str(out, name);
+    output_char(out, '>');
+    output_scan_time(out, t);
+    output_str(out, "</");
+    output_str(out, name);
+    output_str(out, ">\n");
+}
+
+/* <name> list of a bucket's largest files or directories, as <kind> elements */
+static void xml_top_entries(output_t *out, const char *pad, const char *name, const char *kind,
+                            const top_entry_t *entries, size_t count) {
+    output_str(out, pad);
+    output_str(out, "      <");
+    output_str(out, name);
+    output_str(out, ">\n");
+    for (size_t i = 0; i < count; i++) {
+        output_str(out, pad);
+        output_str(out, "        <");
+        output_str(out, kind);
+        output_str(out, "><path>");
+        output_xml_escaped(out, entries[i].path);
+        output_str(out, "</path><bytes>");
+        output_u64(out, entries[i].bytes);
+        output_str(out, "</bytes></");
+        output_str(out, kind);
+        output_str(out, ">\n");
+    }
+    output_str(out, pad);
+    output_str(out, "      </");
+    output_str(out, name);
+    output_str(out, ">\n");
+}
+
+/* One histogram as a <histogram> element, every line indented by pad */
+static void output_xml_histogram(output_t *out, const histogram_t *hist, const char *title,
+                                 const char *pad, int with_mode) {
+    output_str(out, pad);
+    output_str(out, "<histogram>\n");
+    xml_string(out, pad, "version", DISKOGRAM_VERSION);
+    xml_string(out, pad, "title", title);
+    xml_u64(out, pad, "total_bytes", hist->total_bytes);
+    if (hist->disk_usage) {
+        xml_u64(out, pad, "total_allocated_bytes", hist->total_allocated);
+    }
+    xml_u64(out, pad, "total_files", hist->total_files);
+    xml_string(out, pad, "interval", get_interval_name(hist->interval));
+    if (with_mode) {
+        xml_string(out, pad, "mode", get_mode_name(hist->mode));
+    }
 
     /* Scan metadata */
-    tm_info = localtime(&hist->scan_start_time);
-    if (tm_info) {
-        strftime(start_buf, sizeof(start_buf), "%Y-%m-%dT%H:%M:%S", tm_info);
-        printf("  <scan_start>%s</scan_start>\n", start_buf);
-    }
-    tm_info = localtime(&hist->scan_end_time);
-    if (tm_info) {
-        strftime(end_buf, sizeof(end_buf), "%Y-%m-%dT%H:%M:%S", tm_info);
-        printf("  <scan_end>%s</scan_end>\n", end_buf);
-    }
-    printf("  <scan_duration_seconds>%ld</scan_duration_seconds>\n",
-           (long)(hist->scan_end_time - hist->scan_start_time));
-    printf("  <directories_scanned>%lu</directories_scanned>\n",
-           (unsigned long)hist->directories_scanned);
-    printf("  <error_count>%lu</error_count>\n", (unsigned long)hist->error_count);
+    xml_scan_time(out, pad, "scan_start", hist->scan_start_time);
+    xml_scan_time(out, pad, "scan_end", hist->scan_end_time);
+    xml_i64(out, pad, "scan_duration_seconds",
+            (int64_t)(hist->scan_end_time - hist->scan_start_time));
+    xml_u64(out, pad, "directories_scanned", hist->directories_scanned);
+    xml_u64(out, pad, "error_count", hist->error_count);
     if (hist->error_count > 0 && hist->last_error[0] != '\0') {
-        printf("  <last_error>");
-        print_xml_escaped(hist->last_error);
-        printf("</last_error>\n");
+        xml_string(out, pad, "last_error", hist->last_error);
     }
 
-    printf("  <buckets>\n");
+    output_str(out, pad);
+    output_str(out, "  <buckets>\n");
 
     for (size_t i = 0; i < hist->bucket_count; i++) {
         time_bucket_t *bucket = &hist->buckets[i];
-        struct tm *tm_info = localtime(&bucket->start_time);
 
-        if (tm_info) {
-            strftime(time_buf, sizeof(time_buf), format, tm_info);
-        } else {
-            snprintf(time_buf, sizeof(time_buf), "unknown");
+        output_str(out, pad);
+        output_str(out, "    <bucket>\n");
+        output_str(out, pad);
+        output_str(out, "      <time>");
+        output_bucket_time(out, bucket->start_time, hist->interval);
+        output_str(out, "</time>\n");
+        output_str(out, pad);
+        output_str(out, "      <bytes>");
+        output_u64(out, bucket->total_bytes);
+        output_str(out, "</bytes>\n");
+        if (hist->disk_usage) {
+            output_str(out, pad);
+            output_str(out, "      <allocated_bytes>");
+            output_u64(out, bucket->allocated_bytes);
+            output_str(out, "</allocated_bytes>\n");
+        }
+        output_str(out, pad);
+        output_str(out, "      <files>");
+        output_u64(out, bucket->file_count);
+        output_str(out, "</files>\n");
+        if (hist->top_n > 0) {
+            xml_top_entries(out, pad, "largest_files", "file", bucket->top_files,
+                            bucket->top_file_count);
+            xml_top_entries(out, pad, "largest_directories", "directory", bucket->top_dirs,
+                            bucket->top_dir_count);
         }
+        output_str(out, pad);
+        output_str(out, "    </bucket>\n");
+    }
+
+    output_str(out, pad);
+    output_str(out, "  </buckets>\n");
+    output_str(out, pad);
+    output_str(out, "</histogram>\n");
+}
 
-        printf("    <bucket>\n");
-        printf("      <time>%s</time>\n", time_buf);
-        printf("      <bytes>%lu</bytes>\n", (unsigned long)bucket->total_bytes);
-        printf("      <files>%lu</files>\n", (unsigned long)bucket->file_count);
-        printf("    </bucket>\n");
+void export_xml(const histogram_t *hist, const char *title) {
+    if (!hist || hist->bucket_count == 0) {
+        fprintf(stderr, "No data to export.\n");
+        return;
     }
 
-    printf("  </buckets>\n");
-    printf("</histogram>\n");
+    output_t out;
+    output_init(&out, stdout);
+    output_str(&out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    output_xml_histogram(&out, hist, title, "", 0);
+    output_flush(&out);
 }
 
-/* Batch export helpers for JSON arrays */
-void export_json_array_start(void) {
+/*
+ * Batch export helpers for JSON arrays. Items are streamed: each one is
+ * written as soon as it is passed in, and the separator goes before an
+ * item rather than after it, so nobody needs to know which item is last.
+ */
+void export_json_array_start(json_array_writer_t *writer) {
+    writer->items = 0;
     printf("[\n");
 }
 
-void export_json_array_item(const histogram_t *hist, const char *title, int is_last) {
+/* with_mode adds the histogram's mode, for sets of more than one */
+void export_json_array_item(json_array_writer_t *writer, const histogram_t *hist,
+                            const char *title, int with_mode) {
     if (!hist || hist->bucket_count == 0) {
         /* Skip empty histograms in batch mode */
         return;
     }
 
-    char time_buf[64];
-    const char *format = get_interval_format(hist->interval);
-
-    char start_buf[64], end_buf[64];
-    struct tm *tm_info;
-
-    printf("  {\n");
-    printf("    \"version\": \"%s\",\n", DISKOGRAM_VERSION);
-    printf("    \"title\": \"");
-    print_json_escaped(title);
-    printf("\",\n");
-    printf("    \"total_bytes\": %lu,\n", (unsigned long)hist->total_bytes);
-    printf("    \"total_files\": %lu,\n", (unsigned long)hist->total_files);
-    printf("    \"interval\": \"");
-    switch (hist->interval) {
-        case INTERVAL_HOUR: printf("hour"); break;
-        case INTERVAL_DAY: printf("day"); break;
-        case INTERVAL_MONTH: printf("month"); break;
-        case INTERVAL_YEAR: printf("year"); break;
-    }
-    printf("\",\n");
-
-    /* Scan metadata */
-    tm_info = localtime(&hist->scan_start_time);
-    if (tm_info) {
-        strftime(start_buf, sizeof(start_buf), "%Y-%m-%dT%H:%M:%S", tm_info);
-    } else {
-        snprintf(start_buf, sizeof(start_buf), "unknown");
-    }
-    printf("    \"scan_start\": \"%s\",\n", start_buf);
-
-    tm_info = localtime(&hist->scan_end_time);
-    if (tm_info) {
-        strftime(end_buf, sizeof(end_buf), "%Y-%m-%dT%H:%M:%S", tm_info);
-    } else {
-        snprintf(end_buf, sizeof(end_buf), "unknown");
-    }
-    printf("    \"scan_end\": \"%s\",\n", end_buf);
-    printf("    \"scan_duration_seconds\": %ld,\n",
-           (long)(hist->scan_end_time - hist->scan_start_time));
-    printf("    \"directories_scanned\": %lu,\n", (unsigned long)hist->directories_scanned);
-    printf("    \"error_count\": %lu,\n", (unsigned long)hist->error_count);
-    if (hist->error_count > 0 && hist->last_error[0] != '\0') {
-        printf("    \"last_error\": \"");
-        print_json_escaped(hist->last_error);
-        printf("\",\n");
-    }
-
-    printf("    \"buckets\": [\n");
-
-    for (size_t i = 0; i < hist->bucket_count; i++) {
-        time_bucket_t *bucket = &hist->buckets[i];
-        struct tm *tm_info = localtime(&bucket->start_time);
-
-        if (tm_info) {
-            strftime(time_buf, sizeof(time_buf), format, tm_info);
-        } else {
-            snprintf(time_buf, sizeof(time_buf), "unknown");
-        }
-
-        printf("      {\n");
-        printf("        \"time\": \"%s\",\n", time_buf);
-        printf("        \"bytes\": %lu,\n", (unsigned long)bucket->total_bytes);
-        printf("        \"files\": %lu\n", (unsigned long)bucket->file_count);
-        printf("      }%s\n", (i < hist->bucket_count - 1) ? "," : "");
+    output_t out;
+    output_init(&out, stdout);
+    if (writer->items++ > 0) {
+        output_str(&out, ",\n");
     }
-
-    printf("    ]\n");
-    printf("  }%s\n", is_last ? "" : ",");
+    output_json_histogram(&out, hist, title, "  ", with_mode);
+    output_flush(&out);
 }
 
-void export_json_array_end(void) {
-    printf("]\n");
+void export_json_array_end(json_array_writer_t *writer) {
+    printf("%s]\n", writer->items > 0 ? "\n" : "");
 }
 
 /* Batch export helpers for XML collections */
@@ -345,77 +476,16 @@ void export_xml_collection_start(void) {
     printf("<histograms>\n");
 }
 
-void export_xml_collection_item(const histogram_t *hist, const char *title) {
+void export_xml_collection_item(const histogram_t *hist, const char *title, int with_mode) {
     if (!hist || hist->bucket_count == 0) {
         /* Skip empty histograms in batch mode */
         return;
     }
 
-    char time_buf[64];
-    const char *format = get_interval_format(hist->interval);
-
-    char start_buf[64], end_buf[64];
-    struct tm *tm_info;
-
-    printf("  <histogram>\n");
-    printf("    <version>%s</version>\n", DISKOGRAM_VERSION);
-    printf("    <title>");
-    print_xml_escaped(title);
-    printf("</title>\n");
-    printf("    <total_bytes>%lu</total_bytes>\n", (unsigned long)hist->total_bytes);
-    printf("    <total_files>%lu</total_files>\n", (unsigned long)hist->total_files);
-    printf("    <interval>");
-    switch (hist->interval) {
-        case INTERVAL_HOUR: printf("hour"); break;
-        case INTERVAL_DAY: printf("day"); break;
-        case INTERVAL_MONTH: printf("month"); break;
-        case INTERVAL_YEAR: printf("year"); break;
-    }
-    printf("</interval>\n");
-
-    /* Scan metadata */
-    tm_info = localtime(&hist->scan_start_time);
-    if (tm_info) {
-        strftime(start_buf, sizeof(start_buf), "%Y-%m-%dT%H:%M:%S", tm_info);
-        printf("    <scan_start>%s</scan_start>\n", start_buf);
-    }
-    tm_info = localtime(&hist->scan_end_time);
-    if (tm_info) {
-        strftime(end_buf, sizeof(end_buf), "%Y-%m-%dT%H:%M:%S", tm_info);
-        printf("    <scan_end>%s</scan_end>\n", end_buf);
-    }
-    printf("    <scan_duration_seconds>%ld</scan_duration_seconds>\n",
-           (long)(hist->scan_end_time - hist->scan_start_time));
-    printf("    <directories_scanned>%lu</directories_scanned>\n",
-           (unsigned long)hist->directories_scanned);
-    printf("    <error_count>%lu</error_count>\n", (unsigned long)hist->error_count);
-    if (hist->error_count > 0 && hist->last_error[0] != '\0') {
-        printf("    <last_error>");
-        print_xml_escaped(hist->last_error);
-        printf("</last_error>\n");
-    }
-
-    printf("    <buckets>\n");
-
-    for (size_t i = 0; i < hist->bucket_count; i++) {
-        time_bucket_t *bucket = &hist->buckets[i];
-        struct tm *tm_info = localtime(&bucket->start_time);
-
-        if (tm_info) {
-            strftime(time_buf, sizeof(time_buf), format, tm_info);
-        } else {
-            snprintf(time_buf, sizeof(time_buf), "unknown");
-        }
-
-        printf("      <bucket>\n");
-        printf("        <time>%s</time>\n", time_buf);
-        printf("        <bytes>%lu</bytes>\n", (unsigned long)bucket->total_bytes);
-        printf("        <files>%lu</files>\n", (unsigned long)bucket->file_count);
-        printf("      </bucket>\n");
-    }
-
-    printf("    </buckets>\n");
-    printf("  </histogram>\n");
+    output_t out;
+    output_init(&out, stdout);
+    output_xml_histogram(&out, hist, title, "  ", with_mode);
+    output_flush(&out);
 }
 
 void export_xml_collection_end(void) {
@@ -423,12 +493,14 @@ void export_xml_collection_end(void) {
 }
 
 /* Batch export helpers for CSV with Path column */
-void export_csv_batch_start(const char *mode_name, interval_t interval) {
+void export_csv_batch_start(const char *mode_name, interval_t interval, int disk_usage,
+                            int top) {
     (void)mode_name; /* Unused - kept for future metadata */
     (void)interval;  /* Unused - kept for future metadata */
 
     /* Output header with Path column */
-    printf("Path,Time,Bytes,Files,Human-Readable Size\n");
+    printf("Path,Time,Bytes,Files,Human-Readable Size%s%s\n", allocated_columns(disk_usage),
+           top_columns(top));
 }
 
 void export_csv_batch_item(const histogram_t *hist, const char *path, interval_t interval) {
@@ -436,48 +508,252 @@ void export_csv_batch_item(const histogram_t *hist, const char *path, interval_t
         /* Skip empty histograms in batch mode */
         return;
     }
+    (void)interval; /* Each histogram carries its own interval */
 
-    char time_buf[64];
-    char size_buf[64];
-    const char *format = get_interval_format(interval);
+    output_t out;
+    output_init(&out, stdout);
+    output_csv_rows(&out, hist, path, 0);
+    output_flush(&out);
+}
 
-    for (size_t i = 0; i < hist->bucket_count; i++) {
-        time_bucket_t *bucket = &hist->buckets[i];
-        struct tm *tm_info = localtime(&bucket->start_time);
+/*
+ * Several histograms of one scan (see scan_directory_multi) in a single
+ * table, told apart by Mode and Interval columns. Scan metadata is shared.
+ */
+void export_csv_set(histogram_t *const *hists, size_t count, const char *title) {
+    if (count == 0) {
+        fprintf(stderr, "No data to export.\n");
+        return;
+    }
 
-        if (tm_info) {
-            strftime(time_buf, sizeof(time_buf), format, tm_info);
-        } else {
-            snprintf(time_buf, sizeof(time_buf), "unknown");
-        }
+    output_t out;
+    output_init(&out, stdout);
+    output_csv_metadata(&out, hists[0], title);
+    output_str(&out, "Mode,Interval,Time,Bytes,Files,Human-Readable Size");
+    output_str(&out, allocated_columns(hists[0]->disk_usage));
+    output_str(&out, top_columns(hists[0]->top_n > 0));
+    output_char(&out, '\n');
 
-        /* CSV with Path column - need to escape path if it contains commas/quotes */
-        int needs_quoting = 0;
-        for (const char *p = path; *p; p++) {
-            if (*p == ',' || *p == '"' || *p == '\n') {
-                needs_quoting = 1;
-                break;
-            }
-        }
+    for (size_t i = 0; i < count; i++) {
+        output_csv_rows(&out, hists[i], NULL, 1);
+    }
+    output_flush(&out);
+}
 
-        if (needs_quoting) {
-            printf("\"");
-            for (const char *p = path; *p; p++) {
-                if (*p == '"') {
-                    printf("\"\""); /* Escape quotes by doubling */
-                } else {
-                    putchar(*p);
-                }
-            }
-            printf("\"");
-        } else {
-            printf("%s", path);
-        }
+void export_csv_batch_set_start(int disk_usage, int top) {
+    printf("Path,Mode,Interval,Time,Bytes,Files,Human-Readable Size%s%s\n",
+           allocated_columns(disk_usage), top_columns(top));
+}
 
-        printf(",%s,%lu,%lu,%s\n",
-               time_buf,
-               (unsigned long)bucket->total_bytes,
-               (unsigned long)bucket->file_count,
-               format_size(bucket->total_bytes, size_buf, sizeof(size_buf)));
+void export_csv_batch_set_item(histogram_t *const *hists, size_t count, const char *path) {
+    output_t out;
+    output_init(&out, stdout);
+    for (size_t i = 0; i < count; i++) {
+        output_csv_rows(&out, hists[i], path, 1);
     }
+    output_flush(&out);
+}
+
+/* ---- Snapshot comparisons (--compare-with) ---- */
+
+static int64_t change(uint64_t old_value, uint64_t new_value) {
+    return (int64_t)(new_value - old_value);
+}
+
+/* ",old,new,change" CSV columns */
+static void output_csv_change(output_t *out, uint64_t old_value, uint64_t new_value) {
+    output_char(out, ',');
+    output_u64(out, old_value);
+    output_char(out, ',');
+    output_u64(out, new_value);
+    output_char(out, ',');
+    output_i64(out, change(old_value, new_value));
+}
+
+void export_csv_comparison(const comparison_t *cmp, const char *title) {
+    output_t out;
+    output_init(&out, stdout);
+
+    output_str(&out, "# ");
+    output_str(&out, title);
+    output_str(&out, "\n# Version: " DISKOGRAM_VERSION "\n# Previous Scan: ");
+    output_scan_time(&out, cmp->old_scan_time);
+    output_str(&out, "\n# Current Scan: ");
+    output_scan_time(&out, cmp->new_scan_time);
+    output_str(&out, "\n# Directories Added: ");
+    output_u64(&out, cmp->dirs_added);
+    output_str(&out, "\n# Directories Removed: ");
+    output_u64(&out, cmp->dirs_removed);
+    output_str(&out, "\n# Directories Changed: ");
+    output_u64(&out, cmp->dirs_changed);
+    output_str(&out, "\nType,Key,Old Bytes,New Bytes,Byte Change,Old Files,New Files,File Change\n");
+
+    output_str(&out, "total,");
+    output_csv_change(&out, cmp->old_bytes, cmp->new_bytes);
+    output_csv_change(&out, cmp->old_files, cmp->new_files);
+    output_char(&out, '\n');
+    for (size_t i = 0; i < cmp->bucket_count; i++) {
+        const bucket_change_t *b = &cmp->buckets[i];
+        output_str(&out, "bucket,");
+        output_bucket_time(&out, b->start_time, cmp->interval);
+        output_csv_change(&out, b->old_bytes, b->new_bytes);
+        output_csv_change(&out, b->old_files, b->new_files);
+        output_char(&out, '\n');
+    }
+    for (size_t i = 0; i < cmp->top_count; i++) {
+        const dir_change_t *d = &cmp->top_dirs[i];
+        output_str(&out, "directory,");
+        output_csv_field(&out, d->path);
+        output_csv_change(&out, d->old_bytes, d->new_bytes);
+        output_csv_change(&out, d->old_files, d->new_files);
+        output_char(&out, '\n');
+    }
+    output_flush(&out);
+}
+
+/* A signed integer member followed by a comma, or a newline if last */
+static void json_i64(output_t *out, const char *pad, const char *name, int64_t value,
+                     int last) {
+    json_key(out, pad, name);
+    output_i64(out, value);
+    output_str(out, last ? "\n" : ",\n");
+}
+
+/* "previous"/"current" object of a comparison */
+static void json_comparison_side(output_t *out, const char *name, const char *label,
+                                 time_t scan_time, uint64_t bytes, uint64_t files) {
+    json_key(out, "", name);
+    output_str(out, "{\n");
+    json_string(out, "  ", "label", label);
+    json_key(out, "  ", "scan_start");
+    output_char(out, '"');
+    output_scan_time(out, scan_time);
+    output_str(out, "\",\n");
+    json_u64(out, "  ", "total_bytes", bytes);
+    json_key(out, "  ", "total_files");
+    output_u64(out, files);
+    output_str(out, "\n  },\n");
+}
+
+void export_json_comparison(const comparison_t *cmp, const char *title) {
+    output_t out;
+    output_init(&out, stdout);
+
+    output_str(&out, "{\n");
+    json_string(&out, "", "version", DISKOGRAM_VERSION);
+    json_string(&out, "", "title", title);
+    json_string(&out, "", "interval", get_interval_name(cmp->interval));
+    json_string(&out, "", "mode", get_mode_name(cmp->mode));
+
+    json_comparison_side(&out, "previous", cmp->old_label, cmp->old_scan_time,
+                         cmp->old_bytes, cmp->old_files);
+    json_comparison_side(&out, "current", cmp->new_label, cmp->new_scan_time,
+                         cmp->new_bytes, cmp->new_files);
+    json_i64(&out, "", "bytes_change", change(cmp->old_bytes, cmp->new_bytes), 0);
+    json_i64(&out, "", "files_change", change(cmp->old_files, cmp->new_files), 0);
+    json_u64(&out, "", "directories_added", cmp->dirs_added);
+    json_u64(&out, "", "directories_removed", cmp->dirs_removed);
+    json_u64(&out, "", "directories_changed", cmp->dirs_changed);
+
+    output_str(&out, "  \"buckets\": [\n");
+    for (size_t i = 0; i < cmp->bucket_count; i++) {
+        const bucket_change_t *b = &cmp->buckets[i];
+        output_str(&out, "    {\n      \"time\": \"");
+        output_bucket_time(&out, b->start_time, cmp->interval);
+        output_str(&out, "\",\n");
+        json_u64(&out, "    ", "old_bytes", b->old_bytes);
+        json_u64(&out, "    ", "new_bytes", b->new_bytes);
+        json_i64(&out, "    ", "bytes_change", change(b->old_bytes, b->new_bytes), 0);
+        json_u64(&out, "    ", "old_files", b->old_files);
+        json_u64(&out, "    ", "new_files", b->new_files);
+        json_i64(&out, "    ", "files_change", change(b->old_files, b->new_files), 1);
+        output_str(&out, i < cmp->bucket_count - 1 ? "    },\n" : "    }\n");
+    }
+    output_str(&out, "  ],\n");
+
+    output_str(&out, "  \"top_directories\": [\n");
+    for (size_t i = 0; i < cmp->top_count; i++) {
+        const dir_change_t *d = &cmp->top_dirs[i];
+        output_str(&out, "    {\n");
+        json_string(&out, "    ", "path", d->path);
+        json_u64(&out, "    ", "old_bytes", d->old_bytes);
+        json_u64(&out, "    ", "new_bytes", d->new_bytes);
+        json_i64(&out, "    ", "bytes_change", change(d->old_bytes, d->new_bytes), 0);
+        json_i64(&out, "    ", "files_change", change(d->old_files, d->new_files), 0);
+        json_i64(&out, "    ", "subtree_bytes_change",
+                 change(d->old_tree_bytes, d->new_tree_bytes), 1);
+        output_str(&out, i < cmp->top_count - 1 ? "    },\n" : "    }\n");
+    }
+    output_str(&out, "  ]\n}\n");
+    output_flush(&out);
+}
+
+/* "previous"/"current" element of a comparison */
+static void xml_comparison_side(output_t *out, const char *name, const char *label,
+                                time_t scan_time, uint64_t bytes, uint64_t files) {
+    output_str(out, "  <");
+    output_str(out, name);
+    output_str(out, ">\n");
+    xml_string(out, "  ", "label", label);
+    output_str(out, "    <scan_start>");
+    output_scan_time(out, scan_time);
+    output_str(out, "</scan_start>\n");
+    xml_u64(out, "  ", "total_bytes", bytes);
+    xml_u64(out, "  ", "total_files", files);
+    output_str(out, "  </");
+    output_str(out, name);
+    output_str(out, ">\n");
+}
+
+void export_xml_comparison(const comparison_t *cmp, const char *title) {
+    output_t out;
+    output_init(&out, stdout);
+
+    output_str(&out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<comparison>\n");
+    xml_string(&out, "", "version", DISKOGRAM_VERSION);
+    xml_string(&out, "", "title", title);
+    xml_string(&out, "", "interval", get_interval_name(cmp->interval));
+    xml_string(&out, "", "mode", get_mode_name(cmp->mode));
+
+    xml_comparison_side(&out, "previous", cmp->old_label, cmp->old_scan_time,
+                        cmp->old_bytes, cmp->old_files);
+    xml_comparison_side(&out, "current", cmp->new_label, cmp->new_scan_time,
+                        cmp->new_bytes, cmp->new_files);
+    xml_i64(&out, "", "bytes_change", change(cmp->old_bytes, cmp->new_bytes));
+    xml_i64(&out, "", "files_change", change(cmp->old_files, cmp->new_files));
+    xml_u64(&out, "", "directories_added", cmp->dirs_added);
+    xml_u64(&out, "", "directories_removed", cmp->dirs_removed);
+    xml_u64(&out, "", "directories_changed", cmp->dirs_changed);
+
+    output_str(&out, "  <buckets>\n");
+    for (size_t i = 0; i < cmp->bucket_count; i++) {
+        const bucket_change_t *b = &cmp->buckets[i];
+        output_str(&out, "    <bucket>\n      <time>");
+        output_bucket_time(&out, b->start_time, cmp->interval);
+        output_str(&out, "</time>\n");
+        xml_u64(&out, "    ", "old_bytes", b->old_bytes);
+        xml_u64(&out, "    ", "new_bytes", b->new_bytes);
+        xml_i64(&out, "    ", "bytes_change", change(b->old_bytes, b->new_bytes));
+        xml_u64(&out, "    ", "old_files", b->old_files);
+        xml_u64(&out, "    ", "new_files", b->new_files);
+        xml_i64(&out, "    ", "files_change", change(b->old_files, b->new_files));
+        output_str(&out, "    </bucket>\n");
+    }
+    output_str(&out, "  </buckets>\n");
+
+    output_str(&out, "  <top_directories>\n");
+    for (size_t i = 0; i < cmp->top_count; i++) {
+        const dir_change_t *d = &cmp->top_dirs[i];
+        output_str(&out, "    <directory>\n");
+        xml_string(&out, "    ", "path", d->path);
+        xml_u64(&out, "    ", "old_bytes", d->old_bytes);
+        xml_u64(&out, "    ", "new_bytes", d->new_bytes);
+        xml_i64(&out, "    ", "bytes_change", change(d->old_bytes, d->new_bytes));
+        xml_i64(&out, "    ", "files_change", change(d->old_files, d->new_files));
+        xml_i64(&out, "    ", "subtree_bytes_change",
+                change(d->old_tree_bytes, d->new_tree_bytes));
+        output_str(&out, "    </directory>\n");
+    }
+    output_str(&out, "  </top_directories>\n</comparison>\n");
+    output_flush(&out);
 }
@@ -4,53 +4,85 @@
 #include <string.h>
 
 #define INITIAL_BUCKET_CAPACITY 128
-#define SECONDS_PER_HOUR (60 * 60)
-#define SECONDS_PER_DAY (24 * 60 * 60)
-
-static time_t normalize_time(time_t t, interval_t interval) {
-    struct tm *tm_info;
-    struct tm tm_copy;
-
-    switch (interval) {
-        case INTERVAL_HOUR:
-            return (t / SECONDS_PER_HOUR) * SECONDS_PER_HOUR;
-
-        case INTERVAL_DAY:
-            return (t / SECONDS_PER_DAY) * SECONDS_PER_DAY;
-
-        case INTERVAL_MONTH:
-            tm_info = localtime(&t);
-            if (!tm_info) return t;
-            tm_copy = *tm_info;
-            tm_copy.tm_mday = 1;
-            tm_copy.tm_hour = 0;
-            tm_copy.tm_min = 0;
-            tm_copy.tm_sec = 0;
-            tm_copy.tm_isdst = -1;  /* Let mktime() determine DST */
-            return mktime(&tm_copy);
-
-        case INTERVAL_YEAR:
-            tm_info = localtime(&t);
-            if (!tm_info) return t;
-            tm_copy = *tm_info;
-            tm_copy.tm_mon = 0;
-            tm_copy.tm_mday = 1;
-            tm_copy.tm_hour = 0;
-            tm_copy.tm_min = 0;
-            tm_copy.tm_sec = 0;
-            tm_copy.tm_isdst = -1;  /* Let mktime() determine DST */
-            return mktime(&tm_copy);
-
-        default:
-            return (t / SECONDS_PER_DAY) * SECONDS_PER_DAY;
-    }
-}
-
-static int compare_buckets(const void *a, const void *b) {
-    const time_bucket_t *ba = (const time_bucket_t *)a;
-    const time_bucket_t *bb = (const time_bucket_t *)b;
-    if (ba->start_time < bb->start_time) return -1;
-    if (ba->start_time > bb->start_time) return 1;
+#define INITIAL_PAGE_CAPACITY 64
+#define INITIAL_TOP_CAPACITY 64
+#define INITIAL_DIR_SUMS 16
+#define INITIAL_EXACT_CAPACITY 16
+
+/*
+ * Base resolution. Today's UTC offsets are whole quarter hours, so local
+ * hour and day boundaries normally fall on slot edges and roll up exactly
+ * from the slots. Not always: local mean time before standard time, or a
+ * DST change at 00:01 (St. John's until 2011), puts boundaries between
+ * edges. A day whose boundaries the calendar reports off the grid counts
+ * its files into exact buckets at the histogram's resolution instead. A
+ * page covers a UTC day at about 2.3 KB, which a scan spread over decades
+ * pays for every day it touches; histograms that need nothing finer than a
+ * month count local months instead, eight years to a page.
+ */
+#define SLOT_SECONDS (15 * 60)
+#define SLOTS_PER_PAGE 96       /* one UTC day, or eight years of months */
+
+struct histogram_page {
+    int64_t number;             /* first slot / SLOTS_PER_PAGE */
+    int exact;                  /* off the slot grid: files go to hist->exact */
+    uint64_t bytes[SLOTS_PER_PAGE];
+    uint64_t allocated[SLOTS_PER_PAGE];
+    uint64_t files[SLOTS_PER_PAGE];
+};
+
+/*
+ * Largest files and directories (--largest). Every ranked interval keeps,
+ * per bucket, a bounded min-heap of top_n files and one of top_n
+ * directories: a candidate only has to beat the smallest entry kept, so
+ * most files are turned away after one comparison and before their path
+ * is built. Entries rank by bytes, then by path, so the result does not
+ * depend on the order files were scanned in.
+ */
+struct top_bucket {
+    interval_t interval;
+    time_t start;
+    size_t file_count;
+    size_t dir_count;
+    top_entry_t *files;         /* top_n slots each, inside entries[] */
+    top_entry_t *dirs;
+    top_entry_t entries[];
+};
+
+/* Totals of one bucket at a histogram's resolution, see histogram_t.exact */
+struct exact_bucket {
+    time_t start;
+    uint64_t bytes;
+    uint64_t allocated;
+    uint64_t files;             /* 0 = empty table entry */
+};
+
+/* A directory's bytes in one bucket, see top_dir_sums_t */
+struct top_sum {
+    interval_t interval;
+    time_t start;
+    uint64_t bytes;
+};
+
+/* Thread-safe localtime; errors may be logged from several threads at once */
+static struct tm* local_time(const time_t *t, struct tm *result) {
+#ifdef _WIN32
+    return localtime_s(result, t) == 0 ? result : NULL;
+#else
+    return localtime_r(t, result);
+#endif
+}
+
+static int64_t floor_div(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+static int compare_pages(const void *a, const void *b) {
+    const histogram_page_t *pa = *(const histogram_page_t *const *)a;
+    const histogram_page_t *pb = *(const histogram_page_t *const *)b;
+    if (pa->number < pb->number) return -1;
+    if (pa->number > pb->number) return 1;
     return 0;
 }
 
@@ -59,16 +91,36 @@ histogram_t* histogram_create(interval_t interval) {
     if (!hist) return NULL;
 
     hist->buckets = malloc(sizeof(time_bucket_t) * INITIAL_BUCKET_CAPACITY);
-    if (!hist->buckets) {
+    hist->pages = calloc(INITIAL_PAGE_CAPACITY, sizeof(histogram_page_t *));
+    hist->calendar = calendar_create();
+    if (!hist->buckets || !hist->pages || !hist->calendar) {
+        free(hist->buckets);
+        free(hist->pages);
+        calendar_destroy(hist->calendar);
         free(hist);
         return NULL;
     }
 
     hist->bucket_count = 0;
     hist->bucket_capacity = INITIAL_BUCKET_CAPACITY;
+    hist->page_count = 0;
+    hist->page_capacity = INITIAL_PAGE_CAPACITY;
+    hist->last_page = NULL;
+    hist->exact = NULL;
+    hist->exact_count = 0;
+    hist->exact_capacity = 0;
     hist->total_bytes = 0;
+    hist->total_allocated = 0;
     hist->total_files = 0;
     hist->interval = interval;
+    hist->resolution = interval;
+    hist->mode = GROUP_BY_MTIME;
+    hist->disk_usage = 0;
+    hist->top_n = 0;
+    hist->top_intervals = 0;
+    hist->tops = NULL;
+    hist->top_count = 0;
+    hist->top_capacity = 0;
 
     /* Initialize scan metadata */
     hist->scan_start_time = time(NULL);
@@ -76,6 +128,7 @@ histogram_t* histogram_create(interval_t interval) {
     hist->error_count = 0;
     hist->directories_scanned = 0;
     hist->last_error[0] = '\0';
+    hist->out_of_memory = 0;
 
     /* Initialize error logging */
     hist->error_log_file = NULL;
@@ -86,57 +139,742 @@ histogram_t* histogram_create(interval_t interval) {
 
 void histogram_destroy(histogram_t *hist) {
     if (!hist) return;
+    for (size_t i = 0; i < hist->page_capacity; i++) {
+        free(hist->pages[i]);
+    }
+    free(hist->pages);
+    free(hist->exact);
+    for (size_t i = 0; i < hist->top_capacity; i++) {
+        top_bucket_t *top = hist->tops[i];
+        if (!top) continue;
+        for (size_t j = 0; j < top->file_count; j++) free(top->files[j].path);
+        for (size_t j = 0; j < top->dir_count; j++) free(top->dirs[j].path);
+        free(top);
+    }
+    free(hist->tops);
     free(hist->buckets);
+    calendar_destroy(hist->calendar);
     free(hist);
 }
 
+/* splitmix64 finalizer: keys such as page numbers are consecutive, so mix well */
+static uint64_t mix64(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+/* Position in the page table where page `number` lives or would be inserted */
+static size_t page_slot(const histogram_t *hist, int64_t number) {
+    size_t mask = hist->page_capacity - 1;
+    size_t slot = (size_t)mix64((uint64_t)number) & mask;
+    while (hist->pages[slot] != NULL && hist->pages[slot]->number != number) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static int page_table_grow(histogram_t *hist) {
+    size_t old_capacity = hist->page_capacity;
+    histogram_page_t **old_pages = hist->pages;
+    histogram_page_t **new_pages = calloc(old_capacity * 2, sizeof(histogram_page_t *));
+    if (!new_pages) return -1;
+
+    hist->pages = new_pages;
+    hist->page_capacity = old_capacity * 2;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_pages[i]) hist->pages[page_slot(hist, old_pages[i]->number)] = old_pages[i];
+    }
+    free(old_pages);
+    return 0;
+}
+
+/* Whether the base slots are local months rather than 15 minutes */
+static int month_slots(const histogram_t *hist) {
+    return hist->resolution >= INTERVAL_MONTH;
+}
+
+/* Whether the local boundaries within UTC day page `number` all fall on slot edges */
+static int page_on_grid(histogram_t *hist, int64_t number) {
+    time_t first = (time_t)(number * SLOTS_PER_PAGE * SLOT_SECONDS);
+    time_t last = first + SLOTS_PER_PAGE * SLOT_SECONDS - 1;
+
+    /* A UTC day reaches into at most two local months */
+    return calendar_on_grid(hist->calendar, first, SLOT_SECONDS) &&
+           calendar_on_grid(hist->calendar, last, SLOT_SECONDS);
+}
+
+/* Find page `number`, creating it (zeroed) if needed */
+static histogram_page_t* get_page(histogram_t *hist, int64_t number) {
+    size_t slot = page_slot(hist, number);
+    if (hist->pages[slot]) return hist->pages[slot];
+
+    /* Keep the table at most half full */
+    if ((hist->page_count + 1) * 2 > hist->page_capacity) {
+        if (page_table_grow(hist) != 0) return NULL;
+        slot = page_slot(hist, number);
+    }
+
+    histogram_page_t *page = calloc(1, sizeof(histogram_page_t));
+    if (!page) return NULL;
+    page->number = number;
+    page->exact = !month_slots(hist) && !page_on_grid(hist, number);
+    hist->pages[slot] = page;
+    hist->page_count++;
+    return page;
+}
+
+/* Position in the exact table where the bucket at start lives or would be inserted */
+static size_t exact_slot(const histogram_t *hist, time_t start) {
+    size_t mask = hist->exact_capacity - 1;
+    size_t slot = (size_t)mix64((uint64_t)start) & mask;
+    while (hist->exact[slot].files != 0 && hist->exact[slot].start != start) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static int exact_table_grow(histogram_t *hist) {
+    size_t old_capacity = hist->exact_capacity;
+    struct exact_bucket *old_exact = hist->exact;
+    size_t capacity = old_capacity ? old_capacity * 2 : INITIAL_EXACT_CAPACITY;
+    struct exact_bucket *new_exact = calloc(capacity, sizeof(struct exact_bucket));
+    if (!new_exact) return -1;
+
+    hist->exact = new_exact;
+    hist->exact_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_exact[i].files != 0) {
+            hist->exact[exact_slot(hist, old_exact[i].start)] = old_exact[i];
+        }
+    }
+    free(old_exact);
+    return 0;
+}
+
+/* Add to the exact bucket at start, creating it if needed; files must be > 0 */
+static int add_exact(histogram_t *hist, time_t start, uint64_t bytes, uint64_t allocated,
+                     uint64_t files) {
+    size_t slot = 0;
+    int found = 0;
+
+    if (hist->exact_capacity > 0) {
+        slot = exact_slot(hist, start);
+        found = hist->exact[slot].files != 0;
+    }
+    if (!found) {
+        /* Keep the table at most half full */
+        if ((hist->exact_count + 1) * 2 > hist->exact_capacity) {
+            if (exact_table_grow(hist) != 0) return -1;
+        }
+        slot = exact_slot(hist, start);
+        hist->exact[slot].start = start;
+        hist->exact_count++;
+    }
+    hist->exact[slot].bytes += bytes;
+    hist->exact[slot].allocated += allocated;
+    hist->exact[slot].files += files;
+    return 0;
+}
+
+/*
+ * Count at a base fine enough to roll up to interval and every coarser
+ * one, including hist's own. Set before anything is added.
+ */
+void histogram_set_resolution(histogram_t *hist, interval_t interval) {
+    if (!hist) return;
+    hist->resolution = interval < hist->interval ? interval : hist->interval;
+}
+
+/*
+ * Count files left out for lack of memory as one scan error, the first
+ * time only: under memory pressure a message per file would flood stderr.
+ */
+static void record_out_of_memory(histogram_t *hist) {
+    if (hist->out_of_memory) return;
+    hist->out_of_memory = 1;
+    hist->error_count++;
+    snprintf(hist->last_error, sizeof(hist->last_error),
+             "Out of memory: some files were not counted");
+    histogram_log_error(hist, hist->last_error);
+}
+
+static void add_to_slot(histogram_t *hist, time_t file_time, uint64_t size,
+                        uint64_t allocated) {
+    int64_t slot = month_slots(hist) ? calendar_month_index(hist->calendar, file_time)
+                                     : floor_div((int64_t)file_time, SLOT_SECONDS);
+    int64_t number = floor_div(slot, SLOTS_PER_PAGE);
+    histogram_page_t *page = hist->last_page;
+
+    /* Files from one directory tend to share a page: try the last one */
+    if (!page || page->number != number) {
+        page = get_page(hist, number);
+        if (!page) {
+            record_out_of_memory(hist);
+            return;
+        }
+        hist->last_page = page;
+    }
+
+    if (page->exact) {
+        time_t start = calendar_bucket_start(hist->calendar, file_time, hist->resolution);
+        if (add_exact(hist, start, size, allocated, 1) != 0) {
+            record_out_of_memory(hist);
+            return;
+        }
+    } else {
+        size_t idx = (size_t)(slot - number * SLOTS_PER_PAGE);
+        page->bytes[idx] += size;
+        page->allocated[idx] += allocated;
+        page->files[idx]++;
+    }
+    hist->total_bytes += size;
+    hist->total_allocated += allocated;
+    hist->total_files++;
+}
+
+/* A file whose allocated size is unknown is taken to be fully allocated */
 void histogram_add_file(histogram_t *hist, time_t file_time, uint64_t size) {
-    time_t bucket_time = normalize_time(file_time, hist->interval);
-
-    /* Find existing bucket or create new one */
-    size_t i;
-    for (i = 0; i < hist->bucket_count; i++) {
-        if (hist->buckets[i].start_time == bucket_time) {
-            hist->buckets[i].total_bytes += size;
-            hist->buckets[i].file_count++;
-            hist->total_bytes += size;
-            hist->total_files++;
+    add_to_slot(hist, file_time, size, size);
+}
+
+/* The time of a file this histogram groups on */
+static time_t grouping_time(const histogram_t *hist, const file_info_t *info) {
+    switch (hist->mode) {
+        case GROUP_BY_CTIME: return info->ctime;
+        case GROUP_BY_ATIME: return info->atime;
+        case GROUP_BY_MTIME:
+        default:             return info->mtime;
+    }
+}
+
+/* Bucket a file by the time this histogram groups on */
+void histogram_add_file_info(histogram_t *hist, const file_info_t *info) {
+    add_to_slot(hist, grouping_time(hist, info), info->size, info->allocated);
+}
+
+/*
+ * Rank the largest n files and directories of every bucket at each interval
+ * in intervals (a mask of 1 << interval_t). Set before anything is added.
+ */
+void histogram_set_top(histogram_t *hist, size_t n, unsigned intervals) {
+    if (!hist) return;
+    hist->top_n = n < MAX_TOP_ENTRIES ? n : MAX_TOP_ENTRIES;
+    hist->top_intervals = intervals & ((1u << (INTERVAL_YEAR + 1)) - 1);
+}
+
+/* Position in the top table where a bucket lives or would be inserted */
+static size_t top_slot(const histogram_t *hist, interval_t interval, time_t start) {
+    size_t mask = hist->top_capacity - 1;
+    size_t slot = (size_t)mix64((uint64_t)start * 4 + (uint64_t)interval) & mask;
+    while (hist->tops[slot] != NULL &&
+           (hist->tops[slot]->start != start || hist->tops[slot]->interval != interval)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static int top_table_grow(histogram_t *hist) {
+    size_t old_capacity = hist->top_capacity;
+    top_bucket_t **old_tops = hist->tops;
+    size_t capacity = old_capacity ? old_capacity * 2 : INITIAL_TOP_CAPACITY;
+    top_bucket_t **new_tops = calloc(capacity, sizeof(top_bucket_t *));
+    if (!new_tops) return -1;
+
+    hist->tops = new_tops;
+    hist->top_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_tops[i]) {
+            hist->tops[top_slot(hist, old_tops[i]->interval, old_tops[i]->start)] = old_tops[i];
+        }
+    }
+    free(old_tops);
+    return 0;
+}
+
+/* Find the rankings of a bucket, creating them (empty) if needed */
+static top_bucket_t* get_top(histogram_t *hist, interval_t interval, time_t start) {
+    size_t slot;
+
+    if (hist->top_capacity > 0) {
+        slot = top_slot(hist, interval, start);
+        if (hist->tops[slot]) return hist->tops[slot];
+    }
+    if ((hist->top_count + 1) * 2 > hist->top_capacity && top_table_grow(hist) != 0) {
+        return NULL;
+    }
+    slot = top_slot(hist, interval, start);
+
+    top_bucket_t *top = malloc(sizeof(top_bucket_t) + sizeof(top_entry_t) * 2 * hist->top_n);
+    if (!top) return NULL;
+    top->interval = interval;
+    top->start = start;
+    top->file_count = 0;
+    top->dir_count = 0;
+    top->files = top->entries;
+    top->dirs = top->entries + hist->top_n;
+    hist->tops[slot] = top;
+    hist->top_count++;
+    return top;
+}
+
+/* Whether (a_bytes, a_path) ranks below (b_bytes, b_path) */
+static int ranks_below(uint64_t a_bytes, const char *a_path, uint64_t b_bytes,
+                       const char *b_path) {
+    if (a_bytes != b_bytes) return a_bytes < b_bytes;
+    return strcmp(a_path, b_path) > 0;
+}
+
+static void swap_entries(top_entry_t *a, top_entry_t *b) {
+    top_entry_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void heap_sift_up(top_entry_t *heap, size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!ranks_below(heap[i].bytes, heap[i].path, heap[parent].bytes, heap[parent].path)) {
+            break;
+        }
+        swap_entries(&heap[i], &heap[parent]);
+        i = parent;
+    }
+}
+
+static void heap_sift_down(top_entry_t *heap, size_t count, size_t i) {
+    for (;;) {
+        size_t lowest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+
+        if (left < count && ranks_below(heap[left].bytes, heap[left].path,
+                                        heap[lowest].bytes, heap[lowest].path)) {
+            lowest = left;
+        }
+        if (right < count && ranks_below(heap[right].bytes, heap[right].path,
+                                         heap[lowest].bytes, heap[lowest].path)) {
+            lowest = right;
+        }
+        if (lowest == i) return;
+        swap_entries(&heap[i], &heap[lowest]);
+        i = lowest;
+    }
+}
+
+/* dir joined with name by the path separator, or a copy of dir if name is NULL */
+static char* join_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = name ? strlen(name) : 0;
+    int need_sep = name && dir_len > 0 && dir[dir_len - 1] != PATH_SEPARATOR;
+    char *path = malloc(dir_len + need_sep + name_len + 1);
+    if (!path) return NULL;
+
+    memcpy(path, dir, dir_len);
+    if (need_sep) path[dir_len] = PATH_SEPARATOR;
+    if (name) memcpy(path + dir_len + need_sep, name, name_len);
+    path[dir_len + need_sep + name_len] = '\0';
+    return path;
+}
+
+/*
+ * Offer the entry dir/name (dir alone if name is NULL) to a heap of at most
+ * n entries, evicting the smallest if the heap is full.
+ */
+static void top_offer(top_entry_t *heap, size_t *count, size_t n, uint64_t bytes,
+                      const char *dir, const char *name) {
+    char *path;
+
+    if (*count == n && bytes < heap[0].bytes) return;
+    path = join_path(dir, name);
+    if (!path) {
+        fprintf(stderr, "Error: out of memory\n");
+        return;
+    }
+    if (*count < n) {
+        heap[*count].bytes = bytes;
+        heap[*count].path = path;
+        heap_sift_up(heap, (*count)++);
+        return;
+    }
+    if (!ranks_below(heap[0].bytes, heap[0].path, bytes, path)) {
+        free(path);
+        return;
+    }
+    free(heap[0].path);
+    heap[0].bytes = bytes;
+    heap[0].path = path;
+    heap_sift_down(heap, n, 0);
+}
+
+static int compare_sums(const void *a, const void *b) {
+    const struct top_sum *sa = (const struct top_sum *)a;
+    const struct top_sum *sb = (const struct top_sum *)b;
+    if (sa->interval != sb->interval) return sa->interval < sb->interval ? -1 : 1;
+    if (sa->start != sb->start) return sa->start < sb->start ? -1 : 1;
+    return 0;
+}
+
+/* Sort the sums and fold those of the same bucket together */
+static void dir_sums_compact(top_dir_sums_t *sums) {
+    size_t kept = 0;
+
+    if (sums->count == 0) return;
+    qsort(sums->sums, sums->count, sizeof(struct top_sum), compare_sums);
+    for (size_t i = 1; i < sums->count; i++) {
+        if (compare_sums(&sums->sums[kept], &sums->sums[i]) == 0) {
+            sums->sums[kept].bytes += sums->sums[i].bytes;
+        } else {
+            sums->sums[++kept] = sums->sums[i];
+        }
+    }
+    sums->count = kept + 1;
+}
+
+static void dir_sums_add(top_dir_sums_t *sums, interval_t interval, time_t start,
+                         uint64_t bytes) {
+    /* Files of one directory tend to share buckets: try the latest sums */
+    for (size_t i = sums->count; i > 0 && sums->count - i <= INTERVAL_YEAR; i--) {
+        struct top_sum *sum = &sums->sums[i - 1];
+        if (sum->start == start && sum->interval == interval) {
+            sum->bytes += bytes;
             return;
         }
     }
 
-    /* Need to add a new bucket */
-    if (hist->bucket_count >= hist->bucket_capacity) {
-        size_t new_capacity = hist->bucket_capacity * 2;
-        time_bucket_t *new_buckets = realloc(hist->buckets,
-                                              sizeof(time_bucket_t) * new_capacity);
-        if (!new_buckets) {
+    if (sums->count == sums->capacity) {
+        /* Fold before growing, so the array stays within twice the buckets touched */
+        dir_sums_compact(sums);
+        if (sums->capacity == 0 || sums->count * 2 > sums->capacity) {
+            size_t capacity = sums->capacity ? sums->capacity * 2 : INITIAL_DIR_SUMS;
+            struct top_sum *grown = realloc(sums->sums, sizeof(struct top_sum) * capacity);
+            if (!grown) {
+                fprintf(stderr, "Error: out of memory\n");
+                return;
+            }
+            sums->sums = grown;
+            sums->capacity = capacity;
+        }
+    }
+    sums->sums[sums->count].interval = interval;
+    sums->sums[sums->count].start = start;
+    sums->sums[sums->count].bytes = bytes;
+    sums->count++;
+}
+
+/*
+ * Rank a file found in directory dir under name, and add it to the
+ * directory's own sums (if given) for histogram_add_top_dir().
+ */
+void histogram_add_top_file(histogram_t *hist, const file_info_t *info, const char *dir,
+                            const char *name, top_dir_sums_t *sums) {
+    if (!hist || hist->top_n == 0) return;
+
+    time_t file_time = grouping_time(hist, info);
+    for (int i = 0; i <= INTERVAL_YEAR; i++) {
+        interval_t interval = (interval_t)i;
+        if (!(hist->top_intervals & (1u << i))) continue;
+
+        time_t start = calendar_bucket_start(hist->calendar, file_time, interval);
+        if (name) {
+            top_bucket_t *top = get_top(hist, interval, start);
+            if (!top) {
+                fprintf(stderr, "Error: out of memory\n");
+                return;
+            }
+            top_offer(top->files, &top->file_count, hist->top_n, info->size, dir, name);
+        }
+        if (sums) dir_sums_add(sums, interval, start, info->size);
+    }
+}
+
+/* Rank the directory at path once all its files are in sums; empties sums */
+void histogram_add_top_dir(histogram_t *hist, top_dir_sums_t *sums, const char *path) {
+    if (hist && hist->top_n > 0) {
+        dir_sums_compact(sums);
+        for (size_t i = 0; i < sums->count; i++) {
+            const struct top_sum *sum = &sums->sums[i];
+            top_bucket_t *top = get_top(hist, sum->interval, sum->start);
+            if (!top) {
+                fprintf(stderr, "Error: out of memory\n");
+                break;
+            }
+            top_offer(top->dirs, &top->dir_count, hist->top_n, sum->bytes, path, NULL);
+        }
+    }
+    free(sums->sums);
+    sums->sums = NULL;
+    sums->count = 0;
+    sums->capacity = 0;
+}
+
+/* Rank an entry of the bucket starting at start (at hist->interval) directly */
+void histogram_add_top(histogram_t *hist, time_t start, int is_dir, uint64_t bytes,
+                       const char *path) {
+    if (!hist || hist->top_n == 0) return;
+
+    top_bucket_t *top = get_top(hist, hist->interval, start);
+    if (!top) {
+        fprintf(stderr, "Error: out of memory\n");
+        return;
+    }
+    if (is_dir) {
+        top_offer(top->dirs, &top->dir_count, hist->top_n, bytes, path, NULL);
+    } else {
+        top_offer(top->files, &top->file_count, hist->top_n, bytes, path, NULL);
+    }
+}
+
+/* Offer every ranked entry of src at the intervals in mask to dst */
+static int merge_tops(histogram_t *dst, const histogram_t *src, unsigned intervals) {
+    if (dst->top_n == 0) return 0;
+
+    for (size_t i = 0; i < src->top_capacity; i++) {
+        const top_bucket_t *from = src->tops[i];
+        if (!from || !(intervals & (1u << from->interval))) continue;
+
+        top_bucket_t *to = get_top(dst, from->interval, from->start);
+        if (!to) return -1;
+        for (size_t j = 0; j < from->file_count; j++) {
+            top_offer(to->files, &to->file_count, dst->top_n,
+                      from->files[j].bytes, from->files[j].path, NULL);
+        }
+        for (size_t j = 0; j < from->dir_count; j++) {
+            top_offer(to->dirs, &to->dir_count, dst->top_n,
+                      from->dirs[j].bytes, from->dirs[j].path, NULL);
+        }
+    }
+    return 0;
+}
+
+/* Largest first */
+static int compare_top_entries(const void *a, const void *b) {
+    const top_entry_t *ea = (const top_entry_t *)a;
+    const top_entry_t *eb = (const top_entry_t *)b;
+    if (ranks_below(eb->bytes, eb->path, ea->bytes, ea->path)) return -1;
+    if (ranks_below(ea->bytes, ea->path, eb->bytes, eb->path)) return 1;
+    return 0;
+}
+
+/*
+ * Point every finalized bucket at its largest files and directories,
+ * sorted largest first. Sorting undoes the heaps, so nothing more may be
+ * ranked in hist afterwards.
+ */
+void histogram_link_tops(histogram_t *hist) {
+    if (!hist) return;
+
+    for (size_t i = 0; i < hist->bucket_count; i++) {
+        time_bucket_t *bucket = &hist->buckets[i];
+        top_bucket_t *top;
+
+        bucket->top_files = NULL;
+        bucket->top_file_count = 0;
+        bucket->top_dirs = NULL;
+        bucket->top_dir_count = 0;
+        if (hist->top_capacity == 0) continue;
+
+        top = hist->tops[top_slot(hist, hist->interval, bucket->start_time)];
+        if (!top) continue;
+        qsort(top->files, top->file_count, sizeof(top_entry_t), compare_top_entries);
+        qsort(top->dirs, top->dir_count, sizeof(top_entry_t), compare_top_entries);
+        bucket->top_files = top->files;
+        bucket->top_file_count = top->file_count;
+        bucket->top_dirs = top->dirs;
+        bucket->top_dir_count = top->dir_count;
+    }
+}
+
+/* Fold src (e.g. a per-thread shard) into dst */
+void histogram_merge(histogram_t *dst, const histogram_t *src) {
+    if (!dst || !src) return;
+
+    for (size_t i = 0; i < src->page_capacity; i++) {
+        const histogram_page_t *from = src->pages[i];
+        if (!from) continue;
+
+        histogram_page_t *to = get_page(dst, from->number);
+        if (!to) {
             fprintf(stderr, "Error: out of memory\n");
             return;
         }
-        hist->buckets = new_buckets;
-        hist->bucket_capacity = new_capacity;
+        for (size_t j = 0; j < SLOTS_PER_PAGE; j++) {
+            to->bytes[j] += from->bytes[j];
+            to->allocated[j] += from->allocated[j];
+            to->files[j] += from->files[j];
+        }
     }
+    for (size_t i = 0; i < src->exact_capacity; i++) {
+        const struct exact_bucket *from = &src->exact[i];
+        if (from->files == 0) continue;
+        if (add_exact(dst, from->start, from->bytes, from->allocated, from->files) != 0) {
+            fprintf(stderr, "Error: out of memory\n");
+            return;
+        }
+    }
+    dst->total_bytes += src->total_bytes;
+    dst->total_allocated += src->total_allocated;
+    dst->total_files += src->total_files;
+    if (merge_tops(dst, src, dst->top_intervals) != 0) {
+        fprintf(stderr, "Error: out of memory\n");
+    }
+
+    dst->error_count += src->error_count;
+    dst->directories_scanned += src->directories_scanned;
+    if (src->last_error[0] != '\0') {
+        memcpy(dst->last_error, src->last_error, sizeof(dst->last_error));
+    }
+}
 
-    hist->buckets[hist->bucket_count].start_time = bucket_time;
-    hist->buckets[hist->bucket_count].total_bytes = size;
-    hist->buckets[hist->bucket_count].file_count = 1;
-    hist->bucket_count++;
+/* The bucket at start if it is dst's last, else a new empty one after it */
+static time_bucket_t* bucket_at(histogram_t *dst, time_t start) {
+    time_bucket_t *bucket;
 
-    hist->total_bytes += size;
-    hist->total_files++;
+    if (dst->bucket_count > 0 && dst->buckets[dst->bucket_count - 1].start_time == start) {
+        return &dst->buckets[dst->bucket_count - 1];
+    }
+    if (dst->bucket_count >= dst->bucket_capacity) {
+        size_t new_capacity = dst->bucket_capacity * 2;
+        time_bucket_t *new_buckets = realloc(dst->buckets, sizeof(time_bucket_t) * new_capacity);
+        if (!new_buckets) return NULL;
+        dst->buckets = new_buckets;
+        dst->bucket_capacity = new_capacity;
+    }
+    bucket = &dst->buckets[dst->bucket_count++];
+    bucket->start_time = start;
+    bucket->total_bytes = 0;
+    bucket->allocated_bytes = 0;
+    bucket->file_count = 0;
+    bucket->top_files = NULL;
+    bucket->top_file_count = 0;
+    bucket->top_dirs = NULL;
+    bucket->top_dir_count = 0;
+    return bucket;
+}
+
+static int compare_bucket_starts(const void *a, const void *b) {
+    time_t sa = ((const time_bucket_t *)a)->start_time;
+    time_t sb = ((const time_bucket_t *)b)->start_time;
+    return sa < sb ? -1 : sa > sb ? 1 : 0;
+}
+
+/*
+ * Rebuild dst->buckets at dst->interval from the base slots of src. Pages
+ * are visited in time order, so bucket starts only ever increase and each
+ * slot either extends the last bucket or opens the next one. Exact buckets
+ * come in no order; if there are any, the result is sorted and merged.
+ */
+static int rollup_buckets(const histogram_t *src, histogram_t *dst) {
+    histogram_page_t **sorted = NULL;
+    size_t n = 0;
+
+    dst->bucket_count = 0;
+    if (src->page_count == 0) return 0;
+
+    sorted = malloc(sizeof(histogram_page_t *) * src->page_count);
+    if (!sorted) return -1;
+    for (size_t i = 0; i < src->page_capacity; i++) {
+        if (src->pages[i]) sorted[n++] = src->pages[i];
+    }
+    qsort(sorted, n, sizeof(histogram_page_t *), compare_pages);
+
+    for (size_t i = 0; i < n; i++) {
+        const histogram_page_t *page = sorted[i];
+        for (size_t j = 0; j < SLOTS_PER_PAGE; j++) {
+            if (page->files[j] == 0) continue;
+
+            int64_t slot = page->number * SLOTS_PER_PAGE + (int64_t)j;
+            time_t slot_time = month_slots(src) ? calendar_month_start(dst->calendar, slot)
+                                                : (time_t)(slot * SLOT_SECONDS);
+            time_bucket_t *bucket = bucket_at(dst, calendar_bucket_start(dst->calendar, slot_time,
+                                                                         dst->interval));
+            if (!bucket) {
+                free(sorted);
+                return -1;
+            }
+            bucket->total_bytes += page->bytes[j];
+            bucket->allocated_bytes += page->allocated[j];
+            bucket->file_count += page->files[j];
+        }
+    }
+    free(sorted);
+
+    if (src->exact_count > 0) {
+        size_t kept = 0;
+
+        for (size_t i = 0; i < src->exact_capacity; i++) {
+            const struct exact_bucket *exact = &src->exact[i];
+            if (exact->files == 0) continue;
+
+            time_bucket_t *bucket = bucket_at(dst, calendar_bucket_start(dst->calendar,
+                                                                         exact->start,
+                                                                         dst->interval));
+            if (!bucket) return -1;
+            bucket->total_bytes += exact->bytes;
+            bucket->allocated_bytes += exact->allocated;
+            bucket->file_count += exact->files;
+        }
+        qsort(dst->buckets, dst->bucket_count, sizeof(time_bucket_t), compare_bucket_starts);
+        for (size_t i = 1; i < dst->bucket_count; i++) {
+            time_bucket_t *last = &dst->buckets[kept];
+            if (dst->buckets[i].start_time == last->start_time) {
+                last->total_bytes += dst->buckets[i].total_bytes;
+                last->allocated_bytes += dst->buckets[i].allocated_bytes;
+                last->file_count += dst->buckets[i].file_count;
+            } else {
+                dst->buckets[++kept] = dst->buckets[i];
+            }
+        }
+        dst->bucket_count = kept + 1;
+    }
+
+    histogram_link_tops(dst);
+    return 0;
 }
 
 void histogram_finalize(histogram_t *hist) {
     if (!hist) return;
 
-    /* Record scan end time */
-    hist->scan_end_time = time(NULL);
+    /* Record scan end time (already set when loaded from a snapshot) */
+    if (hist->scan_end_time == 0) hist->scan_end_time = time(NULL);
+
+    if (rollup_buckets(hist, hist) != 0) {
+        fprintf(stderr, "Error: out of memory\n");
+    }
+}
+
+/*
+ * A finalized view of hist at another interval, no finer than its
+ * resolution, sharing its totals and scan metadata. The base slots are not
+ * copied, so the result cannot be rolled up further; roll up from the
+ * original instead.
+ */
+histogram_t* histogram_rollup(const histogram_t *hist, interval_t interval) {
+    if (!hist || interval < hist->resolution) return NULL;
 
-    if (hist->bucket_count == 0) return;
+    histogram_t *view = histogram_create(interval);
+    if (!view) return NULL;
 
-    /* Sort buckets by time */
-    qsort(hist->buckets, hist->bucket_count, sizeof(time_bucket_t), compare_buckets);
+    view->mode = hist->mode;
+    view->disk_usage = hist->disk_usage;
+    view->total_bytes = hist->total_bytes;
+    view->total_allocated = hist->total_allocated;
+    view->total_files = hist->total_files;
+    view->scan_start_time = hist->scan_start_time;
+    view->scan_end_time = hist->scan_end_time;
+    view->error_count = hist->error_count;
+    view->directories_scanned = hist->directories_scanned;
+    memcpy(view->last_error, hist->last_error, sizeof(view->last_error));
+    histogram_set_top(view, hist->top_n, hist->top_intervals & (1u << interval));
+
+    if (merge_tops(view, hist, view->top_intervals) != 0 || rollup_buckets(hist, view) != 0) {
+        histogram_destroy(view);
+        return NULL;
+    }
+    return view;
 }
 
 void histogram_set_error_log(histogram_t *hist, FILE *log_file) {
@@ -155,7 +893,8 @@ void histogram_log_error(histogram_t *hist, const char *error_msg) {
     /* Get current timestamp */
     time_t now = time(NULL);
     char time_buf[64];
-    struct tm *tm_info = localtime(&now);
+    struct tm tm_buf;
+    struct tm *tm_info = local_time(&now, &tm_buf);
     if (tm_info) {
         strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", tm_info);
     } else {
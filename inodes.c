@@ -0,0 +1,148 @@
+#include "diskogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+    #include <pthread.h>
+#endif
+
+/*
+ * Set of (device, inode) pairs for --dedup-inodes.
+ *
+ * Only files with more than one link are ever inserted, so the set stays
+ * small next to the number of files scanned. It is split into shards by
+ * hash, each an open-addressing table with linear probing under its own
+ * lock, so that scanning threads rarely wait for one another.
+ */
+
+#define INODE_SHARD_BITS 6
+#define INODE_SHARDS (1u << INODE_SHARD_BITS)
+#define INODE_SHARD_MIN_CAPACITY 64
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+} inode_key_t;
+
+typedef struct {
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+    inode_key_t *slots;     /* (0, 0) marks an empty slot */
+    size_t count;
+    size_t capacity;        /* power of two, or 0 before the first insert */
+    int has_zero;           /* whether (0, 0) itself is in the set */
+} inode_shard_t;
+
+struct inode_set {
+    inode_shard_t shards[INODE_SHARDS];
+};
+
+static uint64_t hash_inode(uint64_t dev, uint64_t ino) {
+    uint64_t x = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inode_set_t* inode_set_create(void) {
+    inode_set_t *set = calloc(1, sizeof(inode_set_t));
+    if (!set) return NULL;
+#ifndef _WIN32
+    for (unsigned i = 0; i < INODE_SHARDS; i++) {
+        pthread_mutex_init(&set->shards[i].lock, NULL);
+    }
+#endif
+    return set;
+}
+
+void inode_set_destroy(inode_set_t *set) {
+    if (!set) return;
+    for (unsigned i = 0; i < INODE_SHARDS; i++) {
+#ifndef _WIN32
+        pthread_mutex_destroy(&set->shards[i].lock);
+#endif
+        free(set->shards[i].slots);
+    }
+    free(set);
+}
+
+/* Forget every inode, keeping the tables for reuse */
+void inode_set_clear(inode_set_t *set) {
+    for (unsigned i = 0; i < INODE_SHARDS; i++) {
+        inode_shard_t *shard = &set->shards[i];
+        if (shard->slots) memset(shard->slots, 0, sizeof(inode_key_t) * shard->capacity);
+        shard->count = 0;
+        shard->has_zero = 0;
+    }
+}
+
+static void shard_place(inode_key_t *slots, size_t capacity, inode_key_t key, uint64_t hash) {
+    size_t i = (size_t)hash & (capacity - 1);
+    while (slots[i].dev != 0 || slots[i].ino != 0) {
+        i = (i + 1) & (capacity - 1);
+    }
+    slots[i] = key;
+}
+
+static int shard_grow(inode_shard_t *shard) {
+    size_t capacity = shard->capacity ? shard->capacity * 2 : INODE_SHARD_MIN_CAPACITY;
+    inode_key_t *slots = calloc(capacity, sizeof(inode_key_t));
+    if (!slots) return -1;
+
+    for (size_t i = 0; i < shard->capacity; i++) {
+        inode_key_t key = shard->slots[i];
+        if (key.dev != 0 || key.ino != 0) {
+            shard_place(slots, capacity, key, hash_inode(key.dev, key.ino));
+        }
+    }
+    free(shard->slots);
+    shard->slots = slots;
+    shard->capacity = capacity;
+    return 0;
+}
+
+static int shard_insert(inode_shard_t *shard, uint64_t dev, uint64_t ino, uint64_t hash) {
+    inode_key_t key;
+    size_t i;
+
+    if (dev == 0 && ino == 0) {
+        int added = !shard->has_zero;
+        shard->has_zero = 1;
+        return added;
+    }
+
+    /* Keep the load factor at or below 3/4 */
+    if ((shard->count + 1) * 4 > shard->capacity * 3 && shard_grow(shard) != 0) return -1;
+
+    for (i = (size_t)hash & (shard->capacity - 1);
+         shard->slots[i].dev != 0 || shard->slots[i].ino != 0;
+         i = (i + 1) & (shard->capacity - 1)) {
+        if (shard->slots[i].dev == dev && shard->slots[i].ino == ino) return 0;
+    }
+    key.dev = dev;
+    key.ino = ino;
+    shard->slots[i] = key;
+    shard->count++;
+    return 1;
+}
+
+/*
+ * Add (dev, ino): 1 if it was not in the set yet, 0 if it was, -1 if out
+ * of memory. Safe to call from several threads at once.
+ */
+int inode_set_insert(inode_set_t *set, uint64_t dev, uint64_t ino) {
+    uint64_t hash = hash_inode(dev, ino);
+    inode_shard_t *shard = &set->shards[hash >> (64 - INODE_SHARD_BITS)];
+    int result;
+
+#ifndef _WIN32
+    pthread_mutex_lock(&shard->lock);
+#endif
+    result = shard_insert(shard, dev, ino, hash);
+#ifndef _WIN32
+    pthread_mutex_unlock(&shard->lock);
+#endif
+    return result;
+}
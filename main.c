@@ -2,6 +2,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
 
 static void print_usage(const char *progname) {
     printf("Usage: %s [OPTIONS] <directory>\n", progname);
@@ -16,17 +24,60 @@ static void print_usage(const char *progname) {
     printf("  --day           Group by day (default)\n");
     printf("  --month         Group by month\n");
     printf("  --year          Group by year\n\n");
+    printf("Counting Options:\n");
+    printf("  --dedup-inodes  Count a hard-linked file once, not once per link (POSIX)\n");
+    printf("  --disk-usage    Report allocated space (st_blocks) next to apparent size\n");
+    printf("  --largest <n>   List the n largest files and directories of every bucket;\n");
+    printf("                  a directory is sized by the files directly inside it\n");
+    printf("  --tree <depth>  Output every directory down to depth levels below the scanned\n");
+    printf("                  path, each with the histogram of its whole subtree\n\n");
+    printf("Filesystem Options:\n");
+    printf("  -x, --one-file-system  Do not descend into other mounted filesystems\n");
+    printf("  --skip-fs <list>       Skip mount points of these types, comma-separated;\n");
+    printf("                         'pseudo' (proc, sysfs, ...) and 'network' (nfs, cifs, ...)\n");
+    printf("                         name whole groups (Linux)\n\n");
+    printf("Multi-Histogram Options (one scan fills every combination):\n");
+    printf("  --modes <list>         Grouping modes, comma-separated: m,c,a (or mtime,ctime,atime)\n");
+    printf("  --intervals <list>     Intervals, comma-separated: hour,day,month,year\n\n");
     printf("Export Format Options:\n");
     printf("  --csv           Export as CSV\n");
     printf("  --json          Export as JSON\n");
-    printf("  --xml           Export as XML\n\n");
+    printf("  --xml           Export as XML\n");
+    printf("  --binary        Export as columnar binary, for loading without parsing\n");
+    printf("  --from-binary <file>   Output a --binary export in another format\n\n");
     printf("Error Logging Options:\n");
     printf("  --error-log <file>     Log all errors to specified file\n");
     printf("  --log-errors-stderr    Log all errors to stderr\n\n");
     printf("Stdin Options:\n");
     printf("  --stdin                Read directory paths from stdin (one per line)\n");
     printf("  --batch                Output separate histogram for each path (with --stdin)\n");
-    printf("                         Without --batch, paths are aggregated into one histogram\n\n");
+    printf("                         Without --batch, paths are aggregated into one histogram\n");
+    printf("  --jobs <n>             Scan n paths at once with --batch (0 = one per CPU, default 1)\n");
+    printf("  --unordered            Output --batch results as they finish, not in input order\n\n");
+    printf("Snapshot Options:\n");
+    printf("  --save-snapshot <file> Also record every scanned file and directory to a snapshot\n");
+    printf("  --from-snapshot <file> Build histograms from a snapshot instead of scanning\n");
+    printf("  --incremental <file>   Rescan using the snapshot in file, then update it;\n");
+    printf("                         directories unchanged since it was taken are not re-read\n");
+    printf("  --save-state <file>    Same as --save-snapshot\n");
+    printf("  --compare-with <file>  Report changes since an older snapshot instead of histograms;\n");
+    printf("                         the newer one comes from --from-snapshot, --save-snapshot\n");
+    printf("                         or --incremental\n");
+    printf("  --top <n>              Directories listed by --compare-with (default 10)\n\n");
+    printf("Performance Options:\n");
+    printf("  --threads <n>          Scan with n worker threads (0 = one per CPU, default 1)\n");
+    printf("  --dirent-buffer <size> Directory read batch size per thread (default 256K)\n");
+    printf("  --fast-stat            Accept cached attributes on network filesystems (Linux)\n");
+    printf("  --io-uring             Issue stats asynchronously through io_uring (Linux)\n");
+    printf("  --uring-depth <n>      Stats kept in flight per thread with --io-uring (default 256)\n");
+    printf("  --max-open-dirs <n>    Directories kept open for relative opens (default: half\n");
+    printf("                         the descriptor limit, at most 4096)\n");
+    printf("  --inode-order          Stat each directory's files in inode number order\n");
+    printf("                         (fewer seeks on rotational disks)\n");
+    printf("  --benchmark            Time the scan in directory and in inode order and report\n");
+    printf("                         entries per second instead of a histogram\n");
+    printf("  --drop-caches          With --benchmark, sync and drop the kernel caches before\n");
+    printf("                         each run (Linux, root) so both runs start cold\n\n");
     printf("Other Options:\n");
     printf("  -h, --help      Show this help message\n");
     printf("  --version       Show version information\n\n");
@@ -34,20 +85,843 @@ static void print_usage(const char *progname) {
     printf("  %s .\n", progname);
     printf("  %s -c --month /path/to/directory\n", progname);
     printf("  %s --atime --year --json ~/Documents\n", progname);
+    printf("  %s --modes m,c,a --intervals day,month --csv /srv\n", progname);
+    printf("  %s --month --largest 10 /srv\n", progname);
+    printf("  %s --year --tree 2 --csv /srv\n", progname);
+    printf("  %s --save-snapshot srv.snap /srv\n", progname);
+    printf("  %s --from-snapshot srv.snap --atime --month\n", progname);
+    printf("  %s --incremental srv.snap /srv\n", progname);
+    printf("  %s --from-snapshot new.snap --compare-with old.snap --month\n", progname);
+    printf("  %s --from-binary nightly.bin --csv\n", progname);
+    printf("  %s -x --skip-fs pseudo,network /\n", progname);
     printf("  find /var -type d | %s --stdin\n", progname);
     printf("  echo -e \"/home\\n/var\" | %s --stdin --batch --json\n\n", progname);
 }
 
+/* Parse a byte count with an optional K/M/G suffix (powers of 1024) */
+static int parse_size(const char *str, size_t *out) {
+    char *end;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str || str[0] == '-') return -1;
+
+    switch (*end) {
+        case '\0': break;
+        case 'k': case 'K': value *= 1024ULL; end++; break;
+        case 'm': case 'M': value *= 1024ULL * 1024; end++; break;
+        case 'g': case 'G': value *= 1024ULL * 1024 * 1024; end++; break;
+        default: return -1;
+    }
+    if (*end != '\0' && !((end[0] == 'i' || end[0] == 'B') && end[1] == '\0')) {
+        return -1;
+    }
+    *out = (size_t)value;
+    return 0;
+}
+
+/* Grouping mode as it appears in titles */
+static const char* mode_title(grouping_mode_t mode) {
+    switch (mode) {
+        case GROUP_BY_CTIME:
+#if defined(__APPLE__) || defined(__linux__)
+            return "Creation Time";
+#else
+            return "Change Time";
+#endif
+        case GROUP_BY_ATIME:
+            return "Access Time";
+        case GROUP_BY_MTIME:
+        default:
+            return "Modification Time";
+    }
+}
+
+static const char* interval_title(interval_t interval) {
+    switch (interval) {
+        case INTERVAL_HOUR: return "Hour";
+        case INTERVAL_MONTH: return "Month";
+        case INTERVAL_YEAR: return "Year";
+        case INTERVAL_DAY:
+        default: return "Day";
+    }
+}
+
+/* Copy the next comma-separated token of *list into tok; 0 at the end */
+static int next_token(const char **list, char *tok, size_t size) {
+    const char *start = *list;
+    size_t len;
+
+    if (*start == '\0') return 0;
+    len = strcspn(start, ",");
+    *list = start[len] == ',' ? start + len + 1 : start + len;
+    if (len >= size) len = size - 1;
+    memcpy(tok, start, len);
+    tok[len] = '\0';
+    return 1;
+}
+
+/* Parse "m,c,a" / "mtime,ctime,atime"; duplicates are ignored */
+static int parse_modes(const char *list, grouping_mode_t *modes, size_t *count) {
+    char tok[16];
+
+    *count = 0;
+    while (next_token(&list, tok, sizeof(tok))) {
+        grouping_mode_t mode;
+        size_t i;
+        if (strcmp(tok, "m") == 0 || strcmp(tok, "mtime") == 0) {
+            mode = GROUP_BY_MTIME;
+        } else if (strcmp(tok, "c") == 0 || strcmp(tok, "ctime") == 0) {
+            mode = GROUP_BY_CTIME;
+        } else if (strcmp(tok, "a") == 0 || strcmp(tok, "atime") == 0) {
+            mode = GROUP_BY_ATIME;
+        } else {
+            return -1;
+        }
+        for (i = 0; i < *count && modes[i] != mode; i++) {}
+        if (i == *count) modes[(*count)++] = mode;
+    }
+    return *count > 0 ? 0 : -1;
+}
+
+/* Parse "hour,day,month,year" (any subset); duplicates are ignored */
+static int parse_intervals(const char *list, interval_t *intervals, size_t *count) {
+    char tok[16];
+
+    *count = 0;
+    while (next_token(&list, tok, sizeof(tok))) {
+        interval_t interval;
+        size_t i;
+        if (strcmp(tok, "hour") == 0) {
+            interval = INTERVAL_HOUR;
+        } else if (strcmp(tok, "day") == 0) {
+            interval = INTERVAL_DAY;
+        } else if (strcmp(tok, "month") == 0) {
+            interval = INTERVAL_MONTH;
+        } else if (strcmp(tok, "year") == 0) {
+            interval = INTERVAL_YEAR;
+        } else {
+            return -1;
+        }
+        for (i = 0; i < *count && intervals[i] != interval; i++) {}
+        if (i == *count) intervals[(*count)++] = interval;
+    }
+    return *count > 0 ? 0 : -1;
+}
+
+/* Requested mode x interval combinations and the logging shared by all */
+typedef struct {
+    grouping_mode_t modes[3];
+    size_t mode_count;
+    interval_t intervals[4];
+    size_t interval_count;
+    int multi;              /* --modes/--intervals given: label each histogram */
+    int disk_usage;         /* --disk-usage: also report allocated space */
+    size_t top_n;           /* --largest: files and directories ranked per bucket */
+    FILE *error_log_file;
+    int log_errors_to_stderr;
+} histogram_spec_t;
+
+/*
+ * Create one histogram per grouping mode for the scan to fill; returns how
+ * many, 0 on failure. The intervals are derived afterwards by
+ * finalize_histograms().
+ */
+static size_t create_histograms(const histogram_spec_t *spec, histogram_t **hists) {
+    size_t count = 0;
+
+    for (size_t m = 0; m < spec->mode_count; m++) {
+        histogram_t *hist = histogram_create(spec->intervals[0]);
+        if (!hist) {
+            while (count > 0) histogram_destroy(hists[--count]);
+            return 0;
+        }
+        hist->mode = spec->modes[m];
+        hist->disk_usage = spec->disk_usage;
+        for (size_t i = 1; i < spec->interval_count; i++) {
+            if (spec->intervals[i] < hist->resolution) {
+                histogram_set_resolution(hist, spec->intervals[i]);
+            }
+        }
+        if (spec->top_n > 0) {
+            /* Ranked at every interval during the scan: coarser rankings cannot be
+             * derived from finer ones, since a directory's bytes add up across buckets */
+            unsigned intervals = 0;
+            for (size_t i = 0; i < spec->interval_count; i++) {
+                intervals |= 1u << spec->intervals[i];
+            }
+            histogram_set_top(hist, spec->top_n, intervals);
+        }
+        if (spec->error_log_file) histogram_set_error_log(hist, spec->error_log_file);
+        if (spec->log_errors_to_stderr) histogram_set_error_stderr(hist, 1);
+        hists[count++] = hist;
+    }
+    return count;
+}
+
+static void destroy_histograms(histogram_t **hists, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        histogram_destroy(hists[i]);
+    }
+}
+
+/*
+ * Finish a scan. On entry hists holds the scanned per-mode histograms; on
+ * return it holds one finalized histogram per mode x interval, mode-major.
+ */
+static size_t finalize_histograms(const histogram_spec_t *spec, histogram_t **hists,
+                                  size_t count) {
+    histogram_t *bases[MAX_SCAN_HISTOGRAMS];
+    size_t out = 0;
+
+    for (size_t m = 0; m < count; m++) {
+        histogram_finalize(hists[m]);
+    }
+    if (spec->interval_count == 1) return count;
+
+    memcpy(bases, hists, sizeof(histogram_t *) * count);
+    for (size_t m = 0; m < count; m++) {
+        for (size_t i = 0; i < spec->interval_count; i++) {
+            histogram_t *view = histogram_rollup(bases[m], spec->intervals[i]);
+            if (!view) {
+                fprintf(stderr, "Error: out of memory\n");
+                continue;
+            }
+            hists[out++] = view;
+        }
+        histogram_destroy(bases[m]);
+    }
+    return out;
+}
+
+static void make_title(char *buf, size_t size, const histogram_spec_t *spec,
+                       const histogram_t *hist, const char *subject) {
+    if (spec->multi) {
+        snprintf(buf, size, "Disk Space by %s per %s: %s",
+                 mode_title(hist->mode), interval_title(hist->interval), subject);
+    } else {
+        snprintf(buf, size, "Disk Space by %s: %s", mode_title(hist->mode), subject);
+    }
+}
+
+/* Print a finished histogram set as a standalone document */
+static void output_histograms(const histogram_spec_t *spec, histogram_t **hists,
+                              size_t count, export_format_t format, const char *subject) {
+    json_array_writer_t json;
+    char title[512];
+    size_t i;
+
+    if (count == 0) return;
+    switch (format) {
+        case FORMAT_CSV:
+            if (spec->multi) {
+                snprintf(title, sizeof(title), "Disk Space: %s", subject);
+                export_csv_set(hists, count, title);
+            } else {
+                make_title(title, sizeof(title), spec, hists[0], subject);
+                export_csv(hists[0], title);
+            }
+            break;
+        case FORMAT_JSON:
+            /* Use array format for consistency */
+            export_json_array_start(&json);
+            for (i = 0; i < count; i++) {
+                make_title(title, sizeof(title), spec, hists[i], subject);
+                export_json_array_item(&json, hists[i], title, spec->mode_count > 1);
+            }
+            export_json_array_end(&json);
+            break;
+        case FORMAT_XML:
+            /* Use collection format for consistency */
+            export_xml_collection_start();
+            for (i = 0; i < count; i++) {
+                make_title(title, sizeof(title), spec, hists[i], subject);
+                export_xml_collection_item(hists[i], title, spec->mode_count > 1);
+            }
+            export_xml_collection_end();
+            break;
+        case FORMAT_BINARY:
+            export_binary_start();
+            for (i = 0; i < count; i++) {
+                make_title(title, sizeof(title), spec, hists[i], subject);
+                export_binary_item(hists[i], title, subject);
+            }
+            export_binary_end();
+            break;
+        case FORMAT_TEXT:
+        default:
+            for (i = 0; i < count; i++) {
+                make_title(title, sizeof(title), spec, hists[i], subject);
+                display_histogram(hists[i], title);
+            }
+            break;
+    }
+}
+
+/* Re-export the histograms of a --binary file (--from-binary) */
+static int output_binary_file(const char *filename, export_format_t format) {
+    binary_file_t *file = binary_open(filename);
+    binary_histogram_t entry;
+    json_array_writer_t json;
+    int status;
+
+    if (!file) {
+        fprintf(stderr, "Error: cannot read '%s' (missing or not a --binary export)\n",
+                filename);
+        return 1;
+    }
+
+    /* The CSV header depends on the first histogram */
+    status = binary_next(file, &entry);
+    switch (format) {
+        case FORMAT_CSV:
+            export_csv_batch_set_start(status == 1 && entry.disk_usage,
+                                       status == 1 && entry.top_n > 0);
+            break;
+        case FORMAT_JSON:
+            export_json_array_start(&json);
+            break;
+        case FORMAT_XML:
+            export_xml_collection_start();
+            break;
+        case FORMAT_BINARY:
+            export_binary_start();
+            break;
+        case FORMAT_TEXT:
+        default:
+            break;
+    }
+
+    /* The file may hold several modes: name each item's, as the CSV Mode column does */
+    for (; status == 1; status = binary_next(file, &entry)) {
+        histogram_t *hist = binary_histogram_load(&entry);
+        if (!hist) {
+            fprintf(stderr, "Error: out of memory\n");
+            status = -1;
+            break;
+        }
+        switch (format) {
+            case FORMAT_CSV:
+                export_csv_batch_set_item(&hist, 1, entry.label);
+                break;
+            case FORMAT_JSON:
+                export_json_array_item(&json, hist, entry.title, 1);
+                break;
+            case FORMAT_XML:
+                export_xml_collection_item(hist, entry.title, 1);
+                break;
+            case FORMAT_BINARY:
+                export_binary_item(hist, entry.title, entry.label);
+                break;
+            case FORMAT_TEXT:
+            default:
+                display_histogram(hist, entry.title);
+                break;
+        }
+        histogram_destroy(hist);
+    }
+
+    if (format == FORMAT_JSON) {
+        export_json_array_end(&json);
+    } else if (format == FORMAT_XML) {
+        export_xml_collection_end();
+    } else if (format == FORMAT_BINARY) {
+        export_binary_end();
+    }
+    binary_close(file);
+
+    if (status < 0) {
+        fprintf(stderr, "Error: '%s' is damaged or incomplete\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+/* Binary output is refused on a terminal */
+static int stdout_is_terminal(void) {
+#ifdef _WIN32
+    return _isatty(_fileno(stdout));
+#else
+    return isatty(STDOUT_FILENO);
+#endif
+}
+
+/* Report what changed from the snapshot in old_file to the one in new_file */
+static int output_comparison(const histogram_spec_t *spec, const char *old_file,
+                             const char *new_file, size_t top_n, export_format_t format) {
+    snapshot_t *old_snap = snapshot_open(old_file);
+    snapshot_t *new_snap = old_snap ? snapshot_open(new_file) : NULL;
+    comparison_t *cmp;
+    char title[512];
+
+    if (!old_snap || !new_snap) {
+        fprintf(stderr, "Error: cannot read snapshot '%s' (missing or not a snapshot)\n",
+                old_snap ? new_file : old_file);
+        snapshot_close(old_snap);
+        return 1;
+    }
+    cmp = compare_snapshots(old_snap, new_snap, spec->modes[0], spec->intervals[0], top_n);
+    if (!cmp) {
+        fprintf(stderr, "Error: cannot compare '%s' with '%s' (damaged snapshot or out of memory)\n",
+                new_file, old_file);
+        snapshot_close(old_snap);
+        snapshot_close(new_snap);
+        return 1;
+    }
+
+    snprintf(title, sizeof(title), "Disk Space Change by %s per %s: %s",
+             mode_title(cmp->mode), interval_title(cmp->interval), cmp->new_label);
+    switch (format) {
+        case FORMAT_CSV:
+            export_csv_comparison(cmp, title);
+            break;
+        case FORMAT_JSON:
+            export_json_comparison(cmp, title);
+            break;
+        case FORMAT_XML:
+            export_xml_comparison(cmp, title);
+            break;
+        case FORMAT_TEXT:
+        default:
+            display_comparison(cmp, title);
+            break;
+    }
+
+    comparison_destroy(cmp);
+    snapshot_close(old_snap);
+    snapshot_close(new_snap);
+    return 0;
+}
+
+/* Drop a snapshot whose scan did not complete */
+static void discard_snapshot(snapshot_writer_t *writer, const char *filename) {
+    if (!writer) return;
+    snapshot_writer_finish(writer, NULL, NULL);
+    remove(filename);
+}
+
+/* Release the previous snapshot of an incremental scan */
+static void close_previous(scan_options_t *opts, snapshot_index_t **index,
+                           snapshot_t **previous) {
+    opts->reuse = NULL;
+    snapshot_index_destroy(*index);
+    *index = NULL;
+    snapshot_close(*previous);
+    *previous = NULL;
+}
+
+/*
+ * Complete a snapshot; with replace set, the finished file (written beside
+ * it) then takes the place of the previous snapshot.
+ */
+static int finish_snapshot(snapshot_writer_t *writer, const histogram_t *meta,
+                           const char *label, const char *filename, const char *replace) {
+    if (snapshot_writer_finish(writer, meta, label) != 0) return -1;
+    if (!replace) return 0;
+#ifdef _WIN32
+    remove(replace);  /* rename() does not overwrite on Windows */
+#endif
+    if (rename(filename, replace) != 0) {
+        remove(filename);
+        return -1;
+    }
+    return 0;
+}
+
+/* Paths read from stdin in aggregate mode */
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t capacity;
+} path_list_t;
+
+/* Absolute form of path with symlinks resolved; a plain copy if that fails */
+static char* canonical_path(const char *path) {
+#ifdef _WIN32
+    char *resolved = _fullpath(NULL, path, 0);
+#else
+    char *resolved = realpath(path, NULL);
+#endif
+    if (resolved) return resolved;
+    return strdup(path);
+}
+
+static int path_list_add(path_list_t *list, const char *path) {
+    char *canonical;
+
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        char **grown = realloc(list->paths, sizeof(char *) * capacity);
+        if (!grown) return -1;
+        list->paths = grown;
+        list->capacity = capacity;
+    }
+    canonical = canonical_path(path);
+    if (!canonical) return -1;
+    list->paths[list->count++] = canonical;
+    return 0;
+}
+
+static void path_list_free(path_list_t *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+}
+
+/* qsort comparator for path_compare() on an array of strings */
+static int compare_paths(const void *a, const void *b) {
+    return path_compare(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Whether path is dir itself or lies below it */
+static int path_within(const char *dir, const char *path) {
+    size_t len = strlen(dir);
+    if (strncmp(dir, path, len) != 0) return 0;
+    return path[len] == '\0' || path[len] == PATH_SEPARATOR ||
+           (len > 0 && dir[len - 1] == PATH_SEPARATOR);
+}
+
+/*
+ * Whether scanning dir reaches path below it: not when -x or --skip-fs
+ * stops the walk at a directory on the way down.
+ */
+static int scan_reaches(const char *dir, const char *path, const scan_options_t *opts) {
+#ifdef _WIN32
+    (void)dir;
+    (void)path;
+    (void)opts;
+    return 1;
+#else
+    char prefix[MAX_PATH_LEN];
+    struct stat st;
+    uint64_t root_dev;
+    uint64_t root_mount_dev = 0;
+    size_t len = strlen(dir);
+    size_t path_len = strlen(path);
+
+    if (!opts->one_file_system && !opts->mounts) return 1;
+    if (path_len >= sizeof(prefix) || stat(dir, &st) != 0) return 1;
+    root_dev = (uint64_t)st.st_dev;
+    if (opts->mounts) root_mount_dev = mount_table_device_of(opts->mounts, dir);
+    memcpy(prefix, path, path_len + 1);
+
+    /* Every directory from the one below dir down to path itself */
+    while (path[len] != '\0') {
+        while (path[len] == PATH_SEPARATOR) len++;
+        while (path[len] != '\0' && path[len] != PATH_SEPARATOR) len++;
+        prefix[len] = '\0';
+        if (opts->one_file_system && stat(prefix, &st) == 0 &&
+            (uint64_t)st.st_dev != root_dev) {
+            return 0;
+        }
+        if (opts->mounts && mount_table_excluded(opts->mounts, prefix, opts->one_file_system,
+                                                 root_mount_dev)) {
+            return 0;
+        }
+        prefix[len] = path[len];
+    }
+    return 1;
+#endif
+}
+
+/*
+ * Sort canonical paths and drop every path already inside another one,
+ * since scanning the outer path covers it; returns how many are left.
+ * find /var -type d | diskogram --stdin thus walks /var once. A path the
+ * outer scan would not enter (another filesystem with -x, a mount point
+ * skipped by --skip-fs) is kept and scanned on its own.
+ */
+static size_t drop_covered_paths(char **paths, size_t count, const scan_options_t *opts) {
+    size_t kept = 0;
+
+    qsort(paths, count, sizeof(char *), compare_paths);
+    for (size_t i = 0; i < count; i++) {
+        size_t outer = kept;
+
+        /* Kept paths may nest when filters apply; the last one around is the deepest */
+        while (outer > 0 && !path_within(paths[outer - 1], paths[i])) {
+            if (!opts->one_file_system && !opts->mounts) {
+                outer = 0;
+                break;
+            }
+            outer--;
+        }
+        if (outer > 0 && scan_reaches(paths[outer - 1], paths[i], opts)) {
+            free(paths[i]);
+            continue;
+        }
+        paths[kept++] = paths[i];
+    }
+    return kept;
+}
+
+/* Output of --stdin --batch, written as each path's results arrive */
+typedef struct {
+    const histogram_spec_t *spec;
+    export_format_t format;
+    interval_t interval;
+    size_t delivered;       /* paths output so far */
+    json_array_writer_t json;
+} batch_output_t;
+
+/* Open the JSON array, XML collection, binary stream or CSV header */
+static void batch_output_start(batch_output_t *out) {
+    const histogram_spec_t *spec = out->spec;
+
+    switch (out->format) {
+        case FORMAT_JSON:
+            export_json_array_start(&out->json);
+            break;
+        case FORMAT_XML:
+            export_xml_collection_start();
+            break;
+        case FORMAT_BINARY:
+            export_binary_start();
+            break;
+        case FORMAT_CSV:
+            if (spec->multi) {
+                export_csv_batch_set_start(spec->disk_usage, spec->top_n > 0);
+            } else {
+                export_csv_batch_start(mode_title(spec->modes[0]), out->interval,
+                                       spec->disk_usage, spec->top_n > 0);
+            }
+            break;
+        case FORMAT_TEXT:
+        default:
+            break;
+    }
+}
+
+static void batch_output_end(batch_output_t *out) {
+    if (out->format == FORMAT_JSON) {
+        export_json_array_end(&out->json);
+    } else if (out->format == FORMAT_XML) {
+        export_xml_collection_end();
+    } else if (out->format == FORMAT_BINARY) {
+        export_binary_end();
+    }
+    /* CSV batch mode has no end marker */
+}
+
+/* Print the finalized histograms of one path and destroy them */
+static void batch_output_path(batch_output_t *out, const char *path, histogram_t **hists,
+                              size_t count) {
+    char title[512];
+
+    if (count == 0) return;
+    switch (out->format) {
+        case FORMAT_JSON:
+            for (size_t h = 0; h < count; h++) {
+                make_title(title, sizeof(title), out->spec, hists[h], path);
+                export_json_array_item(&out->json, hists[h], title,
+                                       out->spec->mode_count > 1);
+            }
+            break;
+        case FORMAT_XML:
+            for (size_t h = 0; h < count; h++) {
+                make_title(title, sizeof(title), out->spec, hists[h], path);
+                export_xml_collection_item(hists[h], title, out->spec->mode_count > 1);
+            }
+            break;
+        case FORMAT_BINARY:
+            for (size_t h = 0; h < count; h++) {
+                make_title(title, sizeof(title), out->spec, hists[h], path);
+                export_binary_item(hists[h], title, path);
+            }
+            break;
+        case FORMAT_CSV:
+            /* For CSV, pass just the path */
+            if (out->spec->multi) {
+                export_csv_batch_set_item(hists, count, path);
+            } else {
+                export_csv_batch_item(hists[0], path, out->interval);
+            }
+            break;
+        case FORMAT_TEXT:
+        default:
+            for (size_t h = 0; h < count; h++) {
+                make_title(title, sizeof(title), out->spec, hists[h], path);
+                display_histogram(hists[h], title);
+            }
+            if (out->delivered > 0) {
+                printf("\n");
+            }
+            break;
+    }
+    destroy_histograms(hists, count);
+    out->delivered++;
+    /* Let a consumer downstream of a pipe start on this path now */
+    fflush(stdout);
+}
+
+/* batch_result_fn: print one finished path */
+static void batch_output_result(void *ctx, const char *path, histogram_t **hists,
+                                size_t count, int status) {
+    batch_output_t *out = (batch_output_t *)ctx;
+
+    (void)status;  /* failures are counted in the histograms' errors */
+    count = finalize_histograms(out->spec, hists, count);
+    if (count == 0) return;
+    if (out->format == FORMAT_TEXT) {
+        /* The scan is over by now, and other paths may be under way */
+        printf("Results for '%s':\n", path);
+    }
+    batch_output_path(out, path, hists, count);
+}
+
+/* batch_result_fn for dir_tree_visit(): print one directory of the tree */
+static void tree_output_node(void *ctx, const char *path, histogram_t **hists,
+                             size_t count, int status) {
+    (void)status;
+    if (count > 0 && hists[0]->total_files == 0) {
+        /* Directories without files are of no interest here */
+        destroy_histograms(hists, count);
+        return;
+    }
+    batch_output_path((batch_output_t *)ctx, path, hists, count);
+}
+
+/*
+ * Print every directory of a --tree scan, parents before children, each
+ * with the histograms of its whole subtree, in the --batch layout. meta
+ * is the scan's first histogram.
+ */
+static void output_tree(const histogram_spec_t *spec, dir_tree_t *tree,
+                        const histogram_t *meta, export_format_t format) {
+    batch_output_t out;
+
+    if (dir_tree_finish(tree) != 0) {
+        fprintf(stderr, "Warning: out of memory; directory tree totals are incomplete\n");
+    }
+    memset(&out, 0, sizeof(out));
+    out.spec = spec;
+    out.format = format;
+    out.interval = spec->intervals[0];
+    batch_output_start(&out);
+    dir_tree_visit(tree, meta, tree_output_node, &out);
+    batch_output_end(&out);
+}
+
+/* Wall-clock seconds from an arbitrary origin, for --benchmark */
+static double elapsed_seconds(void) {
+#if defined(_WIN32) || !defined(CLOCK_MONOTONIC)
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+/* Empty the page, dentry and inode caches so a scan starts cold (Linux, root) */
+static int drop_caches(void) {
+#ifdef __linux__
+    FILE *f;
+    sync();
+    f = fopen("/proc/sys/vm/drop_caches", "w");
+    if (!f) return -1;
+    if (fputs("3\n", f) == EOF) {
+        fclose(f);
+        return -1;
+    }
+    return fclose(f) == 0 ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Scan path once in directory order and once in inode order and report
+ * the rate of each. With drop set, caches are dropped before every run;
+ * otherwise, or if that fails, an unreported scan warms them first so
+ * both runs start equal.
+ */
+static int run_benchmark(const histogram_spec_t *spec, const scan_options_t *base,
+                         const char *path, int drop) {
+    static const char *const order_names[] = { "directory", "inode" };
+    double rates[2] = { 0, 0 };
+    scan_options_t opts = *base;
+    int cold = drop && drop_caches() == 0;
+
+    for (int run = cold ? 0 : -1; run < 2; run++) {
+        histogram_t *hists[MAX_SCAN_HISTOGRAMS];
+        size_t count = create_histograms(spec, hists);
+        uint64_t entries;
+        double start, seconds;
+        int ret;
+
+        if (count == 0) {
+            fprintf(stderr, "Error: failed to create histogram\n");
+            return 1;
+        }
+        opts.inode_order = run > 0;
+        if (opts.dedup) inode_set_clear(opts.dedup);
+        if (cold && run > 0) drop_caches();
+
+        start = elapsed_seconds();
+        ret = scan_directory_multi(path, hists, count, &opts);
+        seconds = elapsed_seconds() - start;
+        entries = hists[0]->total_files + hists[0]->directories_scanned;
+        destroy_histograms(hists, count);
+        if (ret != 0) {
+            fprintf(stderr, "Error: failed to scan directory\n");
+            return 1;
+        }
+
+        if (run < 0) continue;
+        if (run == 0) {
+            printf("Benchmark: %s (%s cache)\n", path, cold ? "cold" : "warm");
+            printf("%-10s %12s %10s %12s\n", "Order", "Entries", "Seconds", "Entries/s");
+        }
+        rates[run] = seconds > 0 ? (double)entries / seconds : 0;
+        printf("%-10s %12llu %10.3f %12.0f\n", order_names[run],
+               (unsigned long long)entries, seconds, rates[run]);
+    }
+    if (rates[0] > 0) {
+        printf("Inode order speedup: %.2fx\n", rates[1] / rates[0]);
+    }
+    if (drop && !cold) {
+        fprintf(stderr, "Note: caches could not be dropped (needs root on Linux); "
+                        "both runs were timed warm\n");
+    } else if (!drop) {
+        fprintf(stderr, "Note: both runs were timed warm; for cold-cache numbers drop the "
+                        "caches before each run (--drop-caches as root on Linux)\n");
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     const char *target_dir = NULL;
     grouping_mode_t mode = GROUP_BY_MTIME;
-    const char *mode_name = "Modification Time";
     interval_t interval = INTERVAL_DAY;
+    const char *modes_list = NULL;
+    const char *intervals_list = NULL;
     export_format_t format = FORMAT_TEXT;
     const char *error_log_filename = NULL;
     int log_errors_to_stderr = 0;
     int use_stdin = 0;
     int batch_mode = 0;
+    int dedup_inodes = 0;
+    int benchmark = 0;
+    int benchmark_drop_caches = 0;
+    size_t batch_jobs = 1;
+    int unordered = 0;
+    const char *skip_fs = NULL;
+    mount_table_t *mounts = NULL;
+    const char *save_snapshot = NULL;
+    const char *from_snapshot = NULL;
+    const char *from_binary = NULL;
+    const char *incremental = NULL;
+    const char *compare_with = NULL;
+    size_t top_dirs = 10;
+    unsigned tree_depth = 0;
+    char incremental_tmp[MAX_PATH_LEN];
+    snapshot_t *previous = NULL;
+    snapshot_index_t *previous_index = NULL;
+    scan_options_t scan_opts;
+    histogram_spec_t spec;
+
+    scan_options_init(&scan_opts);
+    memset(&spec, 0, sizeof(spec));
 
     /* Parse command-line arguments */
     for (int i = 1; i < argc; i++) {
@@ -59,17 +933,10 @@ int main(int argc, char *argv[]) {
             return 0;
         } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mtime") == 0) {
             mode = GROUP_BY_MTIME;
-            mode_name = "Modification Time";
         } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--ctime") == 0) {
             mode = GROUP_BY_CTIME;
-#ifdef __APPLE__
-            mode_name = "Creation Time";
-#else
-            mode_name = "Change Time";
-#endif
         } else if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--atime") == 0) {
             mode = GROUP_BY_ATIME;
-            mode_name = "Access Time";
         } else if (strcmp(argv[i], "--hour") == 0) {
             interval = INTERVAL_HOUR;
         } else if (strcmp(argv[i], "--day") == 0) {
@@ -78,12 +945,35 @@ int main(int argc, char *argv[]) {
             interval = INTERVAL_MONTH;
         } else if (strcmp(argv[i], "--year") == 0) {
             interval = INTERVAL_YEAR;
+        } else if (strcmp(argv[i], "--modes") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --modes requires a list\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            modes_list = argv[++i];
+        } else if (strcmp(argv[i], "--intervals") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --intervals requires a list\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            intervals_list = argv[++i];
         } else if (strcmp(argv[i], "--csv") == 0) {
             format = FORMAT_CSV;
         } else if (strcmp(argv[i], "--json") == 0) {
             format = FORMAT_JSON;
         } else if (strcmp(argv[i], "--xml") == 0) {
             format = FORMAT_XML;
+        } else if (strcmp(argv[i], "--binary") == 0) {
+            format = FORMAT_BINARY;
+        } else if (strcmp(argv[i], "--from-binary") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --from-binary requires a filename\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            from_binary = argv[++i];
         } else if (strcmp(argv[i], "--error-log") == 0) {
             if (i + 1 >= argc) {
                 fprintf(stderr, "Error: --error-log requires a filename\n");
@@ -97,6 +987,175 @@ int main(int argc, char *argv[]) {
             use_stdin = 1;
         } else if (strcmp(argv[i], "--batch") == 0) {
             batch_mode = 1;
+        } else if (strcmp(argv[i], "--save-snapshot") == 0 ||
+                   strcmp(argv[i], "--save-state") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires a filename\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            save_snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--from-snapshot") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --from-snapshot requires a filename\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            from_snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--incremental") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --incremental requires a filename\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            incremental = argv[++i];
+        } else if (strcmp(argv[i], "--compare-with") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --compare-with requires a filename\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            compare_with = argv[++i];
+        } else if (strcmp(argv[i], "--top") == 0) {
+            char *end;
+            long top;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --top requires a number\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            top = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i] || top < 0 || top > 100000) {
+                fprintf(stderr, "Error: invalid directory count '%s'\n", argv[i]);
+                return 1;
+            }
+            top_dirs = (size_t)top;
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            char *end;
+            long threads;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --threads requires a number\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            threads = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i] || threads < 0 || threads > 1024) {
+                fprintf(stderr, "Error: invalid thread count '%s'\n", argv[i]);
+                return 1;
+            }
+            scan_opts.threads = (int)threads;
+        } else if (strcmp(argv[i], "--dirent-buffer") == 0) {
+            size_t size;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --dirent-buffer requires a size\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            if (parse_size(argv[++i], &size) != 0 || size < MIN_DIRENT_BUFFER_SIZE) {
+                fprintf(stderr, "Error: invalid buffer size '%s' (minimum 4K)\n", argv[i]);
+                return 1;
+            }
+            scan_opts.dirent_buffer_size = size;
+        } else if (strcmp(argv[i], "--max-open-dirs") == 0) {
+            char *end;
+            long count;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --max-open-dirs requires a number\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            count = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i] || count < MIN_MAX_OPEN_DIRS) {
+                fprintf(stderr, "Error: invalid directory count '%s' (minimum %d)\n",
+                        argv[i], MIN_MAX_OPEN_DIRS);
+                return 1;
+            }
+            scan_opts.max_open_dirs = (size_t)count;
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            char *end;
+            long jobs;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --jobs requires a number\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            jobs = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i] || jobs < 0 || jobs > MAX_BATCH_JOBS) {
+                fprintf(stderr, "Error: invalid job count '%s' (0-%d)\n", argv[i], MAX_BATCH_JOBS);
+                return 1;
+            }
+            batch_jobs = (size_t)jobs;
+        } else if (strcmp(argv[i], "--unordered") == 0) {
+            unordered = 1;
+        } else if (strcmp(argv[i], "--inode-order") == 0) {
+            scan_opts.inode_order = 1;
+        } else if (strcmp(argv[i], "--benchmark") == 0) {
+            benchmark = 1;
+        } else if (strcmp(argv[i], "--drop-caches") == 0) {
+            benchmark_drop_caches = 1;
+        } else if (strcmp(argv[i], "--dedup-inodes") == 0) {
+            dedup_inodes = 1;
+        } else if (strcmp(argv[i], "--disk-usage") == 0) {
+            spec.disk_usage = 1;
+        } else if (strcmp(argv[i], "--largest") == 0) {
+            char *end;
+            long largest;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --largest requires a number\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            largest = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i] || largest < 1 || largest > MAX_TOP_ENTRIES) {
+                fprintf(stderr, "Error: invalid entry count '%s' (1-%d)\n",
+                        argv[i], MAX_TOP_ENTRIES);
+                return 1;
+            }
+            spec.top_n = (size_t)largest;
+        } else if (strcmp(argv[i], "--tree") == 0) {
+            char *end;
+            long depth;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --tree requires a depth\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            depth = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i] || depth < 1 || depth > MAX_TREE_DEPTH) {
+                fprintf(stderr, "Error: invalid tree depth '%s' (1-%d)\n",
+                        argv[i], MAX_TREE_DEPTH);
+                return 1;
+            }
+            tree_depth = (unsigned)depth;
+        } else if (strcmp(argv[i], "-x") == 0 || strcmp(argv[i], "--one-file-system") == 0) {
+            scan_opts.one_file_system = 1;
+        } else if (strcmp(argv[i], "--skip-fs") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --skip-fs requires a list of filesystem types\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            skip_fs = argv[++i];
+        } else if (strcmp(argv[i], "--fast-stat") == 0) {
+            scan_opts.fast_stat = 1;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            scan_opts.use_io_uring = 1;
+        } else if (strcmp(argv[i], "--uring-depth") == 0) {
+            char *end;
+            long depth;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --uring-depth requires a number\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            depth = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i] || depth < 1 || depth > MAX_URING_DEPTH) {
+                fprintf(stderr, "Error: invalid io_uring depth '%s' (1-%d)\n",
+                        argv[i], MAX_URING_DEPTH);
+                return 1;
+            }
+            scan_opts.uring_depth = (unsigned)depth;
+            scan_opts.use_io_uring = 1;
         } else if (argv[i][0] == '-') {
             fprintf(stderr, "Error: unknown option '%s'\n", argv[i]);
             print_usage(argv[0]);
@@ -117,16 +1176,130 @@ int main(int argc, char *argv[]) {
         print_usage(argv[0]);
         return 1;
     }
-    if (!use_stdin && target_dir == NULL) {
+    if (from_snapshot && (use_stdin || target_dir || save_snapshot)) {
+        fprintf(stderr, "Error: --from-snapshot replaces scanning; "
+                        "do not combine it with a directory, --stdin or --save-snapshot\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (from_binary && (use_stdin || target_dir || from_snapshot || save_snapshot ||
+                        incremental || compare_with || benchmark || modes_list ||
+                        intervals_list)) {
+        fprintf(stderr, "Error: --from-binary outputs the histograms stored in an export; "
+                        "it takes no directory, --stdin, snapshot or histogram options\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (!use_stdin && target_dir == NULL && !from_snapshot && !from_binary) {
         fprintf(stderr, "Error: no directory specified\n");
         print_usage(argv[0]);
         return 1;
     }
+    if (benchmark && (!target_dir || save_snapshot || incremental || compare_with)) {
+        fprintf(stderr, "Error: --benchmark times a plain scan of one directory; "
+                        "it cannot be used with --stdin or snapshots\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (benchmark_drop_caches && !benchmark) {
+        fprintf(stderr, "Error: --drop-caches only applies to --benchmark\n");
+        return 1;
+    }
     if (batch_mode && !use_stdin) {
         fprintf(stderr, "Error: --batch requires --stdin\n");
         print_usage(argv[0]);
         return 1;
     }
+    if ((batch_jobs != 1 || unordered) && !batch_mode) {
+        fprintf(stderr, "Error: --jobs and --unordered require --stdin --batch\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (save_snapshot && batch_mode) {
+        fprintf(stderr, "Error: --save-snapshot cannot be used with --batch\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (incremental && (from_snapshot || save_snapshot || batch_mode)) {
+        fprintf(stderr, "Error: --incremental cannot be combined with "
+                        "--from-snapshot, --save-snapshot or --batch\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (compare_with && !from_snapshot && !save_snapshot && !incremental) {
+        fprintf(stderr, "Error: --compare-with needs the newer snapshot: "
+                        "use --from-snapshot, --save-snapshot or --incremental\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (compare_with && (batch_mode || modes_list || intervals_list)) {
+        fprintf(stderr, "Error: --compare-with takes one mode and interval and no --batch\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (compare_with && format == FORMAT_BINARY) {
+        fprintf(stderr, "Error: --binary exports histograms; it cannot be used with --compare-with\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (format == FORMAT_BINARY && !benchmark && stdout_is_terminal()) {
+        fprintf(stderr, "Error: not writing binary output to a terminal; redirect it to a file\n");
+        return 1;
+    }
+    if (spec.disk_usage && (from_snapshot || incremental || compare_with)) {
+        /* Snapshots record apparent sizes only */
+        fprintf(stderr, "Error: --disk-usage needs a live scan; it cannot be used with "
+                        "--from-snapshot, --incremental or --compare-with\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (spec.top_n > 0 && (from_snapshot || incremental || compare_with || from_binary)) {
+        /* Snapshots record file sizes but not file names */
+        fprintf(stderr, "Error: --largest needs a live scan; it cannot be used with "
+                        "--from-snapshot, --incremental, --compare-with or --from-binary\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (tree_depth > 0 && (batch_mode || from_snapshot || from_binary || compare_with ||
+                           benchmark || spec.top_n > 0)) {
+        fprintf(stderr, "Error: --tree splits the histograms of one scan by directory; it "
+                        "cannot be used with --batch, --from-snapshot, --from-binary, "
+                        "--compare-with, --benchmark or --largest\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (dedup_inodes && incremental) {
+        /* Files replayed from the snapshot carry no device or link count */
+        fprintf(stderr, "Error: --dedup-inodes cannot be used with --incremental\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (incremental) {
+        /* The new snapshot is written beside the old one and renamed over it */
+        if ((size_t)snprintf(incremental_tmp, sizeof(incremental_tmp), "%s.tmp",
+                             incremental) >= sizeof(incremental_tmp)) {
+            fprintf(stderr, "Error: snapshot path too long\n");
+            return 1;
+        }
+        save_snapshot = incremental_tmp;
+    }
+
+    /* Without --modes/--intervals the single -m/-c/-a and interval flags apply */
+    spec.modes[0] = mode;
+    spec.mode_count = 1;
+    spec.intervals[0] = interval;
+    spec.interval_count = 1;
+    if (modes_list && parse_modes(modes_list, spec.modes, &spec.mode_count) != 0) {
+        fprintf(stderr, "Error: invalid mode list '%s' (use m,c,a)\n", modes_list);
+        return 1;
+    }
+    if (intervals_list &&
+        parse_intervals(intervals_list, spec.intervals, &spec.interval_count) != 0) {
+        fprintf(stderr, "Error: invalid interval list '%s' (use hour,day,month,year)\n",
+                intervals_list);
+        return 1;
+    }
+    spec.multi = modes_list != NULL || intervals_list != NULL;
 
     /* Set up error logging */
     FILE *error_log_file = NULL;
@@ -137,40 +1310,133 @@ int main(int argc, char *argv[]) {
             return 1;
         }
     }
+    spec.error_log_file = error_log_file;
+    spec.log_errors_to_stderr = log_errors_to_stderr;
+
+    if (save_snapshot) {
+        scan_opts.snapshot = snapshot_writer_create(save_snapshot);
+        if (!scan_opts.snapshot) {
+            fprintf(stderr, "Error: cannot create snapshot file '%s'\n", save_snapshot);
+            if (error_log_file) fclose(error_log_file);
+            return 1;
+        }
+    }
+
+    if (incremental) {
+        /* A missing snapshot just means a full scan that creates it */
+        FILE *probe = fopen(incremental, "rb");
+        if (probe) {
+            fclose(probe);
+            previous = snapshot_open(incremental);
+            if (previous) previous_index = snapshot_index_create(previous);
+            scan_opts.reuse = previous_index;
+            if (!previous_index) {
+                fprintf(stderr, "Warning: cannot use snapshot '%s'; doing a full scan\n",
+                        incremental);
+                close_previous(&scan_opts, &previous_index, &previous);
+            }
+        }
+    }
+
+    if (dedup_inodes && !from_snapshot) {
+        scan_opts.dedup = inode_set_create();
+        if (!scan_opts.dedup) {
+            fprintf(stderr, "Error: out of memory\n");
+            discard_snapshot(scan_opts.snapshot, save_snapshot);
+            if (error_log_file) fclose(error_log_file);
+            return 1;
+        }
+    }
+
+    if ((scan_opts.one_file_system || skip_fs) && !from_snapshot) {
+        /* Without a table --one-file-system still works by device number */
+        mounts = mount_table_load();
+        if (mounts && skip_fs) mount_table_skip_types(mounts, skip_fs);
+        if (!mounts && skip_fs) {
+            fprintf(stderr, "Warning: mount table unavailable; --skip-fs has no effect\n");
+        }
+        scan_opts.mounts = mounts;
+    }
+
+    if (tree_depth > 0) {
+        scan_opts.tree = dir_tree_create(tree_depth, spec.modes, spec.mode_count,
+                                         spec.intervals, spec.interval_count, spec.disk_usage);
+        if (!scan_opts.tree) {
+            fprintf(stderr, "Error: out of memory\n");
+            discard_snapshot(scan_opts.snapshot, save_snapshot);
+            if (error_log_file) fclose(error_log_file);
+            return 1;
+        }
+    }
 
     int exit_code = 0;
 
-    if (use_stdin) {
+    if (benchmark) {
+        exit_code = run_benchmark(&spec, &scan_opts, target_dir,
+                                  benchmark_drop_caches);
+    } else if (from_binary) {
+        exit_code = output_binary_file(from_binary, format);
+    } else if (from_snapshot) {
+        /* Re-histogram a saved scan without touching the filesystem */
+        histogram_t *hists[MAX_SCAN_HISTOGRAMS];
+        snapshot_t *snap = snapshot_open(from_snapshot);
+        size_t count;
+
+        if (!snap) {
+            fprintf(stderr, "Error: cannot read snapshot '%s' (missing or not a snapshot)\n",
+                    from_snapshot);
+            if (error_log_file) fclose(error_log_file);
+            return 1;
+        }
+        count = create_histograms(&spec, hists);
+        if (count == 0) {
+            fprintf(stderr, "Error: failed to create histogram\n");
+            snapshot_close(snap);
+            if (error_log_file) fclose(error_log_file);
+            return 1;
+        }
+
+        snapshot_fill(snap, hists, count);
+        count = finalize_histograms(&spec, hists, count);
+        if (!compare_with) output_histograms(&spec, hists, count, format, snapshot_label(snap));
+        destroy_histograms(hists, count);
+        snapshot_close(snap);
+    } else if (use_stdin) {
         /* Read paths from stdin */
         char line[MAX_PATH_LEN];
-        histogram_t *aggregate_hist = NULL;
+        histogram_t *aggregate_hists[MAX_SCAN_HISTOGRAMS];
+        path_list_t aggregate_paths = { NULL, 0, 0 };
+        size_t hist_count = 0;
         int path_count = 0;
 
-        /* For aggregate mode, create one histogram */
+        /* For aggregate mode, create one histogram set */
         if (!batch_mode) {
-            aggregate_hist = histogram_create(interval);
-            if (!aggregate_hist) {
+            hist_count = create_histograms(&spec, aggregate_hists);
+            if (hist_count == 0) {
                 fprintf(stderr, "Error: failed to create histogram\n");
+                discard_snapshot(scan_opts.snapshot, save_snapshot);
                 if (error_log_file) fclose(error_log_file);
                 return 1;
             }
-            if (error_log_file) histogram_set_error_log(aggregate_hist, error_log_file);
-            if (log_errors_to_stderr) histogram_set_error_stderr(aggregate_hist, 1);
         }
 
-        /* For batch mode with JSON/XML/CSV, collect all histograms first */
-        #define MAX_BATCH_HISTOGRAMS 1024
-        histogram_t *batch_histograms[MAX_BATCH_HISTOGRAMS];
-        char *batch_paths[MAX_BATCH_HISTOGRAMS];
-        int batch_count = 0;
+        batch_output_t batch_out;
+        batch_runner_t *runner = NULL;
 
-        /* Output collection start for JSON/XML/CSV batch mode */
-        if (batch_mode && format == FORMAT_JSON) {
-            export_json_array_start();
-        } else if (batch_mode && format == FORMAT_XML) {
-            export_xml_collection_start();
-        } else if (batch_mode && format == FORMAT_CSV) {
-            export_csv_batch_start(mode_name, interval);
+        memset(&batch_out, 0, sizeof(batch_out));
+        batch_out.spec = &spec;
+        batch_out.format = format;
+        batch_out.interval = interval;
+
+        if (batch_mode) {
+            batch_output_start(&batch_out);
+            runner = batch_runner_create(batch_jobs, unordered, &scan_opts,
+                                         batch_output_result, &batch_out);
+            if (!runner) {
+                fprintf(stderr, "Error: cannot start batch scans\n");
+                if (error_log_file) fclose(error_log_file);
+                return 1;
+            }
         }
 
         while (fgets(line, sizeof(line), stdin)) {
@@ -185,166 +1451,118 @@ int main(int argc, char *argv[]) {
             path_count++;
 
             if (batch_mode) {
-                /* Batch mode: separate histogram per path */
-                histogram_t *hist = histogram_create(interval);
-                if (!hist) {
+                /* Batch mode: separate histogram set per path, output as each completes */
+                histogram_t *hists[MAX_SCAN_HISTOGRAMS];
+                size_t count = create_histograms(&spec, hists);
+                if (count == 0) {
                     fprintf(stderr, "Error: failed to create histogram for path: %s\n", line);
                     continue;
                 }
-                if (error_log_file) histogram_set_error_log(hist, error_log_file);
-                if (log_errors_to_stderr) histogram_set_error_stderr(hist, 1);
-
-                if (format == FORMAT_TEXT) {
-                    printf("Scanning '%s'...\n", line);
-                }
-                scan_directory(line, mode, hist);
-                histogram_finalize(hist);
-
-                char title[512];
-                snprintf(title, sizeof(title), "Disk Space by %s: %s", mode_name, line);
-
-                /* For JSON/XML/CSV, store histograms for later output */
-                if (format == FORMAT_JSON || format == FORMAT_XML || format == FORMAT_CSV) {
-                    if (batch_count < MAX_BATCH_HISTOGRAMS) {
-                        batch_histograms[batch_count] = hist;
-                        batch_paths[batch_count] = strdup(line); /* Store just the path, not title */
-                        batch_count++;
-                    } else {
-                        fprintf(stderr, "Warning: too many paths, skipping: %s\n", line);
-                        histogram_destroy(hist);
-                    }
-                } else {
-                    /* For TEXT, output immediately */
-                    display_histogram(hist, title);
-
-                    if (path_count > 1) {
-                        printf("\n");
-                    }
-
-                    histogram_destroy(hist);
+                if (batch_runner_submit(runner, line, hists, count) != 0) {
+                    fprintf(stderr, "Error: out of memory, skipping: %s\n", line);
+                    destroy_histograms(hists, count);
                 }
             } else {
-                /* Aggregate mode: accumulate into one histogram */
-                if (format == FORMAT_TEXT) {
-                    printf("Scanning '%s'...\n", line);
+                /* Aggregate mode: collect, so that nested paths are scanned once */
+                if (path_list_add(&aggregate_paths, line) != 0) {
+                    fprintf(stderr, "Error: out of memory, skipping: %s\n", line);
                 }
-                scan_directory(line, mode, aggregate_hist);
-            }
-        }
-
-        /* Output collected JSON/XML/CSV batch histograms */
-        if (batch_mode && (format == FORMAT_JSON || format == FORMAT_XML || format == FORMAT_CSV)) {
-            for (int i = 0; i < batch_count; i++) {
-                if (format == FORMAT_JSON) {
-                    /* For JSON, reconstruct full title */
-                    char title[512];
-                    snprintf(title, sizeof(title), "Disk Space by %s: %s", mode_name, batch_paths[i]);
-                    export_json_array_item(batch_histograms[i], title, (i == batch_count - 1));
-                } else if (format == FORMAT_XML) {
-                    /* For XML, reconstruct full title */
-                    char title[512];
-                    snprintf(title, sizeof(title), "Disk Space by %s: %s", mode_name, batch_paths[i]);
-                    export_xml_collection_item(batch_histograms[i], title);
-                } else if (format == FORMAT_CSV) {
-                    /* For CSV, pass just the path */
-                    export_csv_batch_item(batch_histograms[i], batch_paths[i], interval);
+            }
+        }
+
+        if (batch_mode) {
+            batch_runner_finish(runner);
+        } else {
+            /* Accumulate into one histogram set */
+            size_t listed = aggregate_paths.count;
+            aggregate_paths.count = drop_covered_paths(aggregate_paths.paths, listed,
+                                                         &scan_opts);
+            if (format == FORMAT_TEXT && aggregate_paths.count < listed) {
+                printf("Skipping %lu paths inside other listed paths\n",
+                       (unsigned long)(listed - aggregate_paths.count));
+            }
+            for (size_t p = 0; p < aggregate_paths.count; p++) {
+                if (format == FORMAT_TEXT) {
+                    printf("Scanning '%s'...\n", aggregate_paths.paths[p]);
                 }
-                histogram_destroy(batch_histograms[i]);
-                free(batch_paths[i]);
+                scan_directory_multi(aggregate_paths.paths[p], aggregate_hists, hist_count,
+                                     &scan_opts);
             }
+            path_list_free(&aggregate_paths);
         }
 
-        /* Output collection end for JSON/XML batch mode */
-        if (batch_mode && format == FORMAT_JSON) {
-            export_json_array_end();
-        } else if (batch_mode && format == FORMAT_XML) {
-            export_xml_collection_end();
+        if (batch_mode) {
+            batch_output_end(&batch_out);
         }
-        /* CSV batch mode has no end marker */
-
-        if (!batch_mode && aggregate_hist) {
-            /* Output aggregate histogram */
-            histogram_finalize(aggregate_hist);
-
-            char title[256];
-            snprintf(title, sizeof(title), "Disk Space by %s: %d paths", mode_name, path_count);
-
-            switch (format) {
-                case FORMAT_CSV:
-                    export_csv(aggregate_hist, title);
-                    break;
-                case FORMAT_JSON:
-                    /* Use array format for consistency */
-                    export_json_array_start();
-                    export_json_array_item(aggregate_hist, title, 1);
-                    export_json_array_end();
-                    break;
-                case FORMAT_XML:
-                    /* Use collection format for consistency */
-                    export_xml_collection_start();
-                    export_xml_collection_item(aggregate_hist, title);
-                    export_xml_collection_end();
-                    break;
-                case FORMAT_TEXT:
-                default:
-                    display_histogram(aggregate_hist, title);
-                    break;
-            }
-
-            histogram_destroy(aggregate_hist);
+
+        if (!batch_mode && hist_count > 0) {
+            /* Output aggregate histograms */
+            char subject[64];
+            hist_count = finalize_histograms(&spec, aggregate_hists, hist_count);
+            snprintf(subject, sizeof(subject), "%d paths", path_count);
+            close_previous(&scan_opts, &previous_index, &previous);
+            if (save_snapshot &&
+                finish_snapshot(scan_opts.snapshot, hist_count ? aggregate_hists[0] : NULL,
+                                subject, save_snapshot, incremental) != 0) {
+                fprintf(stderr, "Error: failed to write snapshot '%s'\n", save_snapshot);
+                exit_code = 1;
+            }
+            if (scan_opts.tree) {
+                output_tree(&spec, scan_opts.tree, hist_count ? aggregate_hists[0] : NULL, format);
+            } else if (!compare_with) {
+                output_histograms(&spec, aggregate_hists, hist_count, format, subject);
+            }
+            destroy_histograms(aggregate_hists, hist_count);
         }
     } else {
         /* Single directory mode (original behavior) */
-        histogram_t *hist = histogram_create(interval);
-        if (!hist) {
+        histogram_t *hists[MAX_SCAN_HISTOGRAMS];
+        size_t count = create_histograms(&spec, hists);
+        if (count == 0) {
             fprintf(stderr, "Error: failed to create histogram\n");
+            discard_snapshot(scan_opts.snapshot, save_snapshot);
             if (error_log_file) fclose(error_log_file);
             return 1;
         }
-        if (error_log_file) histogram_set_error_log(hist, error_log_file);
-        if (log_errors_to_stderr) histogram_set_error_stderr(hist, 1);
 
         if (format == FORMAT_TEXT) {
             printf("Scanning '%s'...\n", target_dir);
         }
-        if (scan_directory(target_dir, mode, hist) != 0) {
+        if (scan_directory_multi(target_dir, hists, count, &scan_opts) != 0) {
             fprintf(stderr, "Error: failed to scan directory\n");
-            histogram_destroy(hist);
+            discard_snapshot(scan_opts.snapshot, save_snapshot);
+            destroy_histograms(hists, count);
             if (error_log_file) fclose(error_log_file);
             return 1;
         }
 
-        histogram_finalize(hist);
-
-        char title[256];
-        snprintf(title, sizeof(title), "Disk Space by %s: %s", mode_name, target_dir);
-
-        switch (format) {
-            case FORMAT_CSV:
-                export_csv(hist, title);
-                break;
-            case FORMAT_JSON:
-                /* Use array format for consistency */
-                export_json_array_start();
-                export_json_array_item(hist, title, 1);
-                export_json_array_end();
-                break;
-            case FORMAT_XML:
-                /* Use collection format for consistency */
-                export_xml_collection_start();
-                export_xml_collection_item(hist, title);
-                export_xml_collection_end();
-                break;
-            case FORMAT_TEXT:
-            default:
-                display_histogram(hist, title);
-                break;
+        count = finalize_histograms(&spec, hists, count);
+        close_previous(&scan_opts, &previous_index, &previous);
+        if (save_snapshot &&
+            finish_snapshot(scan_opts.snapshot, count ? hists[0] : NULL, target_dir,
+                            save_snapshot, incremental) != 0) {
+            fprintf(stderr, "Error: failed to write snapshot '%s'\n", save_snapshot);
+            exit_code = 1;
         }
+        if (scan_opts.tree) {
+            output_tree(&spec, scan_opts.tree, count ? hists[0] : NULL, format);
+        } else if (!compare_with) {
+            output_histograms(&spec, hists, count, format, target_dir);
+        }
+        destroy_histograms(hists, count);
+    }
 
-        histogram_destroy(hist);
+    if (compare_with && exit_code == 0) {
+        exit_code = output_comparison(&spec, compare_with,
+                                      from_snapshot ? from_snapshot :
+                                      incremental ? incremental : save_snapshot,
+                                      top_dirs, format);
     }
 
     /* Cleanup */
+    dir_tree_destroy(scan_opts.tree);
+    inode_set_destroy(scan_opts.dedup);
+    mount_table_destroy(mounts);
     if (error_log_file) {
         fclose(error_log_file);
     }
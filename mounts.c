@@ -0,0 +1,243 @@
+#include "diskogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Mount table for --one-file-system and --skip-fs.
+ *
+ * On Linux the table is read from /proc/self/mountinfo, so mount points
+ * can be recognized by path and skipped without ever being opened: a dead
+ * NFS server can hang the open itself. Elsewhere no table is available and
+ * --one-file-system relies on comparing st_dev after opening a directory.
+ */
+
+struct mount_entry {
+    char *path;             /* absolute mount point, escapes decoded */
+    char *type;             /* filesystem type, e.g. "ext4", "nfs4" */
+    uint64_t dev;           /* major << 32 | minor, as in mountinfo */
+    size_t order;           /* position in mountinfo: later mounts hide earlier */
+    int skip;               /* type listed in --skip-fs */
+};
+
+struct mount_table {
+    struct mount_entry *entries;   /* sorted by path, then order */
+    size_t count;
+};
+
+/* Type groups accepted by --skip-fs next to plain type names */
+static const char *const pseudo_types[] = {
+    "proc", "sysfs", "devtmpfs", "devpts", "cgroup", "cgroup2", "debugfs",
+    "tracefs", "securityfs", "pstore", "bpf", "configfs", "fusectl", "mqueue",
+    "hugetlbfs", "autofs", "binfmt_misc", "efivarfs", "rpc_pipefs", "nsfs",
+    "selinuxfs", NULL
+};
+
+static const char *const network_types[] = {
+    "nfs", "nfs4", "cifs", "smb3", "smbfs", "ncpfs", "afs", "ceph", "9p",
+    "glusterfs", "fuse.glusterfs", "lustre", "gpfs", "fuse.sshfs", "fuse.s3fs",
+    "fuse.rclone", "davfs", "fuse.davfs2", NULL
+};
+
+static char* copy_string(const char *str, size_t len) {
+    char *copy = malloc(len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static int compare_mounts(const void *a, const void *b) {
+    const struct mount_entry *ma = (const struct mount_entry *)a;
+    const struct mount_entry *mb = (const struct mount_entry *)b;
+    int c = strcmp(ma->path, mb->path);
+    if (c != 0) return c;
+    return ma->order < mb->order ? -1 : ma->order > mb->order ? 1 : 0;
+}
+
+void mount_table_destroy(mount_table_t *mounts) {
+    if (!mounts) return;
+    for (size_t i = 0; i < mounts->count; i++) {
+        free(mounts->entries[i].path);
+        free(mounts->entries[i].type);
+    }
+    free(mounts->entries);
+    free(mounts);
+}
+
+#ifdef __linux__
+
+/* Decode the octal escapes (\040 for a space, ...) mountinfo uses in paths */
+static void decode_escapes(char *str) {
+    char *out = str;
+    for (char *in = str; *in; ) {
+        if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' &&
+            in[2] >= '0' && in[2] <= '7' && in[3] >= '0' && in[3] <= '7') {
+            *out++ = (char)((in[1] - '0') * 64 + (in[2] - '0') * 8 + (in[3] - '0'));
+            in += 4;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+}
+
+/*
+ * One mountinfo line: "id parent major:minor root mount-point options
+ * [optional fields...] - type source super-options". Returns 0 and fills
+ * entry, or -1 if the line is malformed or memory runs out.
+ */
+static int parse_mountinfo_line(char *line, struct mount_entry *entry) {
+    char *fields[5];
+    char *p = line;
+    char *sep;
+    char *type;
+    unsigned long major, minor;
+
+    for (int i = 0; i < 5; i++) {
+        while (*p == ' ') p++;
+        if (*p == '\0') return -1;
+        fields[i] = p;
+        while (*p && *p != ' ') p++;
+        if (*p) *p++ = '\0';
+    }
+    if (sscanf(fields[2], "%lu:%lu", &major, &minor) != 2) return -1;
+
+    /* The optional fields end at a lone "-" */
+    sep = strstr(p, " - ");
+    if (!sep) return -1;
+    type = sep + 3;
+    type[strcspn(type, " \n")] = '\0';
+
+    decode_escapes(fields[4]);
+    entry->path = copy_string(fields[4], strlen(fields[4]));
+    entry->type = copy_string(type, strlen(type));
+    entry->dev = ((uint64_t)major << 32) | minor;
+    entry->skip = 0;
+    if (!entry->path || !entry->type) {
+        free(entry->path);
+        free(entry->type);
+        return -1;
+    }
+    return 0;
+}
+
+mount_table_t* mount_table_load(void) {
+    FILE *f = fopen("/proc/self/mountinfo", "r");
+    mount_table_t *mounts;
+    size_t capacity = 64;
+    char line[MAX_PATH_LEN * 2];
+
+    if (!f) return NULL;
+    mounts = calloc(1, sizeof(mount_table_t));
+    if (mounts) mounts->entries = malloc(sizeof(struct mount_entry) * capacity);
+    if (!mounts || !mounts->entries) {
+        free(mounts);
+        fclose(f);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        struct mount_entry entry;
+        if (parse_mountinfo_line(line, &entry) != 0) continue;
+        if (mounts->count == capacity) {
+            struct mount_entry *grown = realloc(mounts->entries,
+                                                sizeof(struct mount_entry) * capacity * 2);
+            if (!grown) {
+                free(entry.path);
+                free(entry.type);
+                break;
+            }
+            mounts->entries = grown;
+            capacity *= 2;
+        }
+        entry.order = mounts->count;
+        mounts->entries[mounts->count++] = entry;
+    }
+    fclose(f);
+
+    qsort(mounts->entries, mounts->count, sizeof(struct mount_entry), compare_mounts);
+    return mounts;
+}
+
+#else
+
+mount_table_t* mount_table_load(void) {
+    return NULL;
+}
+
+#endif
+
+static int type_listed(const char *type, const char *const *types) {
+    for (size_t i = 0; types[i]; i++) {
+        if (strcmp(type, types[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Mark mounts whose type is in list, a comma-separated mix of type names
+ * and the groups "pseudo" (proc, sysfs, cgroup, ...) and "network" (nfs,
+ * cifs, ceph, ...).
+ */
+void mount_table_skip_types(mount_table_t *mounts, const char *list) {
+    for (size_t i = 0; i < mounts->count; i++) {
+        struct mount_entry *m = &mounts->entries[i];
+        const char *p = list;
+
+        while (*p && !m->skip) {
+            size_t len = strcspn(p, ",");
+            if ((len == 6 && strncmp(p, "pseudo", len) == 0 && type_listed(m->type, pseudo_types)) ||
+                (len == 7 && strncmp(p, "network", len) == 0 && type_listed(m->type, network_types)) ||
+                (len == strlen(m->type) && strncmp(p, m->type, len) == 0)) {
+                m->skip = 1;
+            }
+            p += len;
+            if (*p == ',') p++;
+        }
+    }
+}
+
+/* The visible mount at exactly path (the last one mounted there), or NULL */
+static const struct mount_entry* find_mount(const mount_table_t *mounts, const char *path) {
+    size_t lo = 0;
+    size_t hi = mounts->count;
+
+    /* Upper bound of path: one past the last entry whose path is <= path */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(mounts->entries[mid].path, path) <= 0) lo = mid + 1; else hi = mid;
+    }
+    if (lo > 0 && strcmp(mounts->entries[lo - 1].path, path) == 0) {
+        return &mounts->entries[lo - 1];
+    }
+    return NULL;
+}
+
+/* Device of the filesystem mounted at or above the absolute path */
+uint64_t mount_table_device_of(const mount_table_t *mounts, const char *path) {
+    char buf[MAX_PATH_LEN];
+    size_t len = strlen(path);
+
+    if (len >= sizeof(buf)) return 0;
+    memcpy(buf, path, len + 1);
+    for (;;) {
+        const struct mount_entry *m = find_mount(mounts, len ? buf : "/");
+        if (m) return m->dev;
+        while (len > 0 && buf[len - 1] != '/') len--;
+        if (len == 0) return 0;
+        buf[--len] = '\0';
+    }
+}
+
+/*
+ * Whether the directory at the absolute path is a mount point the scan
+ * must not enter: its type is skipped, or (with one_file_system) it holds
+ * a filesystem other than root_dev.
+ */
+int mount_table_excluded(const mount_table_t *mounts, const char *path,
+                         int one_file_system, uint64_t root_dev) {
+    const struct mount_entry *m = find_mount(mounts, path);
+    if (!m) return 0;
+    return m->skip || (one_file_system && m->dev != root_dev);
+}
@@ -0,0 +1,329 @@
+#include "diskogram.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+/*
+ * Buffered writer behind every exporter and the terminal display.
+ *
+ * Output is gathered in a fixed buffer inside output_t (no allocation) and
+ * handed to the FILE in one fwrite per buffer, which stdio passes straight
+ * to write() since it exceeds its own buffer. Anything already printed to
+ * the same FILE stays in order: it is flushed ahead of our block. Integers,
+ * dates and escaped strings are formatted by hand; escaping copies runs of
+ * bytes that need no escape in one piece.
+ */
+
+void output_init(output_t *out, FILE *file) {
+    out->file = file;
+    out->len = 0;
+}
+
+void output_flush(output_t *out) {
+    if (out->len > 0) {
+        fwrite(out->buf, 1, out->len, out->file);
+        out->len = 0;
+    }
+    fflush(out->file);
+}
+
+void output_write(output_t *out, const char *data, size_t len) {
+    if (len > sizeof(out->buf) - out->len) {
+        if (out->len > 0) {
+            fwrite(out->buf, 1, out->len, out->file);
+            out->len = 0;
+        }
+        if (len >= sizeof(out->buf)) {
+            fwrite(data, 1, len, out->file);
+            return;
+        }
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+void output_str(output_t *out, const char *str) {
+    output_write(out, str, strlen(str));
+}
+
+void output_char(output_t *out, char c) {
+    if (out->len == sizeof(out->buf)) {
+        fwrite(out->buf, 1, out->len, out->file);
+        out->len = 0;
+    }
+    out->buf[out->len++] = c;
+}
+
+/* count copies of c, e.g. a bar of the histogram */
+void output_repeat(output_t *out, char c, size_t count) {
+    while (count > 0) {
+        size_t room = sizeof(out->buf) - out->len;
+        size_t n = count < room ? count : room;
+        if (n == 0) {
+            fwrite(out->buf, 1, out->len, out->file);
+            out->len = 0;
+            continue;
+        }
+        memset(out->buf + out->len, c, n);
+        out->len += n;
+        count -= n;
+    }
+}
+
+void output_u64(output_t *out, uint64_t value) {
+    char digits[20];
+    size_t pos = sizeof(digits);
+
+    do {
+        digits[--pos] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    output_write(out, digits + pos, sizeof(digits) - pos);
+}
+
+void output_i64(output_t *out, int64_t value) {
+    if (value < 0) {
+        output_char(out, '-');
+        output_u64(out, (uint64_t)0 - (uint64_t)value);
+    } else {
+        output_u64(out, (uint64_t)value);
+    }
+}
+
+/* printf-style formatting for the few fields integers and strings do not cover */
+void output_format(output_t *out, const char *fmt, ...) {
+    va_list args;
+    int n;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t room = sizeof(out->buf) - out->len;
+        va_start(args, fmt);
+        n = vsnprintf(out->buf + out->len, room, fmt, args);
+        va_end(args);
+        if (n < 0) return;
+        if ((size_t)n < room) {
+            out->len += (size_t)n;
+            return;
+        }
+        /* Did not fit: flush and try again with the whole buffer */
+        fwrite(out->buf, 1, out->len, out->file);
+        out->len = 0;
+    }
+    /* Longer than the buffer itself */
+    va_start(args, fmt);
+    vfprintf(out->file, fmt, args);
+    va_end(args);
+}
+
+/*
+ * Dates. Exporters label every bucket of every histogram, and in batch mode
+ * the same buckets recur for each path, so bucket labels are kept in a
+ * direct-mapped cache per interval, keyed by bucket start. Misses are
+ * formatted from calendar_local_time(), which converts with cached UTC
+ * offsets rather than calling localtime(). The cache is shared by all
+ * output and is not thread-safe; display and export run on one thread.
+ */
+
+#define LABEL_CACHE_SLOTS 1024  /* per interval, a power of two */
+#define MAX_LABEL_LEN 32
+
+typedef struct {
+    time_t start;           /* bucket start the label belongs to */
+    unsigned char len;      /* 0 = empty slot */
+    char text[MAX_LABEL_LEN];
+} label_slot_t;
+
+static struct {
+    calendar_t *calendar;   /* created on first use, kept for the process */
+    label_slot_t slots[INTERVAL_YEAR + 1][LABEL_CACHE_SLOTS];
+} labels;
+
+/* Rough length of each interval, so consecutive buckets use consecutive slots */
+static const int64_t interval_seconds[INTERVAL_YEAR + 1] = {
+    3600, 86400, 2629746, 31556952
+};
+
+static struct tm* label_local_time(time_t t, struct tm *result) {
+    if (!labels.calendar) labels.calendar = calendar_create();
+    if (labels.calendar) return calendar_local_time(labels.calendar, t, result);
+
+    struct tm *tm_info = localtime(&t);
+    if (!tm_info) return NULL;
+    *result = *tm_info;
+    return result;
+}
+
+/* value in decimal at p, unpadded like strftime's %Y; returns the end */
+static char* put_int(char *p, int64_t value) {
+    char digits[20];
+    size_t pos = sizeof(digits);
+    uint64_t magnitude = value < 0 ? (uint64_t)0 - (uint64_t)value : (uint64_t)value;
+
+    do {
+        digits[--pos] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) *p++ = '-';
+    memcpy(p, digits + pos, sizeof(digits) - pos);
+    return p + (sizeof(digits) - pos);
+}
+
+/* value as exactly two digits, zero-padded */
+static char* put_2digits(char *p, int value) {
+    p[0] = (char)('0' + value / 10 % 10);
+    p[1] = (char)('0' + value % 10);
+    return p + 2;
+}
+
+/* "YYYY-MM-DD", like strftime's %Y-%m-%d */
+static char* put_date(char *p, const struct tm *tm) {
+    p = put_int(p, (int64_t)tm->tm_year + 1900);
+    *p++ = '-';
+    p = put_2digits(p, tm->tm_mon + 1);
+    *p++ = '-';
+    return put_2digits(p, tm->tm_mday);
+}
+
+/*
+ * Local time t as "YYYY-MM-DDTHH:MM:SS". Returns -1 and writes nothing if
+ * t cannot be converted.
+ */
+int output_timestamp(output_t *out, time_t t) {
+    struct tm tm;
+    char text[MAX_LABEL_LEN];
+    char *p;
+
+    if (!label_local_time(t, &tm)) return -1;
+    p = put_date(text, &tm);
+    *p++ = 'T';
+    p = put_2digits(p, tm.tm_hour);
+    *p++ = ':';
+    p = put_2digits(p, tm.tm_min);
+    *p++ = ':';
+    p = put_2digits(p, tm.tm_sec);
+    output_write(out, text, (size_t)(p - text));
+    return 0;
+}
+
+/* Label of a bucket: "YYYY-MM-DD HH:00", "YYYY-MM-DD", "YYYY-MM" or "YYYY" */
+static size_t format_label(char *text, const struct tm *tm, interval_t interval) {
+    char *p;
+
+    switch (interval) {
+        case INTERVAL_HOUR:
+            p = put_date(text, tm);
+            *p++ = ' ';
+            p = put_2digits(p, tm->tm_hour);
+            memcpy(p, ":00", 3);
+            p += 3;
+            break;
+        case INTERVAL_MONTH:
+            p = put_int(text, (int64_t)tm->tm_year + 1900);
+            *p++ = '-';
+            p = put_2digits(p, tm->tm_mon + 1);
+            break;
+        case INTERVAL_YEAR:
+            p = put_int(text, (int64_t)tm->tm_year + 1900);
+            break;
+        case INTERVAL_DAY:
+        default:
+            p = put_date(text, tm);
+            break;
+    }
+    return (size_t)(p - text);
+}
+
+/* Label of the bucket starting at t by interval, or "unknown" */
+void output_bucket_time(output_t *out, time_t t, interval_t interval) {
+    size_t cache = interval <= INTERVAL_YEAR ? (size_t)interval : (size_t)INTERVAL_DAY;
+    label_slot_t *slot = &labels.slots[cache][(uint64_t)(t / interval_seconds[cache]) &
+                                              (LABEL_CACHE_SLOTS - 1)];
+
+    if (slot->len == 0 || slot->start != t) {
+        struct tm tm;
+        if (!label_local_time(t, &tm)) {
+            output_str(out, "unknown");
+            return;
+        }
+        slot->start = t;
+        slot->len = (unsigned char)format_label(slot->text, &tm, interval);
+    }
+    output_write(out, slot->text, slot->len);
+}
+
+/* Escape a string for safe JSON output; NULL is written as null */
+void output_json_escaped(output_t *out, const char *str) {
+    if (!str) {
+        output_str(out, "null");
+        return;
+    }
+
+    for (;;) {
+        const char *run = str;
+        unsigned char c;
+
+        while ((c = (unsigned char)*str) >= 0x20 && c != '"' && c != '\\') {
+            str++;
+        }
+        output_write(out, run, (size_t)(str - run));
+        if (c == '\0') return;
+
+        switch (c) {
+            case '"':  output_str(out, "\\\""); break;
+            case '\\': output_str(out, "\\\\"); break;
+            case '\b': output_str(out, "\\b"); break;
+            case '\f': output_str(out, "\\f"); break;
+            case '\n': output_str(out, "\\n"); break;
+            case '\r': output_str(out, "\\r"); break;
+            case '\t': output_str(out, "\\t"); break;
+            default: {
+                /* Other control characters */
+                static const char hex[] = "0123456789abcdef";
+                char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                output_write(out, escape, sizeof(escape));
+                break;
+            }
+        }
+        str++;
+    }
+}
+
+/* Escape a string for safe XML output; NULL writes nothing */
+void output_xml_escaped(output_t *out, const char *str) {
+    if (!str) return;
+
+    for (;;) {
+        size_t run = strcspn(str, "<>&\"'");
+        output_write(out, str, run);
+        str += run;
+
+        switch (*str) {
+            case '\0': return;
+            case '<':  output_str(out, "&lt;"); break;
+            case '>':  output_str(out, "&gt;"); break;
+            case '&':  output_str(out, "&amp;"); break;
+            case '"':  output_str(out, "&quot;"); break;
+            default:   output_str(out, "&apos;"); break;
+        }
+        str++;
+    }
+}
+
+/* Write a CSV field, quoting it if it contains commas, quotes or newlines */
+void output_csv_field(output_t *out, const char *str) {
+    if (str[strcspn(str, ",\"\n")] == '\0') {
+        output_str(out, str);
+        return;
+    }
+
+    output_char(out, '"');
+    for (;;) {
+        size_t run = strcspn(str, "\"");
+        output_write(out, str, run);
+        str += run;
+        if (*str == '\0') break;
+        output_str(out, "\"\""); /* Escape quotes by doubling */
+        str++;
+    }
+    output_char(out, '"');
+}
@@ -7,8 +7,20 @@
     #include <windows.h>
 #else
     #include <dirent.h>
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <limits.h>
+    #include <pthread.h>
+    #include <sys/resource.h>
     #include <sys/stat.h>
     #include <unistd.h>
+    #ifdef __linux__
+        #include <linux/stat.h>
+        #include <sys/syscall.h>
+        #if defined(STATX_TYPE) && defined(SYS_statx)
+            #define HAVE_STATX 1
+        #endif
+    #endif
 #endif
 
 #ifdef _WIN32
@@ -20,32 +32,118 @@ static time_t filetime_to_time_t(FILETIME ft) {
     return (time_t)(ull.QuadPart / 10000000ULL - 11644473600ULL);
 }
 
-static int scan_directory_win32(const char *path, grouping_mode_t mode, histogram_t *hist) {
+/* Count an error against every histogram; log it once */
+static void record_error_win32(histogram_t **hists, size_t count, const char *msg) {
+    for (size_t i = 0; i < count; i++) {
+        hists[i]->error_count++;
+        snprintf(hists[i]->last_error, sizeof(hists[i]->last_error), "%s", msg);
+    }
+    histogram_log_error(hists[0], msg);
+}
+
+/* Snapshot recording state of a Win32 scan */
+typedef struct {
+    snapshot_writer_t *writer;
+    snapshot_batch_t *batch;
+} win32_snapshot_t;
+
+/* Directory tree state of a Win32 scan (--tree) */
+typedef struct {
+    dir_tree_t *tree;
+    tree_batch_t *batch;
+} win32_tree_t;
+
+static void win32_file_info(const WIN32_FIND_DATAA *find_data, file_info_t *info) {
+    ULARGE_INTEGER file_size;
+    file_size.LowPart = find_data->nFileSizeLow;
+    file_size.HighPart = find_data->nFileSizeHigh;
+    info->size = file_size.QuadPart;
+    info->allocated = info->size;
+    info->mtime = filetime_to_time_t(find_data->ftLastWriteTime);
+    info->ctime = filetime_to_time_t(find_data->ftCreationTime);
+    info->atime = filetime_to_time_t(find_data->ftLastAccessTime);
+    info->ino = 0;  /* FindFirstFile does not report file IDs or link counts */
+    info->dev = 0;
+    info->nlink = 1;
+}
+
+/*
+ * A directory waiting to be scanned. Pending directories form a heap
+ * allocated stack, so depth costs no call stack and only the directory
+ * being read holds a find handle.
+ */
+typedef struct win32_task {
+    struct win32_task *next;
+    uint64_t parent_id;     /* snapshot id of the parent, 0 for the root */
+    file_info_t info;       /* the directory itself, for snapshots */
+    tree_node_t *node;      /* --tree node its files count toward, NULL = off */
+    size_t name_offset;     /* last path component; 0 (whole path) at the root */
+    char path[];
+} win32_task_t;
+
+static win32_task_t* win32_task_create(const char *parent, const char *name,
+                                       uint64_t parent_id, const file_info_t *info) {
+    size_t parent_len = strlen(parent);
+    size_t name_len = name ? strlen(name) : 0;
+    win32_task_t *task = malloc(sizeof(win32_task_t) + parent_len + 1 + name_len + 1);
+    if (!task) return NULL;
+
+    memcpy(task->path, parent, parent_len + 1);
+    task->name_offset = 0;
+    if (name) {
+        task->path[parent_len] = '\\';
+        memcpy(task->path + parent_len + 1, name, name_len + 1);
+        task->name_offset = parent_len + 1;
+    }
+    task->next = NULL;
+    task->parent_id = parent_id;
+    task->info = *info;
+    task->node = NULL;
+    return task;
+}
+
+/*
+ * Read one directory completely: files are counted, subdirectories are
+ * pushed on *stack. The find handle is closed before returning.
+ */
+static int scan_directory_win32(win32_task_t *task, histogram_t **hists, size_t count,
+                                win32_snapshot_t *snap, win32_tree_t *tree,
+                                win32_task_t **stack) {
+    const char *path = task->path;
     WIN32_FIND_DATAA find_data;
     HANDLE hFind;
     char search_path[MAX_PATH_LEN];
     char full_path[MAX_PATH_LEN];
+    char msg[sizeof(hists[0]->last_error)];
+    top_dir_sums_t top[MAX_SCAN_HISTOGRAMS];
     int ret;
 
+    memset(top, 0, sizeof(top));
     ret = snprintf(search_path, sizeof(search_path), "%s\\*", path);
     if (ret < 0 || (size_t)ret >= sizeof(search_path)) {
-        hist->error_count++;
-        snprintf(hist->last_error, sizeof(hist->last_error),
-                 "Path too long (MAX_PATH exceeded): %s", path);
-        histogram_log_error(hist, hist->last_error);
+        snprintf(msg, sizeof(msg), "Path too long (MAX_PATH exceeded): %s", path);
+        record_error_win32(hists, count, msg);
         return -1;
     }
 
     hFind = FindFirstFileA(search_path, &find_data);
     if (hFind == INVALID_HANDLE_VALUE) {
-        hist->error_count++;
-        snprintf(hist->last_error, sizeof(hist->last_error),
-                 "Cannot open directory: %s", path);
-        histogram_log_error(hist, hist->last_error);
+        snprintf(msg, sizeof(msg), "Cannot open directory: %s", path);
+        record_error_win32(hists, count, msg);
         return -1;
     }
 
-    hist->directories_scanned++;
+    for (size_t i = 0; i < count; i++) {
+        hists[i]->directories_scanned++;
+    }
+    if (tree) tree_batch_add_dir(tree->batch, task->node);
+
+    uint64_t id = 0;
+    if (snap) {
+        id = snapshot_next_dir_id(snap->writer);
+        snapshot_batch_add_dir(snap->batch, id, task->parent_id, &task->info,
+                               path + task->name_offset);
+    }
 
     do {
         if (strcmp(find_data.cFileName, ".") == 0 ||
@@ -55,10 +153,9 @@ static int scan_directory_win32(const char *path, grouping_mode_t mode, histogra
 
         ret = snprintf(full_path, sizeof(full_path), "%s\\%s", path, find_data.cFileName);
         if (ret < 0 || (size_t)ret >= sizeof(full_path)) {
-            hist->error_count++;
-            snprintf(hist->last_error, sizeof(hist->last_error),
-                     "Path too long (MAX_PATH exceeded): %s\\%s", path, find_data.cFileName);
-            histogram_log_error(hist, hist->last_error);
+            snprintf(msg, sizeof(msg), "Path too long (MAX_PATH exceeded): %s\\%s",
+                     path, find_data.cFileName);
+            record_error_win32(hists, count, msg);
             continue;
         }
 
@@ -67,107 +164,1346 @@ static int scan_directory_win32(const char *path, grouping_mode_t mode, histogra
             if (find_data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
                 continue;
             }
-            scan_directory_win32(full_path, mode, hist);
+            file_info_t info;
+            win32_task_t *child;
+            win32_file_info(&find_data, &info);
+            child = win32_task_create(path, find_data.cFileName, id, &info);
+            if (!child) {
+                snprintf(msg, sizeof(msg), "Out of memory queueing directory: %s", full_path);
+                record_error_win32(hists, count, msg);
+                continue;
+            }
+            if (task->node &&
+                !(child->node = dir_tree_child(tree->tree, task->node, find_data.cFileName))) {
+                snprintf(msg, sizeof(msg), "Out of memory adding to directory tree: %s",
+                         full_path);
+                record_error_win32(hists, count, msg);
+            }
+            child->next = *stack;
+            *stack = child;
         } else if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
-            ULARGE_INTEGER file_size;
-            file_size.LowPart = find_data.nFileSizeLow;
-            file_size.HighPart = find_data.nFileSizeHigh;
-
-            time_t file_time;
-            switch (mode) {
-                case GROUP_BY_MTIME:
-                    file_time = filetime_to_time_t(find_data.ftLastWriteTime);
-                    break;
-                case GROUP_BY_CTIME:
-                    file_time = filetime_to_time_t(find_data.ftCreationTime);
-                    break;
-                case GROUP_BY_ATIME:
-                    file_time = filetime_to_time_t(find_data.ftLastAccessTime);
-                    break;
-                default:
-                    file_time = filetime_to_time_t(find_data.ftLastWriteTime);
+            file_info_t info;
+            win32_file_info(&find_data, &info);
+
+            /* Only sparse and compressed files occupy less than their size */
+            if (hists[0]->disk_usage &&
+                (find_data.dwFileAttributes &
+                 (FILE_ATTRIBUTE_SPARSE_FILE | FILE_ATTRIBUTE_COMPRESSED))) {
+                DWORD high = 0;
+                DWORD low = GetCompressedFileSizeA(full_path, &high);
+                if (low != INVALID_FILE_SIZE || GetLastError() == NO_ERROR) {
+                    info.allocated = ((uint64_t)high << 32) | low;
+                }
             }
 
-            histogram_add_file(hist, file_time, file_size.QuadPart);
+            for (size_t i = 0; i < count; i++) {
+                histogram_add_file_info(hists[i], &info);
+                histogram_add_top_file(hists[i], &info, path, find_data.cFileName, &top[i]);
+            }
+            if (snap) snapshot_batch_add_file(snap->batch, id, &info);
+            if (tree) tree_batch_add_file(tree->batch, task->node, &info);
         }
     } while (FindNextFileA(hFind, &find_data) != 0);
 
     FindClose(hFind);
+    for (size_t i = 0; i < count; i++) {
+        histogram_add_top_dir(hists[i], &top[i], path);
+    }
     return 0;
 }
 
+/* Depth-first walk from root; fails only if the root itself cannot be read */
+static int scan_tree_win32(win32_task_t *root, histogram_t **hists, size_t count,
+                           win32_snapshot_t *snap, win32_tree_t *tree) {
+    win32_task_t *stack = NULL;
+    int ret = scan_directory_win32(root, hists, count, snap, tree, &stack);
+
+    free(root);
+    while (stack) {
+        win32_task_t *task = stack;
+        stack = task->next;
+        scan_directory_win32(task, hists, count, snap, tree, &stack);
+        free(task);
+    }
+    return ret;
+}
+
 #else
 
-static int scan_directory_posix(const char *path, grouping_mode_t mode, histogram_t *hist) {
+/* Directory entry types, taken from d_type when the filesystem reports it */
+typedef enum {
+    ENTRY_UNKNOWN,      /* needs a stat to find out */
+    ENTRY_FILE,
+    ENTRY_DIR,
+    ENTRY_OTHER         /* symlinks, devices, sockets, FIFOs */
+} entry_type_t;
+
+typedef struct {
+    const char *name;
+    uint64_t ino;
+    entry_type_t type;
+} dir_entry_t;
+
+/*
+ * Batch directory reader. On Linux entries are pulled straight from the
+ * kernel with getdents64 into a large caller-supplied buffer, so a directory
+ * with thousands of entries costs a handful of syscalls; elsewhere it wraps
+ * readdir.
+ */
+typedef struct {
+    int fd;
+#ifdef __linux__
+    char *buf;
+    size_t buf_size;
+    size_t pos;
+    size_t len;
+#else
     DIR *dir;
-    struct dirent *entry;
-    struct stat st;
-    char full_path[MAX_PATH_LEN];
+#endif
+} dir_reader_t;
 
-    dir = opendir(path);
-    if (!dir) {
-        hist->error_count++;
-        snprintf(hist->last_error, sizeof(hist->last_error),
-                 "Cannot open directory: %s", path);
-        histogram_log_error(hist, hist->last_error);
-        return -1;
+#ifndef AT_STATX_DONT_SYNC
+    #define AT_STATX_DONT_SYNC 0x4000
+#endif
+
+/* Unsubmitted async stats that trigger an io_uring_enter */
+#define STAT_SUBMIT_BATCH 32
+
+#ifdef __linux__
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+static entry_type_t entry_type_from_dtype(unsigned char d_type) {
+    switch (d_type) {
+        case DT_REG:     return ENTRY_FILE;
+        case DT_DIR:     return ENTRY_DIR;
+        case DT_UNKNOWN: return ENTRY_UNKNOWN;
+        default:         return ENTRY_OTHER;
     }
+}
 
-    hist->directories_scanned++;
+static int dir_reader_open(dir_reader_t *reader, int fd, char *buf, size_t buf_size) {
+    reader->fd = fd;
+#ifdef __linux__
+    reader->buf = buf;
+    reader->buf_size = buf_size;
+    reader->pos = 0;
+    reader->len = 0;
+    return 0;
+#else
+    (void)buf;
+    (void)buf_size;
+    /* The stream gets its own descriptor; fd stays open for openat/fstatat */
+    int dup_fd = dup(fd);
+    if (dup_fd < 0) return -1;
+    reader->dir = fdopendir(dup_fd);
+    if (!reader->dir) {
+        close(dup_fd);
+        return -1;
+    }
+    return 0;
+#endif
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 ||
-            strcmp(entry->d_name, "..") == 0) {
+/* Fetch the next entry, skipping "." and "..". Returns 1, 0 at end, -1 on error */
+static int dir_reader_next(dir_reader_t *reader, dir_entry_t *entry) {
+    for (;;) {
+#ifdef __linux__
+        if (reader->pos >= reader->len) {
+            long n = syscall(SYS_getdents64, reader->fd, reader->buf, reader->buf_size);
+            if (n < 0) return -1;
+            if (n == 0) return 0;
+            reader->pos = 0;
+            reader->len = (size_t)n;
+        }
+        struct linux_dirent64 *d = (struct linux_dirent64 *)(reader->buf + reader->pos);
+        reader->pos += d->d_reclen;
+        entry->name = d->d_name;
+        entry->ino = d->d_ino;
+        entry->type = entry_type_from_dtype(d->d_type);
+#else
+        struct dirent *d;
+        errno = 0;
+        d = readdir(reader->dir);
+        if (!d) return errno ? -1 : 0;
+        entry->name = d->d_name;
+        entry->ino = (uint64_t)d->d_ino;
+#ifdef DT_UNKNOWN
+        entry->type = entry_type_from_dtype(d->d_type);
+#else
+        entry->type = ENTRY_UNKNOWN;
+#endif
+#endif
+        if (entry->name[0] == '.' &&
+            (entry->name[1] == '\0' || (entry->name[1] == '.' && entry->name[2] == '\0'))) {
             continue;
         }
+        return 1;
+    }
+}
+
+static void dir_reader_close(dir_reader_t *reader) {
+#ifdef __linux__
+    (void)reader;
+#else
+    closedir(reader->dir);
+#endif
+}
+
+/*
+ * An open directory. Child tasks and in-flight asynchronous stats keep a
+ * reference so they can work relative to it with openat()/statx(); the
+ * descriptor is closed when the last of them is done.
+ *
+ * Only max_open_dirs descriptors are kept that way. Past the budget a
+ * directory is read and closed in one go (fd becomes -1) and its children
+ * are opened by full path, so deep or wide trees cannot run the process
+ * out of descriptors.
+ */
+typedef struct {
+    int fd;
+    size_t *open_count;     /* pool counter charged while fd is kept, or NULL */
+    size_t refs;
+    uint64_t id;            /* snapshot directory id, 0 when not recording */
+    size_t reuse_ref;       /* this directory in opts->reuse, 0 if unknown */
+    tree_node_t *node;      /* --tree node its files count toward, NULL = off */
+    top_dir_sums_t *top;    /* per target with --largest, else NULL */
+    size_t stats;           /* asynchronous stats in flight; scanning worker only */
+    int listed;             /* every entry has been read */
+    char path[];            /* full path, used for error messages */
+} dir_handle_t;
+
+#ifdef HAVE_STATX
+/* An asynchronous statx in flight on a worker's io_uring */
+typedef struct {
+    dir_handle_t *dir;
+    struct statx stx;
+    char name[NAME_MAX + 1];
+} stat_slot_t;
+#endif
+
+/* A directory entry held back to be stat'ed in inode order */
+typedef struct {
+    uint64_t ino;
+    size_t name_offset;     /* into the worker's name arena */
+    entry_type_t type;
+} held_entry_t;
+
+/* A directory waiting to be scanned */
+typedef struct {
+    dir_handle_t *parent;   /* NULL for scan roots */
+    size_t name_offset;     /* start of the entry name within path */
+    uint64_t parent_id;     /* snapshot id of the parent directory, 0 for roots */
+    size_t reuse_ref;       /* this directory in opts->reuse, 0 if unknown */
+    tree_node_t *node;      /* --tree node its files count toward, NULL = off */
+    int is_root;
+    char path[];            /* full path, used for error messages */
+} dir_task_t;
+
+/*
+ * Per-worker task deque. The owning worker pushes and pops at the tail
+ * (depth-first, keeps its working set small); idle workers steal from the
+ * head, which tends to hand them large subtrees near the top of the tree.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    dir_task_t **items;
+    size_t head;
+    size_t count;
+    size_t capacity;
+} task_deque_t;
+
+typedef struct scan_pool scan_pool_t;
+
+typedef struct {
+    scan_pool_t *pool;
+    size_t id;
+    task_deque_t deque;
+    histogram_t *shards[MAX_SCAN_HISTOGRAMS];  /* private, merged after the scan */
+    char *dirent_buf;       /* dir_reader_t batch buffer */
+    held_entry_t *held;     /* --inode-order: entries of the current directory */
+    size_t held_count;
+    size_t held_capacity;
+    char *names;            /* their names, NUL-terminated back to back */
+    size_t names_len;
+    size_t names_capacity;
+    uring_t *ring;          /* NULL when stats are synchronous */
+    snapshot_batch_t *snap; /* NULL unless recording a snapshot */
+    tree_batch_t *tree;     /* NULL unless building a directory tree */
+#ifdef HAVE_STATX
+    stat_slot_t *slots;
+    uint32_t *free_slots;
+    size_t free_count;
+    size_t inflight;
+    int ring_failed;        /* a submission failed: no further async stats */
+#endif
+    pthread_t thread;
+    int started;
+} scan_worker_t;
+
+struct scan_pool {
+    histogram_t **targets;  /* one shard per target in every worker */
+    size_t target_count;
+#ifdef HAVE_STATX
+    unsigned statx_mask;    /* fields needed by any target's grouping mode */
+#endif
+    const scan_options_t *opts;
+    scan_worker_t *workers;
+    size_t worker_count;
+    int rank_top;           /* some target ranks its largest files (--largest) */
+
+    /* Filesystem boundaries (--one-file-system, --skip-fs) */
+    uint64_t root_dev;      /* st_dev of the root */
+    uint64_t root_mount_dev;  /* the root's filesystem as the mount table names it */
+    char *root_real;        /* absolute root path when a mount table is in use */
+    size_t root_len;        /* length of the root path as given */
+
+    /* Counters shared by all workers (accessed with __atomic builtins) */
+    size_t open_dirs;       /* directory descriptors kept for openat() */
+    size_t max_open_dirs;
+    size_t pending;         /* tasks queued or being processed */
+    size_t queued;          /* tasks sitting in a deque */
+    size_t sleepers;        /* workers blocked on idle_cond */
+    int done;
+    int root_failed;
+
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+static dir_task_t* task_create_root(const char *path) {
+    size_t len = strlen(path);
+    dir_task_t *task = malloc(sizeof(dir_task_t) + len + 1);
+    if (!task) return NULL;
+    task->parent = NULL;
+    task->name_offset = 0;
+    task->parent_id = 0;
+    task->reuse_ref = 0;
+    task->node = NULL;
+    task->is_root = 1;
+    memcpy(task->path, path, len + 1);
+    return task;
+}
+
+/* Build a child task; paths are heap-allocated so depth is not limited */
+static dir_task_t* task_create_child(dir_handle_t *parent, const char *name) {
+    size_t parent_len = strlen(parent->path);
+    size_t name_len = strlen(name);
+    int need_sep = parent_len > 0 && parent->path[parent_len - 1] != PATH_SEPARATOR;
+    dir_task_t *task = malloc(sizeof(dir_task_t) + parent_len + need_sep + name_len + 1);
+    if (!task) return NULL;
+
+    memcpy(task->path, parent->path, parent_len);
+    if (need_sep) task->path[parent_len] = PATH_SEPARATOR;
+    memcpy(task->path + parent_len + need_sep, name, name_len + 1);
+    task->name_offset = parent_len + need_sep;
+    task->parent_id = parent->id;
+    task->reuse_ref = 0;
+    task->node = NULL;
+    task->is_root = 0;
+    task->parent = parent;
+    __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    return task;
+}
+
+static void handle_release(dir_handle_t *handle) {
+    if (handle && __atomic_sub_fetch(&handle->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (handle->fd >= 0) close(handle->fd);
+        if (handle->open_count) __atomic_sub_fetch(handle->open_count, 1, __ATOMIC_RELAXED);
+        free(handle);
+    }
+}
+
+/* Drop the scanning worker's reference, closing at once a handle over budget */
+static void handle_finish(dir_handle_t *handle) {
+    if (!handle->open_count) {
+        close(handle->fd);
+        handle->fd = -1;
+    }
+    handle_release(handle);
+}
+
+static void task_free(dir_task_t *task) {
+    handle_release(task->parent);
+    free(task);
+}
 
-        snprintf(full_path, sizeof(full_path), "%s%s%s",
-                 path, PATH_SEPARATOR_STR, entry->d_name);
+/*
+ * Open a directory whose path may exceed PATH_MAX, a chunk of whole
+ * components at a time. Only one intermediate descriptor is open at once.
+ */
+static int open_long_path(const char *path, int flags) {
+    int dirfd = AT_FDCWD;
+    char chunk[PATH_MAX];
+    int fd;
 
-        if (lstat(full_path, &st) != 0) {
-            hist->error_count++;
-            snprintf(hist->last_error, sizeof(hist->last_error),
-                     "Cannot stat: %s", full_path);
-            histogram_log_error(hist, hist->last_error);
+    while (strlen(path) >= sizeof(chunk)) {
+        size_t len = sizeof(chunk) - 1;
+
+        while (len > 0 && path[len] != '/') len--;
+        if (len == 0) {
+            errno = ENAMETOOLONG;
+            fd = -1;
+        } else {
+            memcpy(chunk, path, len);
+            chunk[len] = '\0';
+            fd = openat(dirfd, chunk, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        if (dirfd != AT_FDCWD) close(dirfd);
+        if (fd < 0) return -1;
+        dirfd = fd;
+        path += len;
+        while (*path == '/') path++;
+    }
+    fd = openat(dirfd, path, flags);
+    if (dirfd != AT_FDCWD) close(dirfd);
+    return fd;
+}
+
+/* Open the task's directory, relative to its parent when the parent is kept open */
+static int task_open(const dir_task_t *task) {
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    int fd;
+
+    if (task->parent && task->parent->open_count) {
+        return openat(task->parent->fd, task->path + task->name_offset, flags | O_NOFOLLOW);
+    }
+    if (task->parent) flags |= O_NOFOLLOW;
+    fd = open(task->path, flags);
+    if (fd < 0 && errno == ENAMETOOLONG) fd = open_long_path(task->path, flags);
+    return fd;
+}
+
+static int deque_push(task_deque_t *dq, dir_task_t *task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->capacity) {
+        size_t new_capacity = dq->capacity ? dq->capacity * 2 : 64;
+        dir_task_t **new_items = malloc(sizeof(dir_task_t *) * new_capacity);
+        if (!new_items) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+        for (size_t i = 0; i < dq->count; i++) {
+            new_items[i] = dq->items[(dq->head + i) % dq->capacity];
+        }
+        free(dq->items);
+        dq->items = new_items;
+        dq->head = 0;
+        dq->capacity = new_capacity;
+    }
+    dq->items[(dq->head + dq->count) % dq->capacity] = task;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+static dir_task_t* deque_pop_tail(task_deque_t *dq) {
+    dir_task_t *task = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        dq->count--;
+        task = dq->items[(dq->head + dq->count) % dq->capacity];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+static dir_task_t* deque_steal_head(task_deque_t *dq) {
+    dir_task_t *task = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        task = dq->items[dq->head];
+        dq->head = (dq->head + 1) % dq->capacity;
+        dq->count--;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+/* Count an error against every shard of the worker; log it once */
+static void record_error(scan_worker_t *worker, const char *what, const char *path,
+                         const char *name) {
+    size_t count = worker->pool->target_count;
+    histogram_t *hist = worker->shards[0];
+    int ret;
+
+    hist->error_count++;
+    if (name) {
+        ret = snprintf(hist->last_error, sizeof(hist->last_error), "%s: %s%s%s",
+                       what, path, PATH_SEPARATOR_STR, name);
+    } else {
+        ret = snprintf(hist->last_error, sizeof(hist->last_error), "%s: %s", what, path);
+    }
+    /* Long paths are truncated in last_error; the message is still useful */
+    if (ret < 0) hist->last_error[0] = '\0';
+    for (size_t i = 1; i < count; i++) {
+        worker->shards[i]->error_count++;
+        memcpy(worker->shards[i]->last_error, hist->last_error, sizeof(hist->last_error));
+    }
+    histogram_log_error(hist, hist->last_error);
+}
+
+static void pool_submit(scan_worker_t *worker, dir_task_t *task) {
+    scan_pool_t *pool = worker->pool;
+
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    if (deque_push(&worker->deque, task) != 0) {
+        record_error(worker, "Out of memory queueing directory", task->path, NULL);
+        task_free(task);
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+    /* Wake an idle worker; taking the lock pairs with the sleeper's check */
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+static void pool_task_finished(scan_pool_t *pool) {
+    if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pool->done = 1;
+        pthread_cond_broadcast(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+static void stat_drain(scan_worker_t *worker);
+
+/* Find the next task: own deque first, then steal, then sleep */
+static dir_task_t* pool_next_task(scan_worker_t *worker) {
+    scan_pool_t *pool = worker->pool;
+
+    for (;;) {
+        dir_task_t *task = deque_pop_tail(&worker->deque);
+#ifdef HAVE_STATX
+        /* Out of local work: finish our stats, which may uncover directories */
+        if (!task && worker->inflight > 0) {
+            stat_drain(worker);
             continue;
         }
+#endif
+        for (size_t i = 1; !task && i < pool->worker_count; i++) {
+            scan_worker_t *victim = &pool->workers[(worker->id + i) % pool->worker_count];
+            task = deque_steal_head(&victim->deque);
+        }
+        if (task) {
+            __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+            return task;
+        }
 
-        if (S_ISDIR(st.st_mode)) {
-            scan_directory_posix(full_path, mode, hist);
-        } else if (S_ISREG(st.st_mode)) {
-            time_t file_time;
-            switch (mode) {
-                case GROUP_BY_MTIME:
-                    file_time = st.st_mtime;
-                    break;
-                case GROUP_BY_CTIME:
+        pthread_mutex_lock(&pool->idle_lock);
+        __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (!pool->done && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        int done = pool->done;
+        pthread_mutex_unlock(&pool->idle_lock);
+        if (done) return NULL;
+    }
+}
+
+static void stat_file_info(const struct stat *st, file_info_t *info) {
+    info->size = (uint64_t)st->st_size;
+    info->allocated = (uint64_t)st->st_blocks * 512;
+    info->mtime = st->st_mtime;
 #ifdef __APPLE__
-                    file_time = st.st_birthtime;
+    info->ctime = st->st_birthtime;
 #else
-                    file_time = st.st_ctime;
-#endif
-                    break;
-                case GROUP_BY_ATIME:
-                    file_time = st.st_atime;
-                    break;
-                default:
-                    file_time = st.st_mtime;
+    info->ctime = st->st_ctime;
+#endif
+    info->atime = st->st_atime;
+    info->ino = (uint64_t)st->st_ino;
+    info->dev = (uint64_t)st->st_dev;
+    info->nlink = (uint32_t)st->st_nlink;
+}
+
+static entry_type_t entry_type_from_mode(unsigned mode) {
+    return S_ISDIR(mode) ? ENTRY_DIR : S_ISREG(mode) ? ENTRY_FILE : ENTRY_OTHER;
+}
+
+#ifdef HAVE_STATX
+
+/* Set once statx() turns out to be missing (pre-4.11 kernel or seccomp) */
+static int statx_unsupported;
+
+/*
+ * statx fields a histogram of this mode reads: type and size plus its
+ * timestamp, stx_mtime for --mtime and stx_atime for --atime. --ctime asks
+ * for both stx_btime and stx_ctime; files carry the birth time in the ctime
+ * slot when the filesystem returns STATX_BTIME, else the change time. The
+ * pool ORs the masks of all its targets.
+ */
+static unsigned statx_mask_for_mode(grouping_mode_t mode) {
+    switch (mode) {
+        case GROUP_BY_CTIME: return STATX_TYPE | STATX_SIZE | STATX_BTIME | STATX_CTIME;
+        case GROUP_BY_ATIME: return STATX_TYPE | STATX_SIZE | STATX_ATIME;
+        case GROUP_BY_MTIME:
+        default:             return STATX_TYPE | STATX_SIZE | STATX_MTIME;
+    }
+}
+
+static int statx_flags(const scan_options_t *opts) {
+    /* AT_STATX_DONT_SYNC lets NFS/CIFS answer from cached attributes */
+    return AT_SYMLINK_NOFOLLOW | (opts->fast_stat ? AT_STATX_DONT_SYNC : 0);
+}
+
+/* Times outside the requested mask are left for histograms that never read them */
+static void statx_file_info(const struct statx *stx, file_info_t *info) {
+    info->size = (uint64_t)stx->stx_size;
+    info->allocated = (stx->stx_mask & STATX_BLOCKS) ? stx->stx_blocks * 512 : info->size;
+    info->mtime = (time_t)stx->stx_mtime.tv_sec;
+    info->ctime = (stx->stx_mask & STATX_BTIME) ? (time_t)stx->stx_btime.tv_sec
+                                                : (time_t)stx->stx_ctime.tv_sec;
+    info->atime = (time_t)stx->stx_atime.tv_sec;
+    info->ino = (uint64_t)stx->stx_ino;
+    info->dev = ((uint64_t)stx->stx_dev_major << 32) | stx->stx_dev_minor;
+    info->nlink = (stx->stx_mask & STATX_NLINK) ? stx->stx_nlink : 1;
+}
+
+#endif /* HAVE_STATX */
+
+/* Stat one entry synchronously. Returns 0, or -1 with errno set */
+static int stat_entry(const scan_pool_t *pool, int dirfd, const char *name,
+                      entry_type_t *type, file_info_t *info) {
+    struct stat st;
+
+#ifdef HAVE_STATX
+    if (!__atomic_load_n(&statx_unsupported, __ATOMIC_RELAXED)) {
+        struct statx stx;
+        if (syscall(SYS_statx, dirfd, name, statx_flags(pool->opts),
+                    pool->statx_mask, &stx) == 0) {
+            *type = entry_type_from_mode(stx.stx_mode);
+            statx_file_info(&stx, info);
+            return 0;
+        }
+        if (errno != ENOSYS) return -1;
+        __atomic_store_n(&statx_unsupported, 1, __ATOMIC_RELAXED);
+    }
+#endif
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return -1;
+    *type = entry_type_from_mode(st.st_mode);
+    stat_file_info(&st, info);
+    return 0;
+}
+
+/*
+ * Whether the subdirectory name of dir is a mount point to leave out; -1
+ * if its path cannot be built. The path is allocated, since the table
+ * check is the only one --skip-fs has and must see directories at any
+ * depth.
+ */
+static int mount_excluded(const scan_pool_t *pool, const dir_handle_t *dir, const char *name) {
+    const char *rel = dir->path + pool->root_len;
+    size_t root_len = strlen(pool->root_real);
+    int need_sep = root_len > 0 && pool->root_real[root_len - 1] != '/';
+    size_t rel_len, name_len;
+    char *path, *p;
+    int excluded;
+
+    while (*rel == '/') rel++;
+    rel_len = strlen(rel);
+    name_len = strlen(name);
+    path = malloc(root_len + need_sep + rel_len + 1 + name_len + 1);
+    if (!path) return -1;
+
+    p = path;
+    memcpy(p, pool->root_real, root_len);
+    p += root_len;
+    if (need_sep) *p++ = '/';
+    if (rel_len > 0) {
+        memcpy(p, rel, rel_len);
+        p += rel_len;
+        *p++ = '/';
+    }
+    memcpy(p, name, name_len + 1);
+    excluded = mount_table_excluded(pool->opts->mounts, path, pool->opts->one_file_system,
+                                    pool->root_mount_dev);
+    free(path);
+    return excluded;
+}
+
+/* Account for an entry whose type is known: queue directories, count files */
+static void add_entry(scan_worker_t *worker, dir_handle_t *dir, const char *name,
+                      entry_type_t type, const file_info_t *info) {
+    if (type == ENTRY_DIR) {
+        const snapshot_index_t *reuse = worker->pool->opts->reuse;
+        dir_task_t *child;
+
+        if (worker->pool->root_real) {
+            int excluded = mount_excluded(worker->pool, dir, name);
+            if (excluded < 0) {
+                record_error(worker, "Out of memory checking mount point", dir->path, name);
+            }
+            if (excluded != 0) return;
+        }
+        child = task_create_child(dir, name);
+        if (!child) {
+            record_error(worker, "Out of memory queueing directory", dir->path, name);
+            return;
+        }
+        if (dir->reuse_ref) child->reuse_ref = snapshot_index_lookup(reuse, dir->reuse_ref, name);
+        if (dir->node &&
+            !(child->node = dir_tree_child(worker->pool->opts->tree, dir->node, name))) {
+            record_error(worker, "Out of memory adding to directory tree", dir->path, name);
+        }
+        pool_submit(worker, child);
+    } else if (type == ENTRY_FILE) {
+        /* Later links to an inode already counted add nothing */
+        inode_set_t *dedup = worker->pool->opts->dedup;
+        if (dedup && info->nlink > 1 && inode_set_insert(dedup, info->dev, info->ino) == 0) {
+            return;
+        }
+        for (size_t i = 0; i < worker->pool->target_count; i++) {
+            histogram_add_file_info(worker->shards[i], info);
+            if (worker->pool->rank_top) {
+                histogram_add_top_file(worker->shards[i], info, dir->path, name,
+                                       dir->top ? &dir->top[i] : NULL);
             }
+        }
+        if (worker->snap) snapshot_batch_add_file(worker->snap, dir->id, info);
+        if (worker->tree) tree_batch_add_file(worker->tree, dir->node, info);
+    }
+}
+
+/*
+ * Rank a directory by the bytes of its files in each bucket. Its files
+ * are all counted once it has been read and no asynchronous stat of it is
+ * left; that happens on the worker that read it, which owns handle->top.
+ */
+static void rank_directory(scan_worker_t *worker, dir_handle_t *handle) {
+    if (!handle->top) return;
+    for (size_t i = 0; i < worker->pool->target_count; i++) {
+        histogram_add_top_dir(worker->shards[i], &handle->top[i], handle->path);
+    }
+    free(handle->top);
+    handle->top = NULL;
+}
+
+/* The reading worker is done with the entries of handle */
+static void directory_listed(scan_worker_t *worker, dir_handle_t *handle) {
+    handle->listed = 1;
+    if (handle->stats == 0) rank_directory(worker, handle);
+}
+
+#ifdef HAVE_STATX
+
+static int stat_ring_init(scan_worker_t *worker, unsigned depth) {
+    worker->ring = uring_create(depth);
+    if (!worker->ring) return -1;
+
+    worker->slots = malloc(sizeof(stat_slot_t) * depth);
+    worker->free_slots = malloc(sizeof(uint32_t) * depth);
+    if (!worker->slots || !worker->free_slots) {
+        free(worker->slots);
+        free(worker->free_slots);
+        uring_destroy(worker->ring);
+        worker->ring = NULL;
+        return -1;
+    }
+    for (unsigned i = 0; i < depth; i++) {
+        worker->free_slots[i] = depth - 1 - i;
+    }
+    worker->free_count = depth;
+    worker->inflight = 0;
+    worker->ring_failed = 0;
+    return 0;
+}
+
+static void stat_ring_destroy(scan_worker_t *worker) {
+    if (!worker->ring) return;
+    uring_destroy(worker->ring);
+    free(worker->slots);
+    free(worker->free_slots);
+    worker->ring = NULL;
+}
+
+/* A slot's stat has been accounted for: drop its references and free it */
+static void stat_slot_done(scan_worker_t *worker, uint32_t idx) {
+    stat_slot_t *slot = &worker->slots[idx];
+
+    if (--slot->dir->stats == 0 && slot->dir->listed) rank_directory(worker, slot->dir);
+    handle_release(slot->dir);
+    worker->free_slots[worker->free_count++] = idx;
+    if (--worker->inflight == 0) {
+        pool_task_finished(worker->pool);
+    }
+}
+
+/*
+ * Submit queued stats and consume completions, blocking for at least
+ * wait_nr. If the kernel refuses the submission, the stats it did not take
+ * are withdrawn and done synchronously, and no more are queued; those
+ * already submitted still complete, so stat_drain() ends.
+ */
+static void stat_reap(scan_worker_t *worker, unsigned wait_nr) {
+    uint64_t user_data;
+    int result;
+
+    if (uring_submit(worker->ring, wait_nr) != 0) {
+        if (!worker->ring_failed) {
+            fprintf(stderr, "Warning: io_uring submission failed, using synchronous stat\n");
+            worker->ring_failed = 1;
+        }
+        while (uring_take_unsubmitted(worker->ring, &user_data)) {
+            stat_slot_t *slot = &worker->slots[user_data];
+            entry_type_t type;
+            file_info_t info;
+
+            if (stat_entry(worker->pool, slot->dir->fd, slot->name, &type, &info) != 0) {
+                record_error(worker, "Cannot stat", slot->dir->path, slot->name);
+            } else {
+                add_entry(worker, slot->dir, slot->name, type, &info);
+            }
+            stat_slot_done(worker, (uint32_t)user_data);
+        }
+    }
+
+    while (uring_next_completion(worker->ring, &user_data, &result)) {
+        stat_slot_t *slot = &worker->slots[user_data];
+        const struct statx *stx = &slot->stx;
+
+        if (result < 0) {
+            record_error(worker, "Cannot stat", slot->dir->path, slot->name);
+        } else {
+            file_info_t info;
+            statx_file_info(stx, &info);
+            add_entry(worker, slot->dir, slot->name, entry_type_from_mode(stx->stx_mode), &info);
+        }
+        stat_slot_done(worker, (uint32_t)user_data);
+    }
+}
+
+static void stat_drain(scan_worker_t *worker) {
+    while (worker->inflight > 0) {
+        stat_reap(worker, 1);
+    }
+}
+
+/*
+ * Queue an asynchronous statx. The worker moves on to further entries and
+ * directories while requests are in flight and only blocks when every slot
+ * is busy. While anything is in flight the worker holds one pending unit so
+ * the pool cannot finish before late-discovered directories are queued.
+ * Returns -1 if the caller should stat synchronously instead.
+ */
+static int stat_async(scan_worker_t *worker, dir_handle_t *dir, const char *name) {
+    size_t name_len = strlen(name);
+    if (name_len > NAME_MAX || worker->ring_failed) return -1;
+
+    if (worker->free_count == 0) {
+        stat_reap(worker, 1);
+        if (worker->free_count == 0) return -1;
+    }
+
+    uint32_t idx = worker->free_slots[worker->free_count - 1];
+    stat_slot_t *slot = &worker->slots[idx];
+    memcpy(slot->name, name, name_len + 1);
+
+    if (uring_queue_statx(worker->ring, dir->fd, slot->name,
+                          statx_flags(worker->pool->opts),
+                          worker->pool->statx_mask, &slot->stx, idx) != 0) {
+        return -1;
+    }
+    worker->free_count--;
+    slot->dir = dir;
+    dir->stats++;
+    __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+    if (worker->inflight++ == 0) {
+        __atomic_add_fetch(&worker->pool->pending, 1, __ATOMIC_SEQ_CST);
+    }
+
+    /* Push work to the kernel in batches rather than one syscall per entry */
+    if (uring_unsubmitted(worker->ring) >= STAT_SUBMIT_BATCH) {
+        stat_reap(worker, 0);
+    }
+    return 0;
+}
+
+#else
+
+static int stat_ring_init(scan_worker_t *worker, unsigned depth) {
+    (void)worker;
+    (void)depth;
+    return -1;
+}
+
+static void stat_ring_destroy(scan_worker_t *worker) {
+    (void)worker;
+}
+
+static void stat_drain(scan_worker_t *worker) {
+    (void)worker;
+}
+
+static int stat_async(scan_worker_t *worker, dir_handle_t *dir, const char *name) {
+    (void)worker;
+    (void)dir;
+    (void)name;
+    return -1;
+}
+
+#endif /* HAVE_STATX */
+
+/*
+ * Replay a directory that is unchanged since the previous snapshot: its
+ * files are taken from the snapshot instead of being stat'ed, and its
+ * subdirectories are queued by their recorded names without reading it.
+ * Subdirectories are still checked one by one, since changes below do not
+ * touch this directory's timestamps.
+ */
+static void reuse_directory(scan_worker_t *worker, dir_handle_t *dir) {
+    const snapshot_index_t *reuse = worker->pool->opts->reuse;
+    size_t count = snapshot_index_file_count(reuse, dir->reuse_ref);
+    file_info_t info;
+    const char *name;
+
+    for (size_t i = 0; i < count; i++) {
+        snapshot_index_file(reuse, dir->reuse_ref, i, &info);
+        add_entry(worker, dir, NULL, ENTRY_FILE, &info);
+    }
+    count = snapshot_index_subdir_count(reuse, dir->reuse_ref);
+    for (size_t i = 0; i < count; i++) {
+        snapshot_index_subdir(reuse, dir->reuse_ref, i, &name);
+        add_entry(worker, dir, name, ENTRY_DIR, NULL);
+    }
+}
+
+/* Keep an entry for stat_held_entries(); -1 if out of memory */
+static int hold_entry(scan_worker_t *worker, const dir_entry_t *entry) {
+    size_t name_len = strlen(entry->name) + 1;
+    held_entry_t *held;
+
+    if (worker->held_count == worker->held_capacity) {
+        size_t capacity = worker->held_capacity ? worker->held_capacity * 2 : 256;
+        held_entry_t *grown = realloc(worker->held, sizeof(held_entry_t) * capacity);
+        if (!grown) return -1;
+        worker->held = grown;
+        worker->held_capacity = capacity;
+    }
+    if (worker->names_len + name_len > worker->names_capacity) {
+        size_t capacity = worker->names_capacity ? worker->names_capacity * 2 : 16384;
+        while (capacity < worker->names_len + name_len) capacity *= 2;
+        char *grown = realloc(worker->names, capacity);
+        if (!grown) return -1;
+        worker->names = grown;
+        worker->names_capacity = capacity;
+    }
+
+    held = &worker->held[worker->held_count++];
+    held->ino = entry->ino;
+    held->name_offset = worker->names_len;
+    held->type = entry->type;
+    memcpy(worker->names + worker->names_len, entry->name, name_len);
+    worker->names_len += name_len;
+    return 0;
+}
+
+static int compare_held_ino(const void *a, const void *b) {
+    uint64_t ia = ((const held_entry_t *)a)->ino;
+    uint64_t ib = ((const held_entry_t *)b)->ino;
+    return ia < ib ? -1 : ia > ib ? 1 : 0;
+}
+
+/*
+ * Stat a whole directory's held entries in ascending inode number. Inode
+ * numbers follow the on-disk inode tables on ext4, XFS and most other
+ * filesystems, so this turns the hash order of readdir into a mostly
+ * sequential sweep of the tables, which is what rotational disks need.
+ */
+static void stat_held_entries(scan_worker_t *worker, dir_handle_t *handle) {
+    entry_type_t type;
+    file_info_t info;
+
+    qsort(worker->held, worker->held_count, sizeof(held_entry_t), compare_held_ino);
+    for (size_t i = 0; i < worker->held_count; i++) {
+        const char *name = worker->names + worker->held[i].name_offset;
+
+        if (worker->ring && handle->open_count && stat_async(worker, handle, name) == 0) {
+            continue;
+        }
+        if (stat_entry(worker->pool, handle->fd, name, &type, &info) != 0) {
+            record_error(worker, "Cannot stat", handle->path, name);
+            continue;
+        }
+        add_entry(worker, handle, name, type, &info);
+    }
+    worker->held_count = 0;
+    worker->names_len = 0;
+}
+
+static int scan_directory_posix(scan_worker_t *worker, dir_task_t *task) {
+    dir_handle_t *handle;
+    dir_reader_t reader;
+    dir_entry_t entry;
+    entry_type_t type;
+    file_info_t info;
+    size_t path_len;
+    int fd;
+    int ret;
+
+    fd = task_open(task);
+    /* The parent stays open only while it still has children to open */
+    handle_release(task->parent);
+    task->parent = NULL;
 
-            histogram_add_file(hist, file_time, (uint64_t)st.st_size);
+    if (fd < 0 || dir_reader_open(&reader, fd, worker->dirent_buf,
+                                  worker->pool->opts->dirent_buffer_size) != 0) {
+        if (fd >= 0) close(fd);
+        record_error(worker, "Cannot open directory", task->path, NULL);
+        return -1;
+    }
+    if (worker->pool->opts->one_file_system && !task->is_root) {
+        /* Mount points the mount table did not catch, and nested volumes */
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (uint64_t)st.st_dev != worker->pool->root_dev) {
+            dir_reader_close(&reader);
+            close(fd);
+            return 0;
         }
     }
+    path_len = strlen(task->path);
+    handle = malloc(sizeof(dir_handle_t) + path_len + 1);
+    if (!handle) {
+        dir_reader_close(&reader);
+        close(fd);
+        record_error(worker, "Out of memory opening directory", task->path, NULL);
+        return -1;
+    }
+    handle->fd = fd;
+    handle->open_count = NULL;
+    handle->refs = 1;
+    handle->id = 0;
+    handle->reuse_ref = 0;
+    handle->node = task->node;
+    handle->top = NULL;
+    handle->stats = 0;
+    handle->listed = 0;
+    memcpy(handle->path, task->path, path_len + 1);
+    if (worker->pool->rank_top) {
+        /* Without it the directory goes unranked; its files still count */
+        handle->top = calloc(worker->pool->target_count, sizeof(top_dir_sums_t));
+    }
+
+    if (worker->snap || task->reuse_ref) {
+        struct stat st;
+        memset(&info, 0, sizeof(info));
+        if (fstat(fd, &st) == 0) {
+            stat_file_info(&st, &info);
+            handle->reuse_ref = task->reuse_ref;
+        }
+    }
+    if (worker->snap) {
+        handle->id = snapshot_next_dir_id(worker->pool->opts->snapshot);
+        snapshot_batch_add_dir(worker->snap, handle->id, task->parent_id, &info,
+                               task->path + task->name_offset);
+    }
 
-    closedir(dir);
+    for (size_t i = 0; i < worker->pool->target_count; i++) {
+        worker->shards[i]->directories_scanned++;
+    }
+    if (worker->tree) tree_batch_add_dir(worker->tree, handle->node);
+
+    /* Decided before any child task can see the handle */
+    if (__atomic_add_fetch(&worker->pool->open_dirs, 1, __ATOMIC_RELAXED) <=
+        worker->pool->max_open_dirs) {
+        handle->open_count = &worker->pool->open_dirs;
+    } else {
+        __atomic_sub_fetch(&worker->pool->open_dirs, 1, __ATOMIC_RELAXED);
+    }
+
+    if (handle->reuse_ref &&
+        snapshot_index_unchanged(worker->pool->opts->reuse, handle->reuse_ref, &info)) {
+        reuse_directory(worker, handle);
+        dir_reader_close(&reader);
+        directory_listed(worker, handle);
+        handle_finish(handle);
+        return 0;
+    }
+
+    while ((ret = dir_reader_next(&reader, &entry)) > 0) {
+        /* d_type lets us recurse and skip non-files without a stat */
+        if (entry.type == ENTRY_OTHER) continue;
+        if (entry.type == ENTRY_DIR) {
+            add_entry(worker, handle, entry.name, ENTRY_DIR, NULL);
+            continue;
+        }
+
+        if (worker->pool->opts->inode_order && hold_entry(worker, &entry) == 0) {
+            continue;
+        }
+        if (worker->ring && handle->open_count && stat_async(worker, handle, entry.name) == 0) {
+            continue;
+        }
+        if (stat_entry(worker->pool, fd, entry.name, &type, &info) != 0) {
+            record_error(worker, "Cannot stat", task->path, entry.name);
+            continue;
+        }
+        add_entry(worker, handle, entry.name, type, &info);
+    }
+    if (ret < 0) {
+        record_error(worker, "Cannot read directory", task->path, NULL);
+    }
+    if (worker->held_count > 0) {
+        stat_held_entries(worker, handle);
+    }
+
+    dir_reader_close(&reader);
+    directory_listed(worker, handle);
+    handle_finish(handle);
     return 0;
 }
 
+static void* scan_worker_main(void *arg) {
+    scan_worker_t *worker = (scan_worker_t *)arg;
+    dir_task_t *task;
+
+    while ((task = pool_next_task(worker)) != NULL) {
+        if (scan_directory_posix(worker, task) != 0 && task->is_root) {
+            __atomic_store_n(&worker->pool->root_failed, 1, __ATOMIC_SEQ_CST);
+        }
+        task_free(task);
+        pool_task_finished(worker->pool);
+    }
+    return NULL;
+}
+
+static size_t resolve_thread_count(int threads) {
+    if (threads > 0) return (size_t)threads;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+/* Half the descriptor limit, leaving the rest to workers, io_uring and output */
+static size_t resolve_max_open_dirs(size_t max_open_dirs) {
+    struct rlimit limit;
+    size_t budget;
+
+    if (max_open_dirs > 0) return max_open_dirs;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+        return DEFAULT_MAX_OPEN_DIRS;
+    }
+    budget = (size_t)(limit.rlim_cur / 2);
+    if (budget < MIN_MAX_OPEN_DIRS) budget = MIN_MAX_OPEN_DIRS;
+    if (budget > DEFAULT_MAX_OPEN_DIRS) budget = DEFAULT_MAX_OPEN_DIRS;
+    return budget;
+}
+
+static int scan_pool_run(const char *path, histogram_t **hists, size_t count,
+                         const scan_options_t *opts) {
+    scan_pool_t pool;
+    size_t i, j;
+    int ret = 0;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.targets = hists;
+    pool.target_count = count;
+#ifdef HAVE_STATX
+    for (j = 0; j < count; j++) {
+        pool.statx_mask |= statx_mask_for_mode(hists[j]->mode);
+    }
+    if (opts->snapshot) {
+        /* Snapshots keep every timestamp and the inode */
+        pool.statx_mask |= STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_CTIME |
+                           STATX_ATIME | STATX_BTIME | STATX_INO;
+    }
+    for (j = 0; j < count; j++) {
+        if (hists[j]->disk_usage) pool.statx_mask |= STATX_BLOCKS;
+    }
+    if (opts->dedup) {
+        pool.statx_mask |= STATX_INO | STATX_NLINK;
+    }
 #endif
+    for (j = 0; j < count; j++) {
+        if (hists[j]->top_n > 0) pool.rank_top = 1;
+    }
+    pool.opts = opts;
+    pool.max_open_dirs = resolve_max_open_dirs(opts->max_open_dirs);
+    pool.worker_count = resolve_thread_count(opts->threads);
+    pool.workers = calloc(pool.worker_count, sizeof(scan_worker_t));
+    if (!pool.workers) {
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
+    }
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+
+    /* Load the timezone once, before workers call localtime_r concurrently */
+    tzset();
+
+    for (i = 0; i < pool.worker_count; i++) {
+        scan_worker_t *worker = &pool.workers[i];
+        worker->pool = &pool;
+        worker->id = i;
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        for (j = 0; j < count; j++) {
+            worker->shards[j] = histogram_create(hists[j]->interval);
+            if (!worker->shards[j]) break;
+            worker->shards[j]->mode = hists[j]->mode;
+            histogram_set_resolution(worker->shards[j], hists[j]->resolution);
+            histogram_set_top(worker->shards[j], hists[j]->top_n, hists[j]->top_intervals);
+            histogram_set_error_log(worker->shards[j], hists[j]->error_log_file);
+            histogram_set_error_stderr(worker->shards[j], hists[j]->log_errors_to_stderr);
+        }
+        worker->dirent_buf = malloc(opts->dirent_buffer_size);
+        if (opts->snapshot) worker->snap = snapshot_batch_create(opts->snapshot);
+        if (opts->tree) worker->tree = tree_batch_create(opts->tree);
+        if (j < count || !worker->dirent_buf || (opts->snapshot && !worker->snap) ||
+            (opts->tree && !worker->tree)) {
+            fprintf(stderr, "Error: out of memory\n");
+            ret = -1;
+            break;
+        }
+        if (opts->use_io_uring && stat_ring_init(worker, opts->uring_depth) != 0 && i == 0) {
+            fprintf(stderr, "Warning: io_uring statx is unavailable, using synchronous stat\n");
+        }
+    }
+
+    if (ret == 0 && (opts->one_file_system || opts->mounts)) {
+        struct stat st;
+        if (stat(path, &st) == 0) pool.root_dev = (uint64_t)st.st_dev;
+        if (opts->mounts && (pool.root_real = realpath(path, NULL)) != NULL) {
+            pool.root_mount_dev = mount_table_device_of(opts->mounts, pool.root_real);
+            pool.root_len = strlen(path);
+        }
+    }
+
+    if (ret == 0) {
+        dir_task_t *root = task_create_root(path);
+        if (root && opts->tree && !(root->node = dir_tree_add_root(opts->tree, path))) {
+            task_free(root);
+            root = NULL;
+        }
+        if (!root) {
+            fprintf(stderr, "Error: out of memory\n");
+            ret = -1;
+        } else {
+            if (opts->reuse) root->reuse_ref = snapshot_index_lookup(opts->reuse, 0, path);
+            pool_submit(&pool.workers[0], root);
+
+            /* Worker 0 runs on the calling thread */
+            for (i = 1; i < pool.worker_count; i++) {
+                scan_worker_t *worker = &pool.workers[i];
+                worker->started = pthread_create(&worker->thread, NULL,
+                                                 scan_worker_main, worker) == 0;
+            }
+            scan_worker_main(&pool.workers[0]);
+            for (i = 1; i < pool.worker_count; i++) {
+                if (pool.workers[i].started) {
+                    pthread_join(pool.workers[i].thread, NULL);
+                }
+            }
+            if (pool.root_failed) ret = -1;
+        }
+    }
+
+    for (i = 0; i < pool.worker_count; i++) {
+        scan_worker_t *worker = &pool.workers[i];
+        for (j = 0; j < count; j++) {
+            if (!worker->shards[j]) continue;
+            histogram_merge(hists[j], worker->shards[j]);
+            histogram_destroy(worker->shards[j]);
+        }
+        stat_ring_destroy(worker);
+        snapshot_batch_destroy(worker->snap);
+        tree_batch_destroy(worker->tree);
+        free(worker->dirent_buf);
+        free(worker->held);
+        free(worker->names);
+        free(worker->deque.items);
+        pthread_mutex_destroy(&worker->deque.lock);
+    }
+    pthread_cond_destroy(&pool.idle_cond);
+    pthread_mutex_destroy(&pool.idle_lock);
+    free(pool.workers);
+    free(pool.root_real);
+    return ret;
+}
+
+#endif
+
+void scan_options_init(scan_options_t *opts) {
+    if (!opts) return;
+    opts->threads = 1;
+    opts->dirent_buffer_size = DEFAULT_DIRENT_BUFFER_SIZE;
+    opts->fast_stat = 0;
+    opts->use_io_uring = 0;
+    opts->uring_depth = DEFAULT_URING_DEPTH;
+    opts->max_open_dirs = 0;
+    opts->inode_order = 0;
+    opts->snapshot = NULL;
+    opts->reuse = NULL;
+    opts->dedup = NULL;
+    opts->one_file_system = 0;
+    opts->mounts = NULL;
+    opts->tree = NULL;
+}
 
 int scan_directory(const char *path, grouping_mode_t mode, histogram_t *hist) {
+    scan_options_t opts;
+    scan_options_init(&opts);
+    return scan_directory_opts(path, mode, hist, &opts);
+}
+
+int scan_directory_opts(const char *path, grouping_mode_t mode, histogram_t *hist,
+                        const scan_options_t *opts) {
+    hist->mode = mode;
+    return scan_directory_multi(path, &hist, 1, opts);
+}
+
+/*
+ * Fill several histograms from one traversal. Each histogram groups by its
+ * own mode and interval; every file is stat'ed once for all of them.
+ */
+int scan_directory_multi(const char *path, histogram_t **hists, size_t count,
+                         const scan_options_t *opts) {
+    if (count == 0 || count > MAX_SCAN_HISTOGRAMS) return -1;
 #ifdef _WIN32
-    return scan_directory_win32(path, mode, hist);
+    /* The Win32 walker is single-threaded; only snapshots and the tree apply */
+    win32_snapshot_t snap;
+    win32_tree_t tree;
+    win32_task_t *root;
+    file_info_t root_info;
+    WIN32_FILE_ATTRIBUTE_DATA attrs;
+    int ret;
+
+    memset(&root_info, 0, sizeof(root_info));
+    if (GetFileAttributesExA(path, GetFileExInfoStandard, &attrs)) {
+        root_info.mtime = filetime_to_time_t(attrs.ftLastWriteTime);
+        root_info.ctime = filetime_to_time_t(attrs.ftCreationTime);
+        root_info.atime = filetime_to_time_t(attrs.ftLastAccessTime);
+    }
+    snap.writer = opts->snapshot;
+    snap.batch = snap.writer ? snapshot_batch_create(snap.writer) : NULL;
+    tree.tree = opts->tree;
+    tree.batch = tree.tree ? tree_batch_create(tree.tree) : NULL;
+    root = win32_task_create(path, NULL, 0, &root_info);
+    if (root && tree.tree) root->node = dir_tree_add_root(tree.tree, path);
+    if ((snap.writer && !snap.batch) || (tree.tree && !tree.batch) || !root ||
+        (tree.tree && !root->node)) {
+        snapshot_batch_destroy(snap.batch);
+        tree_batch_destroy(tree.batch);
+        free(root);
+        return -1;
+    }
+    ret = scan_tree_win32(root, hists, count, snap.writer ? &snap : NULL,
+                          tree.tree ? &tree : NULL);
+    snapshot_batch_destroy(snap.batch);
+    tree_batch_destroy(tree.batch);
+    return ret;
 #else
-    return scan_directory_posix(path, mode, hist);
+    return scan_pool_run(path, hists, count, opts);
 #endif
 }
@@ -0,0 +1,860 @@
+#include "diskogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Scan snapshots: every directory and file seen by a scan, written so that
+ * the file can later be mapped and re-histogrammed without touching the
+ * filesystem. All integers are little-endian; records are fixed-size and
+ * 8-byte aligned.
+ *
+ *   header      SNAPSHOT_HEADER_SIZE bytes (see below)
+ *   files       file_count x 48 bytes: size, mtime, ctime, atime, inode, parent id
+ *   dirs        dir_count x 48 bytes: id, parent id, inode, mtime, ctime, name
+ *   names       NUL-terminated strings referenced by byte offset
+ *
+ * Directory ids start at 1; roots have parent id 0. A root's name is the
+ * path as given, every other name is a single path component. Files and
+ * directories appear in no particular order.
+ */
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <pthread.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#define SNAPSHOT_MAGIC "DSKGSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 128
+#define SNAPSHOT_RECORD_SIZE 48
+
+/* Header field offsets */
+#define HDR_VERSION         8
+#define HDR_HEADER_SIZE     12
+#define HDR_FILE_COUNT      16
+#define HDR_FILE_OFFSET     24
+#define HDR_DIR_COUNT       32
+#define HDR_DIR_OFFSET      40
+#define HDR_NAMES_OFFSET    48
+#define HDR_NAMES_SIZE      56
+#define HDR_SCAN_START      64
+#define HDR_SCAN_END        72
+#define HDR_ERROR_COUNT     80
+#define HDR_DIRS_SCANNED    88
+#define HDR_LABEL           96
+#define HDR_LAST_ERROR      104
+
+/* Records buffered per thread before they are handed to the writer */
+#define BATCH_RECORDS 1024
+#define BATCH_NAMES_FLUSH (64 * 1024)
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_le64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint64_t get_le64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+/* ---- Writing ---- */
+
+struct snapshot_writer {
+    FILE *out;              /* header placeholder, then file records */
+    FILE *dirs;             /* directory records, appended on finish */
+    FILE *names;            /* name strings, appended on finish */
+    char *filename;
+    uint64_t file_count;
+    uint64_t dir_count;
+    uint64_t names_size;
+    uint64_t next_dir_id;
+    int failed;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+};
+
+struct snapshot_batch {
+    snapshot_writer_t *writer;
+    unsigned char files[BATCH_RECORDS * SNAPSHOT_RECORD_SIZE];
+    size_t file_count;
+    unsigned char dirs[BATCH_RECORDS * SNAPSHOT_RECORD_SIZE];
+    size_t dir_count;
+    char *names;            /* name offsets in dirs are relative to this */
+    size_t names_len;
+    size_t names_capacity;
+};
+
+snapshot_writer_t* snapshot_writer_create(const char *filename) {
+    snapshot_writer_t *writer = calloc(1, sizeof(snapshot_writer_t));
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    if (!writer) return NULL;
+
+    writer->filename = malloc(strlen(filename) + 1);
+    writer->out = fopen(filename, "wb");
+    writer->dirs = tmpfile();
+    writer->names = tmpfile();
+    if (!writer->filename || !writer->out || !writer->dirs || !writer->names) {
+        if (writer->out) {
+            fclose(writer->out);
+            remove(filename);
+        }
+        if (writer->dirs) fclose(writer->dirs);
+        if (writer->names) fclose(writer->names);
+        free(writer->filename);
+        free(writer);
+        return NULL;
+    }
+    strcpy(writer->filename, filename);
+
+    /* The real header is written once the counts are known */
+    memset(header, 0, sizeof(header));
+    if (fwrite(header, 1, sizeof(header), writer->out) != sizeof(header)) writer->failed = 1;
+#ifndef _WIN32
+    pthread_mutex_init(&writer->lock, NULL);
+#endif
+    return writer;
+}
+
+uint64_t snapshot_next_dir_id(snapshot_writer_t *writer) {
+#ifdef _WIN32
+    return ++writer->next_dir_id;   /* the Win32 walker is single-threaded */
+#else
+    return __atomic_add_fetch(&writer->next_dir_id, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+/* Append a batch to the writer's streams, rebasing its name offsets */
+static void batch_flush(snapshot_batch_t *batch) {
+    snapshot_writer_t *writer = batch->writer;
+
+    if (batch->file_count == 0 && batch->dir_count == 0) return;
+
+#ifndef _WIN32
+    pthread_mutex_lock(&writer->lock);
+#endif
+    for (size_t i = 0; i < batch->dir_count; i++) {
+        unsigned char *name = batch->dirs + i * SNAPSHOT_RECORD_SIZE + 40;
+        put_le64(name, get_le64(name) + writer->names_size);
+    }
+    if (fwrite(batch->files, SNAPSHOT_RECORD_SIZE, batch->file_count, writer->out)
+            != batch->file_count ||
+        fwrite(batch->dirs, SNAPSHOT_RECORD_SIZE, batch->dir_count, writer->dirs)
+            != batch->dir_count ||
+        fwrite(batch->names, 1, batch->names_len, writer->names) != batch->names_len) {
+        writer->failed = 1;
+    }
+    writer->file_count += batch->file_count;
+    writer->dir_count += batch->dir_count;
+    writer->names_size += batch->names_len;
+#ifndef _WIN32
+    pthread_mutex_unlock(&writer->lock);
+#endif
+
+    batch->file_count = 0;
+    batch->dir_count = 0;
+    batch->names_len = 0;
+}
+
+snapshot_batch_t* snapshot_batch_create(snapshot_writer_t *writer) {
+    snapshot_batch_t *batch = malloc(sizeof(snapshot_batch_t));
+    if (!batch) return NULL;
+    batch->writer = writer;
+    batch->file_count = 0;
+    batch->dir_count = 0;
+    batch->names = NULL;
+    batch->names_len = 0;
+    batch->names_capacity = 0;
+    return batch;
+}
+
+void snapshot_batch_destroy(snapshot_batch_t *batch) {
+    if (!batch) return;
+    batch_flush(batch);
+    free(batch->names);
+    free(batch);
+}
+
+void snapshot_batch_add_file(snapshot_batch_t *batch, uint64_t parent, const file_info_t *info) {
+    unsigned char *rec = batch->files + batch->file_count * SNAPSHOT_RECORD_SIZE;
+    put_le64(rec, info->size);
+    put_le64(rec + 8, (uint64_t)(int64_t)info->mtime);
+    put_le64(rec + 16, (uint64_t)(int64_t)info->ctime);
+    put_le64(rec + 24, (uint64_t)(int64_t)info->atime);
+    put_le64(rec + 32, info->ino);
+    put_le64(rec + 40, parent);
+    if (++batch->file_count == BATCH_RECORDS) batch_flush(batch);
+}
+
+void snapshot_batch_add_dir(snapshot_batch_t *batch, uint64_t id, uint64_t parent,
+                            const file_info_t *info, const char *name) {
+    size_t len = strlen(name) + 1;
+
+    if (batch->names_len + len > batch->names_capacity) {
+        size_t capacity = batch->names_capacity ? batch->names_capacity * 2 : 4096;
+        while (capacity < batch->names_len + len) capacity *= 2;
+        char *names = realloc(batch->names, capacity);
+        if (!names) {
+            batch->writer->failed = 1;
+            return;
+        }
+        batch->names = names;
+        batch->names_capacity = capacity;
+    }
+
+    unsigned char *rec = batch->dirs + batch->dir_count * SNAPSHOT_RECORD_SIZE;
+    put_le64(rec, id);
+    put_le64(rec + 8, parent);
+    put_le64(rec + 16, info->ino);
+    put_le64(rec + 24, (uint64_t)(int64_t)info->mtime);
+    put_le64(rec + 32, (uint64_t)(int64_t)info->ctime);
+    put_le64(rec + 40, batch->names_len);
+    memcpy(batch->names + batch->names_len, name, len);
+    batch->names_len += len;
+
+    if (++batch->dir_count == BATCH_RECORDS || batch->names_len >= BATCH_NAMES_FLUSH) {
+        batch_flush(batch);
+    }
+}
+
+/* Copy a temporary stream onto the end of the snapshot */
+static int append_stream(FILE *out, FILE *in) {
+    char buf[64 * 1024];
+    size_t n;
+
+    if (fflush(in) != 0 || fseek(in, 0, SEEK_SET) != 0) return -1;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) return -1;
+    }
+    return ferror(in) ? -1 : 0;
+}
+
+/* Append a string to the names section; returns its offset */
+static uint64_t append_name(snapshot_writer_t *writer, const char *str) {
+    uint64_t offset = writer->names_size;
+    size_t len = strlen(str) + 1;
+    if (fwrite(str, 1, len, writer->names) != len) writer->failed = 1;
+    writer->names_size += len;
+    return offset;
+}
+
+/*
+ * Write the directory and name sections and the header, then close and
+ * free the writer. All batches must have been destroyed. meta supplies the
+ * scan metadata; label names what was scanned. Returns 0 on success; on
+ * failure the partial file is removed.
+ */
+int snapshot_writer_finish(snapshot_writer_t *writer, const histogram_t *meta,
+                           const char *label) {
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    uint64_t label_offset, error_offset;
+    uint64_t dir_offset, names_offset;
+    int failed;
+
+    if (!writer) return -1;
+
+    label_offset = append_name(writer, label ? label : "");
+    error_offset = append_name(writer, meta ? meta->last_error : "");
+
+    dir_offset = SNAPSHOT_HEADER_SIZE + writer->file_count * SNAPSHOT_RECORD_SIZE;
+    names_offset = dir_offset + writer->dir_count * SNAPSHOT_RECORD_SIZE;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, SNAPSHOT_MAGIC, 8);
+    put_le32(header + HDR_VERSION, SNAPSHOT_VERSION);
+    put_le32(header + HDR_HEADER_SIZE, SNAPSHOT_HEADER_SIZE);
+    put_le64(header + HDR_FILE_COUNT, writer->file_count);
+    put_le64(header + HDR_FILE_OFFSET, SNAPSHOT_HEADER_SIZE);
+    put_le64(header + HDR_DIR_COUNT, writer->dir_count);
+    put_le64(header + HDR_DIR_OFFSET, dir_offset);
+    put_le64(header + HDR_NAMES_OFFSET, names_offset);
+    put_le64(header + HDR_NAMES_SIZE, writer->names_size);
+    if (meta) {
+        put_le64(header + HDR_SCAN_START, (uint64_t)(int64_t)meta->scan_start_time);
+        put_le64(header + HDR_SCAN_END, (uint64_t)(int64_t)meta->scan_end_time);
+        put_le64(header + HDR_ERROR_COUNT, meta->error_count);
+        put_le64(header + HDR_DIRS_SCANNED, meta->directories_scanned);
+    }
+    put_le64(header + HDR_LABEL, label_offset);
+    put_le64(header + HDR_LAST_ERROR, error_offset);
+
+    if (append_stream(writer->out, writer->dirs) != 0 ||
+        append_stream(writer->out, writer->names) != 0 ||
+        fseek(writer->out, 0, SEEK_SET) != 0 ||
+        fwrite(header, 1, sizeof(header), writer->out) != sizeof(header)) {
+        writer->failed = 1;
+    }
+    if (fclose(writer->out) != 0) writer->failed = 1;
+    fclose(writer->dirs);
+    fclose(writer->names);
+
+    failed = writer->failed;
+    if (failed) remove(writer->filename);
+#ifndef _WIN32
+    pthread_mutex_destroy(&writer->lock);
+#endif
+    free(writer->filename);
+    free(writer);
+    return failed ? -1 : 0;
+}
+
+/* ---- Reading ---- */
+
+struct snapshot {
+    const unsigned char *data;
+    size_t size;
+    int mapped;             /* data is an mmap()ed view, not a heap copy */
+    uint64_t file_count;
+    uint64_t file_offset;
+    uint64_t dir_count;
+    uint64_t dir_offset;
+    uint64_t names_offset;
+    uint64_t names_size;
+};
+
+/* Load the whole file: mapped where possible, read into memory otherwise */
+static int snapshot_load(snapshot_t *snap, const char *filename) {
+#ifdef _WIN32
+    FILE *f = fopen(filename, "rb");
+    long size;
+    unsigned char *data;
+
+    if (!f) return -1;
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        return -1;
+    }
+    data = malloc(size > 0 ? (size_t)size : 1);
+    if (!data || fread(data, 1, (size_t)size, f) != (size_t)size) {
+        free(data);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    snap->data = data;
+    snap->size = (size_t)size;
+    snap->mapped = 0;
+    return 0;
+#else
+    struct stat st;
+    void *data;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || st.st_size < SNAPSHOT_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+#ifdef MADV_SEQUENTIAL
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    snap->data = data;
+    snap->size = (size_t)st.st_size;
+    snap->mapped = 1;
+    return 0;
+#endif
+}
+
+/* A section of count records at offset must lie inside the file */
+static int section_valid(const snapshot_t *snap, uint64_t offset, uint64_t count) {
+    return offset <= snap->size && count <= (snap->size - offset) / SNAPSHOT_RECORD_SIZE;
+}
+
+snapshot_t* snapshot_open(const char *filename) {
+    snapshot_t *snap = calloc(1, sizeof(snapshot_t));
+    const unsigned char *h;
+    if (!snap) return NULL;
+
+    if (snapshot_load(snap, filename) != 0) {
+        free(snap);
+        return NULL;
+    }
+
+    h = snap->data;
+    if (snap->size < SNAPSHOT_HEADER_SIZE || memcmp(h, SNAPSHOT_MAGIC, 8) != 0 ||
+        get_le32(h + HDR_VERSION) != SNAPSHOT_VERSION ||
+        get_le32(h + HDR_HEADER_SIZE) < SNAPSHOT_HEADER_SIZE) {
+        snapshot_close(snap);
+        return NULL;
+    }
+
+    snap->file_count = get_le64(h + HDR_FILE_COUNT);
+    snap->file_offset = get_le64(h + HDR_FILE_OFFSET);
+    snap->dir_count = get_le64(h + HDR_DIR_COUNT);
+    snap->dir_offset = get_le64(h + HDR_DIR_OFFSET);
+    snap->names_offset = get_le64(h + HDR_NAMES_OFFSET);
+    snap->names_size = get_le64(h + HDR_NAMES_SIZE);
+
+    /* Every offset read later is checked here once */
+    if (!section_valid(snap, snap->file_offset, snap->file_count) ||
+        !section_valid(snap, snap->dir_offset, snap->dir_count) ||
+        snap->names_offset > snap->size || snap->names_size > snap->size - snap->names_offset ||
+        snap->names_size == 0 || h[snap->names_offset + snap->names_size - 1] != '\0' ||
+        get_le64(h + HDR_LABEL) >= snap->names_size ||
+        get_le64(h + HDR_LAST_ERROR) >= snap->names_size) {
+        snapshot_close(snap);
+        return NULL;
+    }
+    for (uint64_t i = 0; i < snap->dir_count; i++) {
+        const unsigned char *rec = snap->data + snap->dir_offset + i * SNAPSHOT_RECORD_SIZE;
+        if (get_le64(rec + 40) >= snap->names_size) {
+            snapshot_close(snap);
+            return NULL;
+        }
+    }
+    return snap;
+}
+
+void snapshot_close(snapshot_t *snap) {
+    if (!snap) return;
+#ifndef _WIN32
+    if (snap->mapped) {
+        munmap((void *)snap->data, snap->size);
+    } else
+#endif
+    {
+        free((void *)snap->data);
+    }
+    free(snap);
+}
+
+static const char* snapshot_name(const snapshot_t *snap, uint64_t offset) {
+    return (const char *)snap->data + snap->names_offset + offset;
+}
+
+const char* snapshot_label(const snapshot_t *snap) {
+    return snapshot_name(snap, get_le64(snap->data + HDR_LABEL));
+}
+
+/*
+ * Re-histogram the snapshot: every file record goes to every histogram,
+ * which then carry the scan metadata of the original scan.
+ */
+void snapshot_fill(const snapshot_t *snap, histogram_t **hists, size_t count) {
+    const unsigned char *h = snap->data;
+    const unsigned char *rec = snap->data + snap->file_offset;
+    file_info_t info;
+
+    for (uint64_t i = 0; i < snap->file_count; i++, rec += SNAPSHOT_RECORD_SIZE) {
+        info.size = get_le64(rec);
+        info.allocated = info.size;    /* not recorded */
+        info.mtime = (time_t)(int64_t)get_le64(rec + 8);
+        info.ctime = (time_t)(int64_t)get_le64(rec + 16);
+        info.atime = (time_t)(int64_t)get_le64(rec + 24);
+        info.ino = get_le64(rec + 32);
+        info.dev = 0;
+        info.nlink = 1;
+        for (size_t j = 0; j < count; j++) {
+            histogram_add_file_info(hists[j], &info);
+        }
+    }
+
+    for (size_t j = 0; j < count; j++) {
+        hists[j]->scan_start_time = (time_t)(int64_t)get_le64(h + HDR_SCAN_START);
+        hists[j]->scan_end_time = (time_t)(int64_t)get_le64(h + HDR_SCAN_END);
+        hists[j]->error_count += get_le64(h + HDR_ERROR_COUNT);
+        hists[j]->directories_scanned += get_le64(h + HDR_DIRS_SCANNED);
+        snprintf(hists[j]->last_error, sizeof(hists[j]->last_error), "%s",
+                 snapshot_name(snap, get_le64(h + HDR_LAST_ERROR)));
+    }
+}
+
+/* ---- Reuse index for incremental scans ---- */
+
+/* A directory of the previous snapshot, sorted by (parent, name) */
+typedef struct {
+    uint64_t parent;
+    uint64_t id;
+    const char *name;
+    const unsigned char *rec;
+} index_dir_t;
+
+struct snapshot_index {
+    const snapshot_t *snap;
+    index_dir_t *dirs;          /* dir_count entries */
+    uint32_t *file_first;       /* per directory id: start in file_order; dir_count + 2 */
+    uint32_t *file_order;       /* file record numbers grouped by parent id */
+    time_t scan_start;
+};
+
+static int compare_index_dirs(const void *a, const void *b) {
+    const index_dir_t *da = (const index_dir_t *)a;
+    const index_dir_t *db = (const index_dir_t *)b;
+    if (da->parent != db->parent) return da->parent < db->parent ? -1 : 1;
+    return strcmp(da->name, db->name);
+}
+
+/*
+ * Index a snapshot for reuse by an incremental scan: directories by
+ * (parent, name) and files grouped by directory with a counting sort.
+ * Returns NULL if the snapshot is too large or its ids are inconsistent.
+ */
+snapshot_index_t* snapshot_index_create(const snapshot_t *snap) {
+    snapshot_index_t *idx;
+    uint64_t dirs = snap->dir_count;
+    uint64_t files = snap->file_count;
+
+    if (dirs >= UINT32_MAX - 2 || files >= UINT32_MAX) return NULL;
+
+    idx = calloc(1, sizeof(snapshot_index_t));
+    if (!idx) return NULL;
+    idx->snap = snap;
+    idx->scan_start = (time_t)(int64_t)get_le64(snap->data + HDR_SCAN_START);
+    idx->dirs = malloc(sizeof(index_dir_t) * (dirs ? dirs : 1));
+    idx->file_first = calloc((size_t)dirs + 2, sizeof(uint32_t));
+    idx->file_order = malloc(sizeof(uint32_t) * (files ? files : 1));
+    if (!idx->dirs || !idx->file_first || !idx->file_order) {
+        snapshot_index_destroy(idx);
+        return NULL;
+    }
+
+    for (uint64_t i = 0; i < dirs; i++) {
+        const unsigned char *rec = snap->data + snap->dir_offset + i * SNAPSHOT_RECORD_SIZE;
+        index_dir_t *d = &idx->dirs[i];
+        d->id = get_le64(rec);
+        d->parent = get_le64(rec + 8);
+        d->name = snapshot_name(snap, get_le64(rec + 40));
+        d->rec = rec;
+        /* Ids are dense (1..dir_count) in snapshots written by a scan */
+        if (d->id == 0 || d->id > dirs || d->parent > dirs) {
+            snapshot_index_destroy(idx);
+            return NULL;
+        }
+    }
+    qsort(idx->dirs, (size_t)dirs, sizeof(index_dir_t), compare_index_dirs);
+
+    /* Count files per parent, turn counts into starts, then place them */
+    for (uint64_t i = 0; i < files; i++) {
+        uint64_t parent = get_le64(snap->data + snap->file_offset + i * SNAPSHOT_RECORD_SIZE + 40);
+        if (parent <= dirs) idx->file_first[parent + 1]++;
+    }
+    for (uint64_t id = 1; id <= dirs + 1; id++) {
+        idx->file_first[id] += idx->file_first[id - 1];
+    }
+    {
+        uint32_t *next = malloc(sizeof(uint32_t) * ((size_t)dirs + 1));
+        if (!next) {
+            snapshot_index_destroy(idx);
+            return NULL;
+        }
+        memcpy(next, idx->file_first, sizeof(uint32_t) * ((size_t)dirs + 1));
+        for (uint64_t i = 0; i < files; i++) {
+            uint64_t parent = get_le64(snap->data + snap->file_offset +
+                                       i * SNAPSHOT_RECORD_SIZE + 40);
+            if (parent <= dirs) idx->file_order[next[parent]++] = (uint32_t)i;
+        }
+        free(next);
+    }
+    return idx;
+}
+
+void snapshot_index_destroy(snapshot_index_t *idx) {
+    if (!idx) return;
+    free(idx->dirs);
+    free(idx->file_first);
+    free(idx->file_order);
+    free(idx);
+}
+
+/* First position in dirs with (parent, name) >= the key (name NULL sorts first) */
+static size_t index_lower_bound(const snapshot_index_t *idx, uint64_t parent, const char *name) {
+    size_t lo = 0;
+    size_t hi = (size_t)idx->snap->dir_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const index_dir_t *d = &idx->dirs[mid];
+        int before = d->parent < parent ||
+                     (d->parent == parent && name && strcmp(d->name, name) < 0);
+        if (before) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+/* Directory references are positions in dirs plus one; 0 means not found */
+size_t snapshot_index_lookup(const snapshot_index_t *idx, size_t dir, const char *name) {
+    uint64_t parent = dir ? idx->dirs[dir - 1].id : 0;
+    size_t pos = index_lower_bound(idx, parent, name);
+    if (pos < idx->snap->dir_count && idx->dirs[pos].parent == parent &&
+        strcmp(idx->dirs[pos].name, name) == 0) {
+        return pos + 1;
+    }
+    return 0;
+}
+
+/*
+ * A directory can be reused when it is the same inode with the same mtime
+ * and ctime as before. A directory touched at or after the start of the
+ * previous scan may have changed after it was read within the same second,
+ * so it is always rescanned.
+ */
+int snapshot_index_unchanged(const snapshot_index_t *idx, size_t dir, const file_info_t *now) {
+    const unsigned char *rec = idx->dirs[dir - 1].rec;
+    return get_le64(rec + 16) == now->ino &&
+           (time_t)(int64_t)get_le64(rec + 24) == now->mtime &&
+           (time_t)(int64_t)get_le64(rec + 32) == now->ctime &&
+           now->mtime < idx->scan_start && now->ctime < idx->scan_start;
+}
+
+size_t snapshot_index_file_count(const snapshot_index_t *idx, size_t dir) {
+    uint64_t id = idx->dirs[dir - 1].id;
+    return idx->file_first[id + 1] - idx->file_first[id];
+}
+
+void snapshot_index_file(const snapshot_index_t *idx, size_t dir, size_t i, file_info_t *info) {
+    uint64_t id = idx->dirs[dir - 1].id;
+    uint64_t n = idx->file_order[idx->file_first[id] + i];
+    const unsigned char *rec = idx->snap->data + idx->snap->file_offset + n * SNAPSHOT_RECORD_SIZE;
+    info->size = get_le64(rec);
+    info->allocated = info->size;
+    info->mtime = (time_t)(int64_t)get_le64(rec + 8);
+    info->ctime = (time_t)(int64_t)get_le64(rec + 16);
+    info->atime = (time_t)(int64_t)get_le64(rec + 24);
+    info->ino = get_le64(rec + 32);
+    info->dev = 0;
+    info->nlink = 1;
+}
+
+/* Subdirectories of dir are consecutive in the sorted table */
+size_t snapshot_index_subdir_count(const snapshot_index_t *idx, size_t dir) {
+    uint64_t id = idx->dirs[dir - 1].id;
+    return index_lower_bound(idx, id + 1, NULL) - index_lower_bound(idx, id, NULL);
+}
+
+size_t snapshot_index_subdir(const snapshot_index_t *idx, size_t dir, size_t i,
+                             const char **name) {
+    size_t pos = index_lower_bound(idx, idx->dirs[dir - 1].id, NULL) + i;
+    *name = idx->dirs[pos].name;
+    return pos + 1;
+}
+
+/* ---- Directory walk in path order, for comparing snapshots ---- */
+
+/* A directory while the walk is being built, sorted by (parent, name) */
+typedef struct {
+    uint64_t parent;
+    uint64_t id;
+    const char *name;
+    uint32_t rec;
+} walk_dir_t;
+
+struct snapshot_walk {
+    const snapshot_t *snap;
+    uint32_t *order;        /* directory ids in walk order */
+    uint32_t *depth;        /* depth of each order entry, roots at 0 */
+    uint32_t *rec;          /* per id: directory record number */
+    uint64_t *totals;       /* per id: files, bytes, subtree files, subtree bytes */
+    size_t count;
+    size_t pos;
+    char *path;             /* path of the current directory */
+    size_t path_capacity;
+    size_t *path_len;       /* per depth: length of the path up to that level */
+    size_t depth_capacity;
+};
+
+static int compare_walk_dirs(const void *a, const void *b) {
+    const walk_dir_t *da = (const walk_dir_t *)a;
+    const walk_dir_t *db = (const walk_dir_t *)b;
+    if (da->parent != db->parent) return da->parent < db->parent ? -1 : 1;
+    return path_compare(da->name, db->name);
+}
+
+/* Depth-first order of the directory tree with children in path order */
+static int walk_build_order(snapshot_walk_t *walk, walk_dir_t *dirs, uint64_t dir_count) {
+    uint32_t *first = malloc(sizeof(uint32_t) * ((size_t)dir_count + 2));
+    uint32_t *stack = malloc(sizeof(uint32_t) * ((size_t)dir_count + 1) * 2);
+    size_t top = 0;
+
+    if (!first || !stack) {
+        free(first);
+        free(stack);
+        return -1;
+    }
+
+    /* first[p] .. first[p + 1] are the children of directory p */
+    for (uint64_t p = 0, i = 0; p <= dir_count + 1; p++) {
+        while (i < dir_count && dirs[i].parent < p) i++;
+        first[p] = (uint32_t)i;
+    }
+
+    /* Roots are pushed last-first so that they pop in order */
+    for (uint32_t i = first[1]; i > first[0]; i--) {
+        stack[top++] = i - 1;
+        stack[top++] = 0;
+    }
+    while (top > 0) {
+        uint32_t depth = stack[--top];
+        const walk_dir_t *d = &dirs[stack[--top]];
+
+        /* Duplicate or cyclic ids in a damaged snapshot are walked once */
+        if (walk->rec[d->id] != UINT32_MAX) continue;
+        walk->rec[d->id] = d->rec;
+        walk->order[walk->count] = (uint32_t)d->id;
+        walk->depth[walk->count] = depth;
+        walk->count++;
+
+        for (uint32_t i = first[d->id + 1]; i > first[d->id]; i--) {
+            stack[top++] = i - 1;
+            stack[top++] = depth + 1;
+        }
+    }
+
+    free(first);
+    free(stack);
+    return 0;
+}
+
+/*
+ * Prepare a walk over every directory reachable from the snapshot's roots,
+ * in path_compare() order, with the totals of the files directly
+ * inside each directory and of its whole subtree. Memory is proportional
+ * to the number of directories; file records are streamed once.
+ */
+snapshot_walk_t* snapshot_walk_create(const snapshot_t *snap) {
+    snapshot_walk_t *walk;
+    walk_dir_t *dirs;
+    uint64_t dir_count = snap->dir_count;
+
+    if (dir_count >= UINT32_MAX - 2) return NULL;
+
+    walk = calloc(1, sizeof(snapshot_walk_t));
+    if (!walk) return NULL;
+    walk->snap = snap;
+    walk->order = malloc(sizeof(uint32_t) * ((size_t)dir_count + 1));
+    walk->depth = malloc(sizeof(uint32_t) * ((size_t)dir_count + 1));
+    walk->rec = malloc(sizeof(uint32_t) * ((size_t)dir_count + 1));
+    walk->totals = calloc(((size_t)dir_count + 1) * 4, sizeof(uint64_t));
+    dirs = malloc(sizeof(walk_dir_t) * (dir_count ? dir_count : 1));
+    if (!walk->order || !walk->depth || !walk->rec || !walk->totals || !dirs) {
+        free(dirs);
+        snapshot_walk_destroy(walk);
+        return NULL;
+    }
+    memset(walk->rec, 0xff, sizeof(uint32_t) * ((size_t)dir_count + 1));
+
+    for (uint64_t i = 0; i < dir_count; i++) {
+        const unsigned char *rec = snap->data + snap->dir_offset + i * SNAPSHOT_RECORD_SIZE;
+        walk_dir_t *d = &dirs[i];
+        d->id = get_le64(rec);
+        d->parent = get_le64(rec + 8);
+        d->name = snapshot_name(snap, get_le64(rec + 40));
+        d->rec = (uint32_t)i;
+        if (d->id == 0 || d->id > dir_count || d->parent > dir_count) {
+            free(dirs);
+            snapshot_walk_destroy(walk);
+            return NULL;
+        }
+    }
+    qsort(dirs, (size_t)dir_count, sizeof(walk_dir_t), compare_walk_dirs);
+    if (walk_build_order(walk, dirs, dir_count) != 0) {
+        free(dirs);
+        snapshot_walk_destroy(walk);
+        return NULL;
+    }
+    free(dirs);
+
+    for (uint64_t i = 0; i < snap->file_count; i++) {
+        const unsigned char *rec = snap->data + snap->file_offset + i * SNAPSHOT_RECORD_SIZE;
+        uint64_t parent = get_le64(rec + 40);
+        if (parent == 0 || parent > dir_count) continue;
+        walk->totals[parent * 4] += 1;
+        walk->totals[parent * 4 + 1] += get_le64(rec);
+    }
+
+    /* Children come after their parent in walk order: roll up in reverse */
+    for (size_t i = 0; i < walk->count; i++) {
+        uint64_t *t = &walk->totals[(size_t)walk->order[i] * 4];
+        t[2] = t[0];
+        t[3] = t[1];
+    }
+    for (size_t i = walk->count; i > 0; i--) {
+        uint32_t id = walk->order[i - 1];
+        const unsigned char *rec = snap->data + snap->dir_offset +
+                                   (uint64_t)walk->rec[id] * SNAPSHOT_RECORD_SIZE;
+        uint64_t parent = get_le64(rec + 8);
+        if (walk->depth[i - 1] > 0) {
+            walk->totals[parent * 4 + 2] += walk->totals[(size_t)id * 4 + 2];
+            walk->totals[parent * 4 + 3] += walk->totals[(size_t)id * 4 + 3];
+        }
+    }
+    return walk;
+}
+
+void snapshot_walk_destroy(snapshot_walk_t *walk) {
+    if (!walk) return;
+    free(walk->order);
+    free(walk->depth);
+    free(walk->rec);
+    free(walk->totals);
+    free(walk->path);
+    free(walk->path_len);
+    free(walk);
+}
+
+/* Next directory of the walk: 1, or 0 once every directory was visited, -1 if out of memory */
+int snapshot_walk_next(snapshot_walk_t *walk, snapshot_dir_totals_t *dir) {
+    uint32_t id;
+    size_t depth;
+    size_t base;
+    size_t name_len;
+    const char *name;
+    const unsigned char *rec;
+
+    if (walk->pos >= walk->count) return 0;
+    id = walk->order[walk->pos];
+    depth = walk->depth[walk->pos];
+    walk->pos++;
+
+    rec = walk->snap->data + walk->snap->dir_offset + (uint64_t)walk->rec[id] * SNAPSHOT_RECORD_SIZE;
+    name = snapshot_name(walk->snap, get_le64(rec + 40));
+    name_len = strlen(name);
+
+    if (depth >= walk->depth_capacity) {
+        size_t capacity = walk->depth_capacity ? walk->depth_capacity * 2 : 64;
+        size_t *lens = realloc(walk->path_len, sizeof(size_t) * capacity);
+        if (!lens) return -1;
+        walk->path_len = lens;
+        walk->depth_capacity = capacity;
+    }
+    base = depth > 0 ? walk->path_len[depth - 1] : 0;
+    if (base + name_len + 2 > walk->path_capacity) {
+        size_t capacity = walk->path_capacity ? walk->path_capacity : 256;
+        char *path;
+        while (base + name_len + 2 > capacity) capacity *= 2;
+        path = realloc(walk->path, capacity);
+        if (!path) return -1;
+        walk->path = path;
+        walk->path_capacity = capacity;
+    }
+    if (depth > 0 && (base == 0 || walk->path[base - 1] != '/')) {
+        walk->path[base++] = '/';
+    }
+    memcpy(walk->path + base, name, name_len + 1);
+    walk->path_len[depth] = base + name_len;
+
+    dir->path = walk->path;
+    dir->files = walk->totals[(size_t)id * 4];
+    dir->bytes = walk->totals[(size_t)id * 4 + 1];
+    dir->tree_files = walk->totals[(size_t)id * 4 + 2];
+    dir->tree_bytes = walk->totals[(size_t)id * 4 + 3];
+    return 1;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# --stdin aggregate mode must keep a nested path that -x stops the outer
+# scan from reaching. Uses /dev and /dev/shm when they are separate
+# filesystems; skipped otherwise.
+
+DISKOGRAM=${DISKOGRAM:-./diskogram}
+OUTER=/dev
+INNER=/dev/shm
+
+if [ ! -d "$INNER" ] || [ ! -w "$INNER" ] ||
+   [ "$(stat -c %d "$OUTER" 2>/dev/null)" = "$(stat -c %d "$INNER" 2>/dev/null)" ]; then
+    echo "SKIP: $INNER is not a separate writable filesystem"
+    exit 0
+fi
+
+FILE=$(mktemp "$INNER/diskogram-test.XXXXXX") || exit 1
+trap 'rm -f "$FILE"' EXIT
+head -c 100000 /dev/zero > "$FILE"
+
+OUT=$(printf '%s\n%s\n' "$OUTER" "$INNER" | "$DISKOGRAM" --stdin -x --year --csv) || exit 1
+FILES=$(printf '%s\n' "$OUT" | grep -v '^#' | awk -F, 'NR > 1 { n += $3 } END { print n + 0 }')
+if [ "$FILES" -lt 1 ]; then
+    echo "FAIL: $INNER was dropped as covered by $OUTER under -x"
+    printf '%s\n' "$OUT"
+    exit 1
+fi
+echo "PASS"
@@ -0,0 +1,630 @@
+#include "diskogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+    #include <pthread.h>
+#endif
+
+/*
+ * Directory tree for --tree: a node per directory down to max_depth below
+ * each scanned path, holding the bytes of its files per bucket; files
+ * further down count toward their ancestor at max_depth. Nodes come from
+ * an arena in chunks and names are interned, so a node costs a few words
+ * besides its buckets.
+ *
+ * Buckets are kept per grouping mode at the finest requested interval,
+ * which every coarser bucket contains whole; the other intervals are
+ * rolled up from it on output. Scanning threads count into a tree_batch_t
+ * of their own and fold it into a node, under one of a set of striped
+ * locks, when they move on to another node. dir_tree_finish() then adds
+ * every node into its parent, deepest first, so that each node holds its
+ * whole subtree.
+ */
+
+#define TREE_LOCKS 64
+#define NODES_PER_CHUNK 256
+#define NAME_CHUNK_SIZE (64 * 1024)
+#define INITIAL_NAME_CAPACITY 256
+#define INITIAL_NODE_SUMS 8
+#define BATCH_SUMS 256          /* pending sums a batch folds in one go */
+#define BATCH_RECENT 8          /* pending sums checked for the same bucket */
+
+/* Totals of one bucket of one grouping mode */
+typedef struct {
+    time_t start;               /* bucket at the tree's interval */
+    size_t mode;                /* index into the tree's modes */
+    uint64_t bytes;
+    uint64_t allocated;
+    uint64_t files;             /* 0 = free slot in a node's table */
+} tree_sum_t;
+
+struct tree_node {
+    tree_node_t *parent;        /* NULL for scan roots */
+    tree_node_t *children;      /* in name order, linked by dir_tree_finish() */
+    tree_node_t *next;          /* next sibling */
+    const char *name;           /* interned; the scanned path at a root */
+    unsigned depth;             /* 0 at a root */
+    size_t id;                  /* picks the node's lock */
+    uint64_t directories;       /* directories read into this node */
+    tree_sum_t *sums;           /* open-addressing table on (mode, start) */
+    size_t sum_count;
+    size_t sum_capacity;        /* power of two, 0 before the first file */
+};
+
+typedef struct node_chunk {
+    struct node_chunk *next;
+    size_t used;
+    tree_node_t nodes[NODES_PER_CHUNK];
+} node_chunk_t;
+
+typedef struct name_chunk {
+    struct name_chunk *next;
+    size_t used;
+    size_t size;
+    char text[];
+} name_chunk_t;
+
+struct dir_tree {
+    unsigned max_depth;
+    grouping_mode_t modes[3];
+    size_t mode_count;
+    interval_t intervals[4];    /* reported intervals, in the order requested */
+    size_t interval_count;
+    interval_t interval;        /* finest of them, at which buckets are kept */
+    int disk_usage;
+    calendar_t *calendar;       /* for output; batches have their own */
+
+    node_chunk_t *chunks;       /* newest first */
+    size_t node_count;
+    tree_node_t **roots;        /* in the order scanned */
+    size_t root_count;
+    size_t root_capacity;
+    name_chunk_t *text;         /* newest first */
+    const char **names;         /* interned names, open addressing */
+    size_t name_count;
+    size_t name_capacity;       /* power of two */
+    int failed;                 /* some counts were lost for lack of memory */
+#ifndef _WIN32
+    pthread_mutex_t lock;       /* nodes, roots and names */
+    pthread_mutex_t sum_locks[TREE_LOCKS];
+#endif
+};
+
+struct tree_batch {
+    dir_tree_t *tree;
+    calendar_t *calendar;
+    tree_node_t *node;          /* the node pending counts belong to */
+    uint64_t directories;
+    tree_sum_t sums[BATCH_SUMS];
+    size_t count;
+};
+
+static uint64_t hash_sum(time_t start, size_t mode) {
+    uint64_t x = (uint64_t)start * 4 + mode;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* FNV-1a */
+static uint64_t hash_name(const char *name) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static time_t file_time(const file_info_t *info, grouping_mode_t mode) {
+    switch (mode) {
+        case GROUP_BY_CTIME: return info->ctime;
+        case GROUP_BY_ATIME: return info->atime;
+        case GROUP_BY_MTIME:
+        default:             return info->mtime;
+    }
+}
+
+dir_tree_t* dir_tree_create(unsigned max_depth, const grouping_mode_t *modes,
+                            size_t mode_count, const interval_t *intervals,
+                            size_t interval_count, int disk_usage) {
+    dir_tree_t *tree;
+
+    if (mode_count == 0 || mode_count > 3 || interval_count == 0 || interval_count > 4) {
+        return NULL;
+    }
+    tree = calloc(1, sizeof(dir_tree_t));
+    if (!tree) return NULL;
+    tree->names = calloc(INITIAL_NAME_CAPACITY, sizeof(const char *));
+    tree->calendar = calendar_create();
+    if (!tree->names || !tree->calendar) {
+        free(tree->names);
+        calendar_destroy(tree->calendar);
+        free(tree);
+        return NULL;
+    }
+    tree->name_capacity = INITIAL_NAME_CAPACITY;
+    tree->max_depth = max_depth;
+    memcpy(tree->modes, modes, sizeof(grouping_mode_t) * mode_count);
+    tree->mode_count = mode_count;
+    memcpy(tree->intervals, intervals, sizeof(interval_t) * interval_count);
+    tree->interval_count = interval_count;
+    tree->interval = intervals[0];
+    for (size_t i = 1; i < interval_count; i++) {
+        if (intervals[i] < tree->interval) tree->interval = intervals[i];
+    }
+    tree->disk_usage = disk_usage;
+#ifndef _WIN32
+    pthread_mutex_init(&tree->lock, NULL);
+    for (unsigned i = 0; i < TREE_LOCKS; i++) {
+        pthread_mutex_init(&tree->sum_locks[i], NULL);
+    }
+#endif
+    return tree;
+}
+
+void dir_tree_destroy(dir_tree_t *tree) {
+    if (!tree) return;
+    while (tree->chunks) {
+        node_chunk_t *chunk = tree->chunks;
+        tree->chunks = chunk->next;
+        for (size_t i = 0; i < chunk->used; i++) {
+            free(chunk->nodes[i].sums);
+        }
+        free(chunk);
+    }
+    while (tree->text) {
+        name_chunk_t *chunk = tree->text;
+        tree->text = chunk->next;
+        free(chunk);
+    }
+#ifndef _WIN32
+    pthread_mutex_destroy(&tree->lock);
+    for (unsigned i = 0; i < TREE_LOCKS; i++) {
+        pthread_mutex_destroy(&tree->sum_locks[i]);
+    }
+#endif
+    calendar_destroy(tree->calendar);
+    free(tree->roots);
+    free(tree->names);
+    free(tree);
+}
+
+/* A copy of str in the name arena; the caller holds tree->lock */
+static const char* text_copy(dir_tree_t *tree, const char *str) {
+    size_t len = strlen(str) + 1;
+    name_chunk_t *chunk = tree->text;
+    char *copy;
+
+    if (!chunk || chunk->size - chunk->used < len) {
+        size_t size = len > NAME_CHUNK_SIZE ? len : NAME_CHUNK_SIZE;
+        chunk = malloc(sizeof(name_chunk_t) + size);
+        if (!chunk) return NULL;
+        chunk->next = tree->text;
+        chunk->used = 0;
+        chunk->size = size;
+        tree->text = chunk;
+    }
+    copy = chunk->text + chunk->used;
+    memcpy(copy, str, len);
+    chunk->used += len;
+    return copy;
+}
+
+static int names_grow(dir_tree_t *tree) {
+    size_t capacity = tree->name_capacity * 2;
+    const char **names = calloc(capacity, sizeof(const char *));
+    if (!names) return -1;
+
+    for (size_t i = 0; i < tree->name_capacity; i++) {
+        const char *name = tree->names[i];
+        size_t slot;
+        if (!name) continue;
+        for (slot = hash_name(name) & (capacity - 1); names[slot];
+             slot = (slot + 1) & (capacity - 1)) {}
+        names[slot] = name;
+    }
+    free(tree->names);
+    tree->names = names;
+    tree->name_capacity = capacity;
+    return 0;
+}
+
+/* The one stored copy of name; the caller holds tree->lock */
+static const char* intern(dir_tree_t *tree, const char *name) {
+    size_t mask, slot;
+
+    if (tree->name_count * 2 >= tree->name_capacity && names_grow(tree) != 0) return NULL;
+    mask = tree->name_capacity - 1;
+    for (slot = hash_name(name) & mask; tree->names[slot]; slot = (slot + 1) & mask) {
+        if (strcmp(tree->names[slot], name) == 0) return tree->names[slot];
+    }
+    tree->names[slot] = text_copy(tree, name);
+    if (!tree->names[slot]) return NULL;
+    tree->name_count++;
+    return tree->names[slot];
+}
+
+/* A zeroed node from the arena; the caller holds tree->lock */
+static tree_node_t* node_alloc(dir_tree_t *tree) {
+    node_chunk_t *chunk = tree->chunks;
+    tree_node_t *node;
+
+    if (!chunk || chunk->used == NODES_PER_CHUNK) {
+        chunk = malloc(sizeof(node_chunk_t));
+        if (!chunk) return NULL;
+        chunk->next = tree->chunks;
+        chunk->used = 0;
+        tree->chunks = chunk;
+    }
+    node = &chunk->nodes[chunk->used++];
+    memset(node, 0, sizeof(tree_node_t));
+    node->id = tree->node_count++;
+    return node;
+}
+
+/* Node of a scanned path; NULL if out of memory */
+tree_node_t* dir_tree_add_root(dir_tree_t *tree, const char *path) {
+    tree_node_t *node = NULL;
+    const char *name;
+
+#ifndef _WIN32
+    pthread_mutex_lock(&tree->lock);
+#endif
+    if (tree->root_count == tree->root_capacity) {
+        size_t capacity = tree->root_capacity ? tree->root_capacity * 2 : 8;
+        tree_node_t **roots = realloc(tree->roots, sizeof(tree_node_t *) * capacity);
+        if (roots) {
+            tree->roots = roots;
+            tree->root_capacity = capacity;
+        }
+    }
+    if (tree->root_count < tree->root_capacity && (name = text_copy(tree, path)) != NULL &&
+        (node = node_alloc(tree)) != NULL) {
+        node->name = name;
+        tree->roots[tree->root_count++] = node;
+    }
+#ifndef _WIN32
+    pthread_mutex_unlock(&tree->lock);
+#endif
+    return node;
+}
+
+/*
+ * Node the files of subdirectory name of parent count toward: a new node
+ * above max_depth, parent itself below. NULL if out of memory.
+ */
+tree_node_t* dir_tree_child(dir_tree_t *tree, tree_node_t *parent, const char *name) {
+    tree_node_t *node = NULL;
+    const char *interned;
+
+    if (parent->depth >= tree->max_depth) return parent;
+#ifndef _WIN32
+    pthread_mutex_lock(&tree->lock);
+#endif
+    interned = intern(tree, name);
+    if (interned && (node = node_alloc(tree)) != NULL) {
+        node->parent = parent;
+        node->name = interned;
+        node->depth = parent->depth + 1;
+    }
+#ifndef _WIN32
+    pthread_mutex_unlock(&tree->lock);
+#endif
+    return node;
+}
+
+static int node_grow(tree_node_t *node) {
+    size_t capacity = node->sum_capacity ? node->sum_capacity * 2 : INITIAL_NODE_SUMS;
+    tree_sum_t *sums = calloc(capacity, sizeof(tree_sum_t));
+    if (!sums) return -1;
+
+    for (size_t i = 0; i < node->sum_capacity; i++) {
+        const tree_sum_t *sum = &node->sums[i];
+        size_t slot;
+        if (sum->files == 0) continue;
+        for (slot = hash_sum(sum->start, sum->mode) & (capacity - 1); sums[slot].files != 0;
+             slot = (slot + 1) & (capacity - 1)) {}
+        sums[slot] = *sum;
+    }
+    free(node->sums);
+    node->sums = sums;
+    node->sum_capacity = capacity;
+    return 0;
+}
+
+/* Add sum into the node's bucket; the caller holds the node's lock */
+static int node_add(tree_node_t *node, const tree_sum_t *sum) {
+    size_t mask, slot;
+
+    if (node->sum_count * 2 >= node->sum_capacity && node_grow(node) != 0) return -1;
+    mask = node->sum_capacity - 1;
+    for (slot = hash_sum(sum->start, sum->mode) & mask; node->sums[slot].files != 0;
+         slot = (slot + 1) & mask) {
+        tree_sum_t *found = &node->sums[slot];
+        if (found->start == sum->start && found->mode == sum->mode) {
+            found->bytes += sum->bytes;
+            found->allocated += sum->allocated;
+            found->files += sum->files;
+            return 0;
+        }
+    }
+    node->sums[slot] = *sum;
+    node->sum_count++;
+    return 0;
+}
+
+tree_batch_t* tree_batch_create(dir_tree_t *tree) {
+    tree_batch_t *batch = malloc(sizeof(tree_batch_t));
+    if (!batch) return NULL;
+    batch->calendar = calendar_create();
+    if (!batch->calendar) {
+        free(batch);
+        return NULL;
+    }
+    batch->tree = tree;
+    batch->node = NULL;
+    batch->directories = 0;
+    batch->count = 0;
+    return batch;
+}
+
+/* Move the pending counts into their node */
+static void batch_fold(tree_batch_t *batch) {
+    tree_node_t *node = batch->node;
+    int failed = 0;
+
+    if (!node || (batch->count == 0 && batch->directories == 0)) return;
+#ifndef _WIN32
+    pthread_mutex_t *lock = &batch->tree->sum_locks[node->id % TREE_LOCKS];
+    pthread_mutex_lock(lock);
+#endif
+    node->directories += batch->directories;
+    for (size_t i = 0; i < batch->count; i++) {
+        if (node_add(node, &batch->sums[i]) != 0) failed = 1;
+    }
+#ifndef _WIN32
+    pthread_mutex_unlock(lock);
+#endif
+    if (failed) {
+#ifdef _WIN32
+        batch->tree->failed = 1;    /* the Win32 walker is single-threaded */
+#else
+        __atomic_store_n(&batch->tree->failed, 1, __ATOMIC_RELAXED);
+#endif
+    }
+    batch->directories = 0;
+    batch->count = 0;
+}
+
+void tree_batch_destroy(tree_batch_t *batch) {
+    if (!batch) return;
+    batch_fold(batch);
+    calendar_destroy(batch->calendar);
+    free(batch);
+}
+
+static void batch_switch(tree_batch_t *batch, tree_node_t *node) {
+    batch_fold(batch);
+    batch->node = node;
+}
+
+void tree_batch_add_dir(tree_batch_t *batch, tree_node_t *node) {
+    if (!node) return;
+    if (node != batch->node) batch_switch(batch, node);
+    batch->directories++;
+}
+
+/* Pending sum of a bucket; files of one directory mostly share a few */
+static tree_sum_t* batch_sum(tree_batch_t *batch, size_t mode, time_t start) {
+    size_t recent = batch->count > BATCH_RECENT ? batch->count - BATCH_RECENT : 0;
+    tree_sum_t *sum;
+
+    for (size_t i = batch->count; i-- > recent;) {
+        sum = &batch->sums[i];
+        if (sum->start == start && sum->mode == mode) return sum;
+    }
+    if (batch->count == BATCH_SUMS) batch_fold(batch);
+    sum = &batch->sums[batch->count++];
+    sum->start = start;
+    sum->mode = mode;
+    sum->bytes = 0;
+    sum->allocated = 0;
+    sum->files = 0;
+    return sum;
+}
+
+void tree_batch_add_file(tree_batch_t *batch, tree_node_t *node, const file_info_t *info) {
+    const dir_tree_t *tree = batch->tree;
+
+    if (!node) return;
+    if (node != batch->node) batch_switch(batch, node);
+    for (size_t m = 0; m < tree->mode_count; m++) {
+        time_t start = calendar_bucket_start(batch->calendar, file_time(info, tree->modes[m]),
+                                             tree->interval);
+        tree_sum_t *sum = batch_sum(batch, m, start);
+        sum->bytes += info->size;
+        sum->allocated += info->allocated;
+        sum->files++;
+    }
+}
+
+static int compare_depth_desc(const void *a, const void *b) {
+    unsigned da = (*(tree_node_t *const *)a)->depth;
+    unsigned db = (*(tree_node_t *const *)b)->depth;
+    return da > db ? -1 : da < db ? 1 : 0;
+}
+
+static int compare_node_names(const void *a, const void *b) {
+    return strcmp((*(tree_node_t *const *)a)->name, (*(tree_node_t *const *)b)->name);
+}
+
+/*
+ * Roll every node up into its parent and link children in name order.
+ * Call once, after every batch has been destroyed. Returns -1 if counts
+ * were lost for lack of memory; the tree is still usable.
+ */
+int dir_tree_finish(dir_tree_t *tree) {
+    tree_node_t **nodes;
+    size_t count = 0;
+
+    if (tree->node_count == 0) return tree->failed ? -1 : 0;
+    nodes = malloc(sizeof(tree_node_t *) * tree->node_count);
+    if (!nodes) return -1;
+    for (node_chunk_t *chunk = tree->chunks; chunk; chunk = chunk->next) {
+        for (size_t i = 0; i < chunk->used; i++) {
+            nodes[count++] = &chunk->nodes[i];
+        }
+    }
+
+    /* Deepest first, so each node is complete before it is added to its parent */
+    qsort(nodes, count, sizeof(tree_node_t *), compare_depth_desc);
+    for (size_t i = 0; i < count; i++) {
+        tree_node_t *node = nodes[i];
+        if (!node->parent) continue;
+        node->parent->directories += node->directories;
+        for (size_t s = 0; s < node->sum_capacity; s++) {
+            if (node->sums[s].files != 0 && node_add(node->parent, &node->sums[s]) != 0) {
+                tree->failed = 1;
+            }
+        }
+    }
+
+    /* Pushed in reverse, each parent's children end up in name order */
+    qsort(nodes, count, sizeof(tree_node_t *), compare_node_names);
+    for (size_t i = count; i-- > 0;) {
+        tree_node_t *node = nodes[i];
+        if (!node->parent) continue;
+        node->next = node->parent->children;
+        node->parent->children = node;
+    }
+    free(nodes);
+    return tree->failed ? -1 : 0;
+}
+
+static int compare_sum_starts(const void *a, const void *b) {
+    time_t sa = ((const tree_sum_t *)a)->start;
+    time_t sb = ((const tree_sum_t *)b)->start;
+    return sa < sb ? -1 : sa > sb ? 1 : 0;
+}
+
+/* Finalized histogram of a node's subtree for one mode and interval */
+static histogram_t* node_histogram(dir_tree_t *tree, const tree_node_t *node, size_t mode,
+                                   interval_t interval, const histogram_t *meta) {
+    histogram_t *hist = histogram_create(interval);
+    tree_sum_t *sums = NULL;
+    size_t count = 0;
+
+    if (!hist) return NULL;
+    if (node->sum_count > 0) {
+        sums = malloc(sizeof(tree_sum_t) * node->sum_count);
+        if (!sums) {
+            histogram_destroy(hist);
+            return NULL;
+        }
+    }
+    for (size_t s = 0; s < node->sum_capacity; s++) {
+        if (node->sums[s].files == 0 || node->sums[s].mode != mode) continue;
+        sums[count] = node->sums[s];
+        if (interval != tree->interval) {
+            sums[count].start = calendar_bucket_start(tree->calendar, sums[count].start,
+                                                      interval);
+        }
+        count++;
+    }
+    if (count > 1) qsort(sums, count, sizeof(tree_sum_t), compare_sum_starts);
+
+    for (size_t s = 0; s < count; s++) {
+        time_bucket_t *bucket;
+
+        if (hist->bucket_count > 0 &&
+            hist->buckets[hist->bucket_count - 1].start_time == sums[s].start) {
+            bucket = &hist->buckets[hist->bucket_count - 1];
+        } else {
+            if (hist->bucket_count == hist->bucket_capacity) {
+                size_t capacity = hist->bucket_capacity * 2;
+                time_bucket_t *buckets = realloc(hist->buckets, sizeof(time_bucket_t) * capacity);
+                if (!buckets) {
+                    free(sums);
+                    histogram_destroy(hist);
+                    return NULL;
+                }
+                hist->buckets = buckets;
+                hist->bucket_capacity = capacity;
+            }
+            bucket = &hist->buckets[hist->bucket_count++];
+            memset(bucket, 0, sizeof(time_bucket_t));
+            bucket->start_time = sums[s].start;
+        }
+        bucket->total_bytes += sums[s].bytes;
+        bucket->allocated_bytes += sums[s].allocated;
+        bucket->file_count += sums[s].files;
+        hist->total_bytes += sums[s].bytes;
+        hist->total_allocated += sums[s].allocated;
+        hist->total_files += sums[s].files;
+    }
+    free(sums);
+
+    hist->mode = tree->modes[mode];
+    hist->disk_usage = tree->disk_usage;
+    hist->directories_scanned = node->directories;
+    if (meta) {
+        hist->scan_start_time = meta->scan_start_time;
+        hist->scan_end_time = meta->scan_end_time;
+        if (!node->parent) {
+            /* Errors are not traced to directories; the scan roots report them */
+            hist->error_count = meta->error_count;
+            memcpy(hist->last_error, meta->last_error, sizeof(hist->last_error));
+        }
+    }
+    histogram_link_tops(hist);
+    return hist;
+}
+
+static void visit_node(dir_tree_t *tree, const tree_node_t *node, const char *path,
+                       const histogram_t *meta, batch_result_fn fn, void *ctx) {
+    histogram_t *hists[MAX_SCAN_HISTOGRAMS];
+    size_t count = 0;
+
+    for (size_t m = 0; m < tree->mode_count; m++) {
+        for (size_t i = 0; i < tree->interval_count; i++) {
+            histogram_t *hist = node_histogram(tree, node, m, tree->intervals[i], meta);
+            if (!hist) {
+                fprintf(stderr, "Error: out of memory\n");
+                continue;
+            }
+            hists[count++] = hist;
+        }
+    }
+    fn(ctx, path, hists, count, 0);
+
+    for (const tree_node_t *child = node->children; child; child = child->next) {
+        size_t path_len = strlen(path);
+        size_t name_len = strlen(child->name);
+        int need_sep = path_len > 0 && path[path_len - 1] != PATH_SEPARATOR;
+        char *child_path = malloc(path_len + need_sep + name_len + 1);
+        if (!child_path) {
+            fprintf(stderr, "Error: out of memory\n");
+            continue;
+        }
+        memcpy(child_path, path, path_len);
+        if (need_sep) child_path[path_len] = PATH_SEPARATOR;
+        memcpy(child_path + path_len + need_sep, child->name, name_len + 1);
+        visit_node(tree, child, child_path, meta, fn, ctx);
+        free(child_path);
+    }
+}
+
+/*
+ * Hand every node to fn, depth-first with children in name order, as its
+ * histograms per mode x interval (mode-major). Scan times come from meta,
+ * as do the errors, which are reported at the roots. Call after
+ * dir_tree_finish().
+ */
+void dir_tree_visit(dir_tree_t *tree, const histogram_t *meta, batch_result_fn fn, void *ctx) {
+    for (size_t r = 0; r < tree->root_count; r++) {
+        visit_node(tree, tree->roots[r], tree->roots[r]->name, meta, fn, ctx);
+    }
+}
@@ -0,0 +1,257 @@
+#include "diskogram.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Minimal io_uring driver for batched statx, talking to the kernel through
+ * raw syscalls so no liburing is needed. Only what the scanner uses is
+ * implemented: queue STATX requests, submit, and reap completions.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #define HAVE_IO_URING 1
+    #endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct uring {
+    int fd;
+
+    /* Submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;     /* entries queued but not yet published */
+    unsigned sq_unsubmitted;
+
+    /* Completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Mappings, for teardown */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* IORING_OP_STATX needs Linux 5.6; ask the kernel rather than guess */
+static int probe_statx(int fd) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int supported = 0;
+
+    if (!probe) return 0;
+    if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        probe->last_op >= IORING_OP_STATX) {
+        supported = (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+    free(probe);
+    return supported;
+}
+
+uring_t* uring_create(unsigned entries) {
+    struct io_uring_params params;
+    uring_t *ring = calloc(1, sizeof(uring_t));
+    if (!ring) return NULL;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    if (!probe_statx(ring->fd)) {
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto fail_close;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) goto fail_sq;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail_cq;
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    return ring;
+
+fail_cq:
+    if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+fail_sq:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+fail_close:
+    close(ring->fd);
+    free(ring);
+    return NULL;
+}
+
+void uring_destroy(uring_t *ring) {
+    if (!ring) return;
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+int uring_queue_statx(uring_t *ring, int dirfd, const char *name, int flags,
+                      unsigned mask, void *statx_buf, uint64_t user_data) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) return -1;
+
+    unsigned idx = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (uint64_t)(uintptr_t)name;
+    sqe->len = mask;
+    sqe->off = (uint64_t)(uintptr_t)statx_buf;
+    sqe->statx_flags = (uint32_t)flags;
+    sqe->user_data = user_data;
+
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    ring->sq_unsubmitted++;
+    return 0;
+}
+
+unsigned uring_unsubmitted(const uring_t *ring) {
+    return ring->sq_unsubmitted;
+}
+
+int uring_submit(uring_t *ring, unsigned wait_nr) {
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    for (;;) {
+        int ret = sys_io_uring_enter(ring->fd, ring->sq_unsubmitted, wait_nr, flags);
+        if (ret >= 0) {
+            ring->sq_unsubmitted -= (unsigned)ret < ring->sq_unsubmitted ?
+                                    (unsigned)ret : ring->sq_unsubmitted;
+            return 0;
+        }
+        if (errno != EINTR) return -1;
+    }
+}
+
+/*
+ * Withdraw the most recently queued request the kernel has not taken, e.g.
+ * after uring_submit() failed. Returns 1 with its user_data, 0 if none.
+ */
+int uring_take_unsubmitted(uring_t *ring, uint64_t *user_data) {
+    if (ring->sq_unsubmitted == 0) return 0;
+    ring->sq_local_tail--;
+    ring->sq_unsubmitted--;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    *user_data = ring->sqes[ring->sq_local_tail & ring->sq_mask].user_data;
+    return 1;
+}
+
+int uring_next_completion(uring_t *ring, uint64_t *user_data, int *result) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    *user_data = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+#else /* !HAVE_IO_URING */
+
+uring_t* uring_create(unsigned entries) {
+    (void)entries;
+    return NULL;
+}
+
+void uring_destroy(uring_t *ring) {
+    (void)ring;
+}
+
+int uring_queue_statx(uring_t *ring, int dirfd, const char *name, int flags,
+                      unsigned mask, void *statx_buf, uint64_t user_data) {
+    (void)ring; (void)dirfd; (void)name; (void)flags;
+    (void)mask; (void)statx_buf; (void)user_data;
+    return -1;
+}
+
+unsigned uring_unsubmitted(const uring_t *ring) {
+    (void)ring;
+    return 0;
+}
+
+int uring_submit(uring_t *ring, unsigned wait_nr) {
+    (void)ring;
+    (void)wait_nr;
+    return -1;
+}
+
+int uring_take_unsubmitted(uring_t *ring, uint64_t *user_data) {
+    (void)ring; (void)user_data;
+    return 0;
+}
+
+int uring_next_completion(uring_t *ring, uint64_t *user_data, int *result) {
+    (void)ring; (void)user_data; (void)result;
+    return 0;
+}
+
+#endif /* HAVE_IO_URING */